@@ -146,6 +146,13 @@
  */
 #define 	DEFAULT_API_PORT        		80
 
+/**
+ * Default size quota (in megabytes) of the image cache. When the cache grows
+ * above it, the least recently used images that are not pinned are removed.
+ * It can be changed with the "cacheQuota" key of the global configuration.
+ */
+#define 	DEFAULT_CACHE_QUOTA				20480
+
 ///////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////
 ////
@@ -178,6 +185,20 @@
  */
 #define 	SESSION_HEAL_TRIES				2
 
+/**
+ * Deadline (in milliseconds) of the session actions that drive the hypervisor.
+ * An action still running after that is considered stuck and its commands
+ * are cancelled, so the session can go through the error handling.
+ */
+#define 	SESSION_HANDLER_TIMEOUT			180000
+
+/**
+ * How long (in milliseconds) the FSM journal of a session remains valid.
+ * A session opened within that time after being interrupted in the middle
+ * of a transition resumes from the last completed step.
+ */
+#define 	SESSION_JOURNAL_EXPIRE			600000
+
 
 ///////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////
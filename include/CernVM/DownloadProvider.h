@@ -47,11 +47,33 @@
  */
 #define DP_THROTTLE_TIMER   250
 
+/**
+ * How much downloaded data (in bytes) can wait in memory for the extraction
+ * before the transfer is paused
+ */
+#define DP_PIPE_BUFFER_SIZE 0x800000
+
+/**
+ * How often (in bytes) the state of a resumable download is saved, so it can
+ * be resumed even if the process is terminated
+ */
+#define DP_RESUME_SAVE_INTERVAL 0x1000000
+
+/**
+ * Segmented downloads: the default number of parallel connections (1 disables
+ * the segmented mode), the smallest segment size (in bytes) and how many times
+ * a broken segment is continued before giving up
+ */
+#define DP_SEGMENTS_DEFAULT 1
+#define DP_SEGMENT_MIN_SIZE 0x800000
+#define DP_SEGMENT_RETRIES  3
+
 /**
  * Forward decleration of pointer types
  */
 class DownloadProvider; 
 class CURLProvider; 
+class DownloadInflatePipe;
 typedef boost::shared_ptr< DownloadProvider >       DownloadProviderPtr;
 typedef boost::shared_ptr< CURLProvider >           CURLProviderPtr;
 
@@ -62,7 +84,7 @@ class DownloadProvider {
 public:
     
     // Constructor & Destructor
-    DownloadProvider()          { };
+    DownloadProvider() : segments(DP_SEGMENTS_DEFAULT) { };
     virtual ~DownloadProvider() { };
     
     // Public interface
@@ -70,6 +92,24 @@ public:
     virtual int                 downloadText( const std::string &URL, std::string *buffer, const VariableTaskPtr& pf = VariableTaskPtr() ) = 0;
     virtual DownloadProviderPtr clone() = 0;
 
+    // Download a file and get its sha256 signature. The providers that can,
+    // hash the data while writing them, so no extra pass on the file is needed,
+    // and resume the interrupted downloads of the same file.
+    virtual int                 downloadFileSHA256( const std::string &URL, const std::string &destination, std::string * checksum, const VariableTaskPtr& pf = VariableTaskPtr() );
+
+    // Download a gzip-compressed file, extract it to the destination and get the
+    // sha256 signature of the compressed data. The providers that can, extract
+    // the data while downloading them, so the compressed file is never stored.
+    virtual int                 downloadFileGZ( const std::string &URL, const std::string &destination, std::string * checksum, const VariableTaskPtr& pf = VariableTaskPtr() );
+
+    // Download a file over many parallel connections, each one fetching a
+    // different range of it. The providers that cannot, download it normally.
+    virtual int                 downloadFileSegmented( const std::string &URL, const std::string &destination, int numSegments, const VariableTaskPtr& pf = VariableTaskPtr() );
+
+    // Number of parallel connections downloadFile uses for the big files
+    void                        setSegments( int numSegments ) { this->segments = numSegments; };
+    int                         getSegments() { return segments; };
+
     // Abort flag
     virtual int                 abort() = 0;
     virtual int                 abortAll() = 0;
@@ -80,7 +120,12 @@ public:
 
     // Helper functions
     static void                 fireProgressEvent( const VariableTaskPtr& pf, size_t pos, size_t max );
-    static void                 writeToStream( std::ostream * stream, const VariableTaskPtr& pf, long max_size, const char * ptr, size_t data );
+    static void                 writeToStream( std::ostream * stream, const VariableTaskPtr& pf, long max_size, const char * ptr, size_t data, SHA256Stream * digest = NULL );
+
+protected:
+
+    // Configuration
+    int                         segments;
 
 };
 
@@ -91,7 +136,7 @@ class CURLProvider : public DownloadProvider {
 public:
 
     // Constructor & Destructor
-    CURLProvider() : DownloadProvider(), pf(), fStream(), sStream() {
+    CURLProvider() : DownloadProvider(), pf(), fStream(), sStream(), digest(NULL), pipe(NULL), partFile(), partURL(), partValidator(), partOffset(0), partSaved(0), httpStatus(0), httpETag(), httpModified() {
         CRASH_REPORT_BEGIN;
 
         // Initialize global CURL
@@ -124,7 +169,13 @@ public:
     // Curl I/O
     virtual int                 downloadFile( const std::string &URL, const std::string &destination, const VariableTaskPtr& pf = VariableTaskPtr()  ) ;
     virtual int                 downloadText( const std::string &URL, std::string *buffer, const VariableTaskPtr& pf = VariableTaskPtr() );
+    virtual int                 downloadFileSHA256( const std::string &URL, const std::string &destination, std::string * checksum, const VariableTaskPtr& pf = VariableTaskPtr() );
+    virtual int                 downloadFileGZ( const std::string &URL, const std::string &destination, std::string * checksum, const VariableTaskPtr& pf = VariableTaskPtr() );
+    virtual int                 downloadFileSegmented( const std::string &URL, const std::string &destination, int numSegments, const VariableTaskPtr& pf = VariableTaskPtr() );
     virtual DownloadProviderPtr clone();
+
+    // Download a file over a single connection
+    int                         downloadFileSingle( const std::string &URL, const std::string &destination, const VariableTaskPtr& pf = VariableTaskPtr() );
     virtual int                 abort();
     virtual int                 abortAll();
 
@@ -137,6 +188,20 @@ public:
     int                         operationInstances;
     std::ofstream               fStream;
     std::ostringstream          sStream;
+    SHA256Stream *              digest;
+    DownloadInflatePipe *       pipe;
+
+    // Resumable download state. The partial data are kept in partFile and the
+    // transfer continues from partOffset if the server's copy is still the
+    // one in partValidator (ETag or Last-Modified).
+    std::string                 partFile;
+    std::string                 partURL;
+    std::string                 partValidator;
+    long long                   partOffset;
+    long long                   partSaved;
+    int                         httpStatus;
+    std::string                 httpETag;
+    std::string                 httpModified;
     
 };
 
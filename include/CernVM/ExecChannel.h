@@ -0,0 +1,131 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef EXECCHANNEL_H
+#define EXECCHANNEL_H
+
+#include <CernVM/Utilities.h>
+#include <CernVM/CrashReport.h>
+
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+/**
+ * The shell used as the command co-process
+ */
+#define EXEC_CHANNEL_SHELL  "/bin/sh"
+
+/**
+ * Forward decleration of pointer types
+ */
+class ExecChannel;
+typedef boost::shared_ptr< ExecChannel >            ExecChannelPtr;
+
+/**
+ * A persistent command channel to a long-lived co-process.
+ *
+ * Instead of forking the (usually quite heavy) host process for every command,
+ * the commands are written to a light-weight shell that stays alive for the
+ * lifetime of the channel. The shell launches the binary and reports back the
+ * output and the exit code of every command, separated with a unique marker.
+ *
+ * Note that the binary itself is still started for every command (VBoxManage
+ * has no batch or interactive mode), so the channel only saves the cost of
+ * forking the host process and setting up the pipes, not the start-up time
+ * of the binary.
+ *
+ * It is meant to be used as a sysExecHandler: If the channel cannot be used
+ * (not supported, busy or failed to start) it returns SYSEXEC_FALLBACK and
+ * the command is forked & executed as usual.
+ */
+class ExecChannel {
+public:
+
+    /**
+     * Create a channel that executes the specified binary
+     */
+    ExecChannel                 ( const std::string& app );
+
+    /**
+     * Destructor that terminates the co-process
+     */
+    virtual ~ExecChannel        ( );
+
+    /**
+     * Start the co-process if it's not already running
+     */
+    bool                        open        ( );
+
+    /**
+     * Terminate the co-process
+     */
+    void                        close       ( );
+
+    /**
+     * Check if the co-process is running
+     */
+    bool                        isOpen      ( );
+
+    /**
+     * Run the specified command-line through the channel. This function has the
+     * same signature as the sysExecHandler, so it can be passed to sysExec().
+     */
+    int                         execute     ( const std::string& app, const std::string& cmdline, std::vector<std::string> * stdoutList, std::string * rawStderr, const SysExecConfig& config );
+
+private:
+
+    /**
+     * The binary to launch
+     */
+    std::string                 app;
+
+    /**
+     * Mutex that serializes the commands sent over the channel
+     */
+    boost::mutex                channelMutex;
+
+    /**
+     * Sequence number used for building the command markers
+     */
+    unsigned long               sequence;
+
+#ifndef _WIN32
+
+    /**
+     * The PID of the co-process
+     */
+    pid_t                       pid;
+
+    /**
+     * The descriptors for the STDIN, STDOUT and STDERR of the co-process
+     */
+    int                         fdIn;
+    int                         fdOut;
+    int                         fdErr;
+
+#endif
+
+};
+
+#endif /* end of include guard: EXECCHANNEL_H */
@@ -0,0 +1,171 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef FILEWATCH_H
+#define FILEWATCH_H
+
+#include <CernVM/Utilities.h>
+#include <CernVM/CrashReport.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+/**
+ * How often (in milliseconds) the files are checked when
+ * there is no native notification mechanism.
+ */
+#define FILEWATCH_POLL_INTERVAL     1000
+
+/**
+ * Forward decleration of pointer types
+ */
+class FileWatch;
+typedef boost::shared_ptr< FileWatch >              FileWatchPtr;
+
+/**
+ * Callback fired when a watched file is created, modified, renamed or removed
+ */
+typedef boost::function< void ( const std::string& ) >  callbackFileChanged;
+
+/**
+ * A file-watch subsystem that notifies the listeners when the files
+ * they are interested in are changed.
+ *
+ * On linux it uses inotify on the directory of every watched file, so
+ * the file can also be created, rotated or removed. On the other platforms,
+ * or if a directory cannot be watched (ex. it does not exist yet), it falls
+ * back to checking the modification time every FILEWATCH_POLL_INTERVAL ms.
+ *
+ * The callbacks are fired from the watcher thread.
+ */
+class FileWatch {
+public:
+
+    /**
+     * Create a watcher (the thread is started on demand)
+     */
+    FileWatch                   ( int pollInterval = FILEWATCH_POLL_INTERVAL );
+
+    /**
+     * Destructor that stops the watcher thread
+     */
+    virtual ~FileWatch          ( );
+
+    /**
+     * Get the system-wide watcher singleton
+     */
+    static FileWatchPtr         Default     ( );
+
+    /**
+     * Start watching the specified file and return the watch ID
+     */
+    int                         watch       ( const std::string& file, const callbackFileChanged& cb );
+
+    /**
+     * Stop watching. When this function returns, the callback
+     * of the watch is not running and it will not be called again.
+     */
+    void                        unwatch     ( int id );
+
+private:
+
+    /**
+     * A watched file
+     */
+    struct Watch {
+        std::string             file;
+        std::string             dir;
+        std::string             name;
+        callbackFileChanged     callback;
+        long long               fileTime;
+        long long               fileSize;
+        int                     wd;
+    };
+
+    /**
+     * Watcher thread main loop
+     */
+    void                        watchLoop   ( );
+
+    /**
+     * Try to start native watching for the given entry
+     * (must be called with watchMutex locked)
+     */
+    void                        addNative   ( Watch& w );
+
+    /**
+     * Stop native watching for the given entry
+     * (must be called with watchMutex locked)
+     */
+    void                        removeNative( Watch& w );
+
+    /**
+     * Wake-up the watcher thread
+     */
+    void                        wakeUp      ( );
+
+    /**
+     * Check the modification time and size of the entries (all of them, or only
+     * the ones not watched natively) and collect the ones that have changed
+     * (must be called with watchMutex locked)
+     */
+    void                        pollChanges ( std::vector<int>& ids, bool all );
+
+    /**
+     * Fire the callbacks of the specified watches
+     */
+    void                        fire        ( const std::vector<int>& ids );
+
+    // Configuration
+    int                         pollInterval;
+
+    // The watched files
+    std::map< int, Watch >      watches;
+    int                         lastID;
+
+    // Thread state
+    bool                        stopping;
+    boost::thread *             thread;
+    boost::mutex                watchMutex;
+    boost::condition_variable   watchCond;
+
+    // Held while the callbacks are running
+    boost::recursive_mutex      fireMutex;
+
+#ifdef __linux__
+    // The inotify descriptor, the wake-up pipe and the
+    // number of watches on every watched directory.
+    int                         fdNotify;
+    int                         fdWake[2];
+    std::map< int, int >        dirRefs;
+#endif
+
+};
+
+#endif /* end of include guard: FILEWATCH_H */
@@ -31,6 +31,10 @@
 
 #include <CernVM/ProgressFeedback.h>
 #include <CernVM/DownloadProvider.h>
+#include <CernVM/ImageCache.h>
+#include <CernVM/ExecChannel.h>
+#include <CernVM/SimpleFSM.h>
+#include <CernVM/SysExecPool.h>
 #include <CernVM/Utilities.h>
 #include <CernVM/CrashReport.h>
 #include <CernVM/ParameterMap.h>
@@ -450,6 +454,11 @@ public:
      */
     std::string             dirDataCache;
 
+    /**
+     * The downloaded disk images, stored under their checksum in dirDataCache
+     */
+    ImageCachePtr           imageCache;
+
     /**
      * HACK: The last STDERR buffer from the exec() function
      */
@@ -469,6 +478,11 @@ public:
      */
     std::list< HVSessionPtr > openSessions;
 
+    /**
+     * Mutex that protects the openSessions list
+     */
+    boost::recursive_mutex  openSessionsMutex;
+
     /**
      * The map of session UUIDs and their object instance
      */
@@ -539,6 +553,12 @@ public:
      */
     virtual int             getUsage            ( HVINFO_RES * usage);
 
+    /**
+     * Update the state of all the open sessions. The hypervisor implementations
+     * should gather the information with as few hypervisor calls as possible.
+     */
+    virtual int             refreshAll          ( );
+
     /**
      * Immediately abort current task and reap all sessions
      */
@@ -555,6 +575,13 @@ public:
      */
     int                     exec                ( std::string args, std::vector<std::string> * stdoutList, std::string * stderrMsg, const SysExecConfig& config );
 
+    /**
+     * Schedule the execution of the hypervisor binary in the system-wide SysExecPool,
+     * so that independent commands can run in parallel. The results can be collected
+     * either through the returned job or through the callback.
+     */
+    SysExecJobPtr           execAsync           ( std::string args, const SysExecConfig& config, const callbackSysExec& cb = callbackSysExec() );
+
     /**
      * Download an arbitrary file and validate it against a checksum
      * file, both provided as URLs
@@ -568,11 +595,17 @@ public:
     int                     downloadFile        ( const std::string & fileURL, const std::string & checksumString, std::string * filename, const FiniteTaskPtr & pf = FiniteTaskPtr(), const int retries = 2, const DownloadProviderPtr & customDownloadProvider = DownloadProviderPtr() );
     
     /**
-     * Download a gzip-compressed arbitrary file and validate it's extracted
-     * contents against a checksum string specified in parameter
+     * Download a gzip-compressed arbitrary file and validate it against a checksum
+     * string specified in parameter. The filename receives the extracted file.
      */
     int                     downloadFileGZ      ( const std::string & fileURL, const std::string & checksumString, std::string * filename, const FiniteTaskPtr & pf = FiniteTaskPtr(), const int retries = 2, const DownloadProviderPtr & customDownloadProvider = DownloadProviderPtr() );
 
+    /**
+     * Download a disk image in the image cache ahead of time (gzip-compressed
+     * ones are extracted), optionally pinning it for the given owner.
+     */
+    int                     imagePrewarm        ( const std::string & fileURL, const std::string & checksumString, const std::string & pinOwner = "", const FiniteTaskPtr & pf = FiniteTaskPtr(), const int retries = 2, const DownloadProviderPtr & customDownloadProvider = DownloadProviderPtr() );
+
     /**
      * Download a specific version of CernVM and return the path where it was saved.
      *
@@ -628,6 +661,17 @@ public:
      */
     void                    setUserInteraction( UserInteractionPtr p );
 
+    /**
+     * Run the state machines of the sessions opened from now on, on the specified
+     * shared executor instead of one thread per session (empty to disable).
+     */
+    void                    setFSMExecutor( FSMExecutorPtr p );
+
+    /**
+     * Return the shared FSM executor (or empty if not used)
+     */
+    FSMExecutorPtr          getFSMExecutor( );
+
     /* HACK: Only the JSAPI knows where it's located. Therefore it must provide it to
              the Hypervisor class in order to use the checkDaemonNeed() function. It's
              a hack because those two systems (JSAPI & HypervisorAPI) should be isolated. */
@@ -637,6 +681,16 @@ protected:
     int                     sessionID;
     DownloadProviderPtr     downloadProvider;
     UserInteractionPtr      userInteraction;
+
+    /**
+     * The persistent command channel to the hypervisor binary (if used)
+     */
+    ExecChannelPtr          execChannel;
+
+    /**
+     * The shared executor for the session FSMs (if used)
+     */
+    FSMExecutorPtr          fsmExecutor;
 };
 
 //////////////////////////////////////////////
@@ -48,18 +48,19 @@
 #define GUESTADD_DEVICE     "0"
 
 // Where the floppyIO floppy is placed
-#define FLOPPYIO_ENUM_NAME  "Storage Controller Name (2)"
+#define FLOPPYIO_ENUM_NAME  "storagecontrollername2"
     // ^^ The first controller is IDE, second is SATA, third is Floppy
 #define FLOPPYIO_CONTROLLER "Floppy"
 #define FLOPPYIO_PORT       "0"
 #define FLOPPYIO_DEVICE     "0"
 
 // Create some condensed strings using the above parameters
-#define BOOT_DSK            BOOT_CONTROLLER " (" BOOT_PORT ", " BOOT_DEVICE ")"
-#define SCRATCH_DSK         SCRATCH_CONTROLLER " (" SCRATCH_PORT ", " SCRATCH_DEVICE ")"
-#define CONTEXT_DSK         CONTEXT_CONTROLLER " (" CONTEXT_PORT ", " CONTEXT_DEVICE ")"
-#define GUESTADD_DSK        GUESTADD_CONTROLLER " (" GUESTADD_PORT ", " GUESTADD_DEVICE ")"
-#define FLOPPYIO_DSK        FLOPPYIO_CONTROLLER " (" FLOPPYIO_PORT ", " FLOPPYIO_DEVICE ")"
+// (These are the keys of the slots in the machine-readable VM info)
+#define BOOT_DSK            BOOT_CONTROLLER "-" BOOT_PORT "-" BOOT_DEVICE
+#define SCRATCH_DSK         SCRATCH_CONTROLLER "-" SCRATCH_PORT "-" SCRATCH_DEVICE
+#define CONTEXT_DSK         CONTEXT_CONTROLLER "-" CONTEXT_PORT "-" CONTEXT_DEVICE
+#define GUESTADD_DSK        GUESTADD_CONTROLLER "-" GUESTADD_PORT "-" GUESTADD_DEVICE
+#define FLOPPYIO_DSK        FLOPPYIO_CONTROLLER "-" FLOPPYIO_PORT "-" FLOPPYIO_DEVICE
 
 // The VirtualBox PUEL License
 #define VBOX_PUEL_LICENSE \
@@ -107,6 +108,11 @@ std::string _vbox_extractMac( std::string nicInfo );
  */
 std::string _vbox_changeUpperIP( std::string baseIP, int value );
 
+/**
+ * Parse the output of a --machinereadable VBoxManage command
+ */
+std::map< const std::string, const std::string > _vbox_parseMachineReadable( std::vector< std::string > * lines );
+
 /////////////////////////
 // Exported functions
 /////////////////////////
@@ -0,0 +1,127 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef VBOXCONFIGPLAN_H
+#define VBOXCONFIGPLAN_H
+
+#include <CernVM/Utilities.h>
+#include <CernVM/CrashReport.h>
+
+#include <string>
+#include <vector>
+#include <map>
+
+/**
+ * The key in the session's local config where the options that cannot
+ * be read back from 'showvminfo' are stored after they are applied.
+ */
+#define PLAN_APPLIED_KEY    "appliedVMOptions"
+
+/**
+ * A configuration plan for a VirtualBox VM.
+ *
+ * The plan collects the desired machine configuration, compares it against the
+ * cached 'showvminfo' information and keeps only the options that need to change.
+ * All of them are then applied with a single 'modifyvm' invocation.
+ */
+class VBoxConfigPlan {
+public:
+
+    /**
+     * Create an empty plan
+     */
+    VBoxConfigPlan              ( );
+
+    /**
+     * Start a new plan for the given VM. The applied argument is the string
+     * previously returned by commit().
+     */
+    void                        reset               ( const std::string& vboxid, const std::string& applied = "" );
+
+    /**
+     * Request the given modifyvm option, only if it differs from the current
+     * value, as found in the machine info.
+     */
+    void                        setVMOption         ( const std::string& option, const std::string& value, const std::string& current );
+
+    /**
+     * Request the given modifyvm option unconditionally
+     */
+    void                        setVMOption         ( const std::string& option, const std::string& value );
+
+    /**
+     * Request a modifyvm option that cannot be read back from the machine info.
+     * It's applied only if it was not applied already with the same value.
+     */
+    void                        setBlindVMOption    ( const std::string& option, const std::string& value );
+
+    /**
+     * Ensure the given NAT port-forwarding rule exists on the specified NIC.
+     * The machine info is used for detecting if the rule is already there.
+     */
+    void                        setNATRule          ( int nic, const std::string& name, const std::string& proto, const std::string& hostIP,
+                                                      int hostPort, int guestPort, const std::map<const std::string, const std::string>& machineInfo );
+
+    /**
+     * Check if there is anything to be applied
+     */
+    bool                        empty               ( bool withNATRules = true );
+
+    /**
+     * Build the modifyvm command that applies the plan
+     */
+    std::string                 getModifyVMCommand  ( bool withNATRules = true );
+
+    /**
+     * Mark the pending options as applied and return the string
+     * to be stored for the next reset().
+     */
+    std::string                 commit              ( );
+
+private:
+
+    /**
+     * The VirtualBox ID of the VM
+     */
+    std::string                 vboxid;
+
+    /**
+     * The modifyvm options to apply, in order
+     */
+    std::vector< std::pair< std::string, std::string > >
+                                vmOptions;
+
+    /**
+     * The --natpf arguments to apply, in order
+     */
+    std::vector< std::string >  natOptions;
+
+    /**
+     * The blind options already applied and the ones pending
+     */
+    std::map< std::string, std::string >
+                                appliedOptions;
+    std::map< std::string, std::string >
+                                pendingOptions;
+
+};
+
+#endif /* end of include guard: VBOXCONFIGPLAN_H */
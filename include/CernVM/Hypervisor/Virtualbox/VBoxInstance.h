@@ -26,6 +26,7 @@
 #include "VBoxSession.h"
 
 #include <map>
+#include <ctime>
 
 #include "CernVM/Utilities.h"
 #include "CernVM/Hypervisor.h"
@@ -35,6 +36,19 @@
 #include "CernVM/DomainKeystore.h"
 
 #include <boost/regex.hpp>
+#include <boost/thread/mutex.hpp>
+
+/**
+ * How long (in milliseconds) the cached media registry is trusted if
+ * nothing indicates that it has changed.
+ */
+#define MEDIA_REGISTRY_TTL      60000
+
+/**
+ * How long (in milliseconds) the cached machine information is valid.
+ * Our own modifications invalidate it explicitly.
+ */
+#define MACHINE_INFO_TTL        1000
 
 /**
  * VirtualBox Hypervisor
@@ -42,13 +56,18 @@
 class VBoxInstance : public HVInstance {
 public:
 
-    VBoxInstance( std::string fBin ) : HVInstance(), execConfig(), reflectionValid(true) {
+    VBoxInstance( std::string fBin ) : HVInstance(), execConfig(), reflectionValid(true), 
+        mediaMutex(), mediaLoaded(false), mediaTimestamp(0), mediaConfigTime(0), mediaList(), mediaByUUID(), mediaByLocation(),
+        machineInfoMutex(), machineInfoCache(), machineInfoTimestamp() {
         CRASH_REPORT_BEGIN;
 
         // Populate variables
         this->sessionLoaded = false;
         this->hvBinary = fBin;
 
+        // Send the VBoxManage commands through a persistent channel
+        this->execChannel = boost::make_shared< ExecChannel >( fBin );
+
         // Load hypervisor-specific runtime configuration
         this->hvConfig = LocalConfig::forRuntime("virtualbox");
 
@@ -74,6 +93,7 @@ public:
     virtual int             getCapabilities     ( HVINFO_CAPS * caps );
     virtual void            abort               ( );
     virtual bool            validateIntegrity   ( );
+    virtual int             refreshAll          ( );
 
     /////////////////////////
     // Friend functions
@@ -82,9 +102,20 @@ public:
     int                     prepareSession      ( VBoxSession * session );
     std::map<const std::string, const std::string>        
                             getMachineInfo      ( std::string uuid, int timeout = SYSEXEC_TIMEOUT );
+    std::map<const std::string, const std::string>        
+                            getMachineInfo      ( std::string uuid, const SysExecConfig& config );
+    std::map< std::string, std::map<const std::string, const std::string> >
+                            getMachineInfo      ( const std::vector< std::string >& uuids, const SysExecConfig& config );
+    void                    invalidateMachineInfo ( const std::string& uuid );
     std::string             getProperty         ( std::string uuid, std::string name );
     std::vector< std::map< const std::string, const std::string > > 
                             getDiskList         ( );
+    std::map<const std::string, const std::string>
+                            findDiskByUUID      ( const std::string& uuid );
+    std::map<const std::string, const std::string>
+                            findDiskByLocation  ( const std::string& location );
+    std::string             findMultiAttachMaster ( const std::string& location );
+    void                    invalidateDiskList  ( );
     std::map<std::string, std::string> 
                             getAllProperties    ( std::string uuid );
     bool                    hasExtPack          ();
@@ -112,6 +143,30 @@ private:
     // The virtualbox reflection is still valid
     bool                    reflectionValid;
 
+    // The cached media registry (the 'list hdds' output), indexed
+    // by UUID and location. Protected by mediaMutex.
+    boost::mutex            mediaMutex;
+    bool                    mediaLoaded;
+    unsigned long           mediaTimestamp;
+    std::time_t             mediaConfigTime;
+    std::vector< std::map< const std::string, const std::string > >
+                            mediaList;
+    std::map< std::string, size_t >
+                            mediaByUUID;
+    std::map< std::string, size_t >
+                            mediaByLocation;
+
+    // Make sure the media registry cache is up to date
+    void                    updateDiskList      ( );
+
+    // The cached 'showvminfo' information of every VM, and the time it was
+    // fetched. Protected by machineInfoMutex.
+    boost::mutex            machineInfoMutex;
+    std::map< std::string, std::map< const std::string, const std::string > >
+                            machineInfoCache;
+    std::map< std::string, long >
+                            machineInfoTimestamp;
+
 #ifdef __linux__
     // On linux, we also check for 'The vboxdrv kernel module is not loaded' warnings 
     bool                    vboxDrvKernelLoaded;
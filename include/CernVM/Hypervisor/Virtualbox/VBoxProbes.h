@@ -28,11 +28,23 @@
 
 #include <string>
 #include <map>
+#include <fstream>
 
 using namespace std;
 
+/**
+ * How many bytes from the beginning of the log file are used
+ * for detecting that the file was rotated.
+ */
+#define LOGPROBE_HEADER_SIZE    256
+
 /**
  * Virtualbox log crawler
+ *
+ * The probe follows the log file incrementally: It remembers up to where it
+ * has read and on every analyze() it parses only the newly appended bytes.
+ * The flags are raised only for the events found in the new data, while the
+ * values (state, resolution) are kept from the previous analysis.
  */
 class VBoxLogProbe {
 public:
@@ -43,7 +55,8 @@ public:
 	VBoxLogProbe( const string& path, int tailSize = 81920 )
 		: hasState(false), state(0), hasFailures(false), failures(0),
 		  hasResolutionChange(false), resWidth(0), resHeight(0),
-		  resBpp(0)
+		  resBpp(0), offset(0), started(false), stateBlocked(false),
+		  header(""), lineBuffer("")
 	{
         CRASH_REPORT_BEGIN;
 		this->logFile = path + "/VBox.log";
@@ -57,10 +70,16 @@ public:
 	bool 			exists();
 
 	/**
-	 * Analyze the log file
+	 * Analyze the bytes appended to the log file since the last call
 	 */
 	void 			analyze();
 
+	/**
+	 * Forget the position in the log file, so the next analyze()
+	 * starts again from the tail of the file.
+	 */
+	void 			reset();
+
 	/**
 	 * Flag and information regarding state change
 	 */
@@ -87,6 +106,29 @@ public:
 	string 			logFile;
 	int				tailSize;
 
+private:
+
+	/**
+	 * Read the file from the current offset till the end
+	 */
+	void 			follow( const string& file );
+
+	/**
+	 * Parse a single log line
+	 */
+	void 			parseLine( const string& line );
+
+	/**
+	 * The position up to where we have read the file, the first bytes
+	 * of the file (used for detecting rotation) and the incomplete
+	 * last line.
+	 */
+	std::streamoff	offset;
+	bool 			started;
+	bool 			stateBlocked;
+	string 			header;
+	string 			lineBuffer;
+
 };
 
 
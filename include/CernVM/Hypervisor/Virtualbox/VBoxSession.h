@@ -23,16 +23,19 @@
 #define VBOXSESSION_H
 
 #include "VBoxCommon.h"
+#include "VBoxConfigPlan.h"
 
 #include <string>
 #include <map>
 
 #include <CernVM/SimpleFSM.h>
 #include <CernVM/Hypervisor.h>
+#include <CernVM/SessionMonitor.h>
 #include <CernVM/CrashReport.h>
 
 #include <boost/regex.hpp>
 #include <boost/thread.hpp>
+#include <boost/atomic.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
 
@@ -45,88 +48,44 @@ enum VBoxDiskType {
     T_FLOPPY    // A Floppy disk drive
 };
 
+/**
+ * Virtualbox log follower (defined in VBoxProbes.h)
+ */
+class VBoxLogProbe;
+
 /**
  * Virtualbox Session, built around a Finite-State-Machine model
  */
 class VBoxSession : public SimpleFSM, public HVSession {
 public:
 
-    VBoxSession( ParameterMapPtr param, HVInstancePtr hv ) : SimpleFSM(), HVSession(param, hv), execConfig() {
+    VBoxSession( ParameterMapPtr param, HVInstancePtr hv ) : SimpleFSM(), HVSession(param, hv), logProbe(), logWatchFile(""), logWatchMutex(), updateMutex(), configPlan(), execConfig() {
         CRASH_REPORT_BEGIN;
 
-        FSM_REGISTRY(1,             // Entry point is on '1'
-        {
-
-            // Target states
-            FSM_STATE(1, 100);      // Entry point
-            FSM_STATE(2, 102,112);  // Error
-            FSM_STATE(3, 104);      // Destroyed
-            FSM_STATE(4, 105,108);  // Power off
-            FSM_STATE(5, 107,211);  // Saved
-            FSM_STATE(6, 109,111);  // Paused
-            FSM_STATE(7, 110,106);  // Running
-
-            // 100: INITIALIZE HYPERVISOR
-            FSM_HANDLER(100, &VBoxSession::Initialize,              101);
-
-            // 101: UPDATE SESSION STATE FROM THE HYPERVISOR
-            FSM_HANDLER(101, &VBoxSession::UpdateSession,           2,3,4,5,6,7);
-
-            // 102: HANDLE ERROR SEQUENCE
-            FSM_HANDLER(102, &VBoxSession::HandleError,             103);
-                FSM_HANDLER(103, &VBoxSession::CureError,           101);       // Try to recover error and recheck state
-
-            // 104: CREATE SEQUENCE
-            FSM_HANDLER(104, &VBoxSession::CreateVM,                4);         // Create new VM
-
-            // 105: DESTROY SEQUENCE
-            FSM_HANDLER(105, &VBoxSession::ReleaseVMScratch,        207);       // Release Scratch storage
-                FSM_HANDLER(207, &VBoxSession::ReleaseVMBoot,       208);       // Release Boot Media
-                FSM_HANDLER(208, &VBoxSession::DestroyVM,           3);         // Destroy VM
-
-            // 106: POWEROFF SEQUENCE
-            FSM_HANDLER(106, &VBoxSession::PoweroffVM,              209);       // Power off the VM
-                FSM_HANDLER(209, &VBoxSession::ReleaseVMAPI,        4);         // Release the VM API media
-
-            // 211: CHECK VMAPI STATE
-            FSM_HANDLER(211, &VBoxSession::CheckVMAPI,              206);       // Check if we can resume from current VMAPI Data of we should restart
-
-            // 107: DISCARD STATE SEQUENCE
-            FSM_HANDLER(107, &VBoxSession::DiscardVMState,          209);       // Discard saved state of the VM
-                FSM_HANDLER(209, &VBoxSession::ReleaseVMAPI,        4);         // Release the VM API media
-
-            // 108: START SEQUENCE
-            FSM_HANDLER(108, &VBoxSession::PrepareVMBoot,           210);       // Prepare start parameters
-                FSM_HANDLER(210, &VBoxSession::ConfigNetwork,       201);       // Configure the network devices
-                FSM_HANDLER(201, &VBoxSession::ConfigureVM,         202);       // Configure VM
-                FSM_HANDLER(202, &VBoxSession::DownloadMedia,       203);       // Download required media files
-                FSM_HANDLER(203, &VBoxSession::ConfigureVMBoot,     204);       // Configure Boot media
-                FSM_HANDLER(204, &VBoxSession::ConfigureVMScratch,  205);       // Configure Scratch storage
-                FSM_HANDLER(205, &VBoxSession::ConfigureVMAPI,      206);       // Configure API Disks
-                FSM_HANDLER(206, &VBoxSession::StartVM,             7);         // Launch the VM
-
-            // 109: SAVE STATE SEQUENCE
-            FSM_HANDLER(109, &VBoxSession::SaveVMState,             5);         // Save VM state
-
-            // 110: PAUSE SEQUENCE
-            FSM_HANDLER(110, &VBoxSession::PauseVM,                 6);         // Pause VM
-
-            // 111: PAUSE SEQUENCE
-            FSM_HANDLER(111, &VBoxSession::ResumeVM,                7);         // Resume VM
-
-            // 112: FATAL ERROR HANDLING
-            FSM_HANDLER(112, &VBoxSession::FatalErrorSink,          0);         // Fatal Error Sink
-
-        });
+        // Use the static FSM definition (see VBoxSession.cpp)
+        FSMRegistryStatic( fsmDefinition );
 
         // Reset error states
         errorCount = 0;
         errorTimestamp = 0;
         errorCode = 0;
         errorMessage = "";
-        lastMachineInfoTimestamp = 0;
         isAborting = false;
+        lastLogTime = 0;
+        logChanged = false;
+        logWatchID = 0;
+        monitored = false;
+
+        CRASH_REPORT_END;
+    }
 
+    /**
+     * Make sure the FileWatch does not call us after we are gone
+     */
+    virtual ~VBoxSession() {
+        CRASH_REPORT_BEGIN;
+        unwatchLog();
+        if (monitored) SessionMonitor::Default()->unmonitor( this );
         CRASH_REPORT_END;
     }
 
@@ -134,6 +93,13 @@ public:
     // FSM implementation functions 
     /////////////////////////////////////
 
+    /**
+     * The FSM graph, shared by all the sessions
+     */
+    static const FSMStaticNode  fsmNodeTable[];
+    static const FSMStaticFork  fsmForkTable[];
+    static const FSMStaticDef   fsmDefinition;
+
     void Initialize();
     void UpdateSession();
     void HandleError();
@@ -193,6 +159,12 @@ public:
      */
     void                    hvNotifyDestroyed   ();
 
+    /**
+     * Notification from the VBoxInstance with the current state of
+     * the VM, as detected by a bulk refresh of all sessions.
+     */
+    void                    hvNotifyState       ( int newState );
+
     /**
      * Notification from the VBoxInstance that we are going
      * for a forceful shutdown. We should cleanup everything
@@ -210,6 +182,17 @@ public:
      */
     void                    FSMEnteringState    ( const int state, const bool final );
 
+    /**
+     * Override to route the actions that missed their deadline to the error state
+     */
+    void                    FSMHandlerTimeout   ( const int state, const bool redirected );
+
+    /**
+     * Override to keep the FSM journal in the local config
+     * and to let the session monitor know when we are idle
+     */
+    void                    FSMStepCompleted    ( const int state, const int target );
+
 protected:
 
     /////////////////////////////////////
@@ -231,16 +214,36 @@ protected:
 
     /**
      * (Re-)Mount a disk on the specified controller
-     * This function automatically unmounts a previously attached disk if the filenames
-     * do not match.
+     * This function automatically replaces a previously attached disk if the filenames
+     * do not match. The replaced disk is deleted if multiAttach or deleteReplaced is set.
      */
-    int                     mountDisk           ( const std::string & controller, const std::string & port, const std::string & device, const VBoxDiskType& type, const std::string & file, bool multiAttach = false );
+    int                     mountDisk           ( const std::string & controller, const std::string & port, const std::string & device, const VBoxDiskType& type, const std::string & file, bool multiAttach = false, bool deleteReplaced = false );
 
     /**
      * Unmount a medium from the VirtulaBox Instance
      */
     int                     unmountDisk         ( const std::string & controller, const std::string & port, const std::string & device, const VBoxDiskType& type, const bool deleteFile = false );
 
+    /**
+     * Get the medium mounted on the specified slot
+     */
+    bool                    getMountedDisk      ( const std::string & controller, const std::string & port, const std::string & device, std::string * file, std::string * uuid );
+
+    /**
+     * Update (or erase, if file is empty) the medium mounted on the specified slot
+     */
+    void                    setMountedDisk      ( const std::string & controller, const std::string & port, const std::string & device, const std::string & file, const std::string & uuid );
+
+    /**
+     * Close and delete a medium, first by filename and then by UUID
+     */
+    int                     closeMedium         ( const VBoxDiskType& type, const std::string & file, const std::string & uuid );
+
+    /**
+     * Apply the pending modifyvm options of the configuration plan
+     */
+    int                     applyConfigPlan     ( );
+
     /**
      * Forward the fact that an error has occured somewhere in the FSM handling
      */
@@ -260,6 +263,11 @@ protected:
                             getDiskInfo         ( const std::string& disk );
 
     int                     startVM             ();
+    void                    switchState         ( int newState );
+
+    void                    watchLog            ();
+    void                    unwatchLog          ();
+    void                    logFileChanged      ( const std::string& file );
 
     ////////////////////////////////////
     // Local variables
@@ -274,17 +282,31 @@ protected:
     int                     errorCount;
     unsigned long           errorTimestamp;
 
-    // getMachineInfo helpers
-    std::map<const std::string, const std::string>        
-                            lastMachineInfo;
-    long                    lastMachineInfoTimestamp;
-
     // Detection of virtualbox log modification time
     unsigned long long      lastLogTime;
 
+    // The follower of the virtualbox log file
+    boost::shared_ptr< VBoxLogProbe >
+                            logProbe;
+
+    // The FileWatch on the virtualbox log file
+    int                     logWatchID;
+    std::string             logWatchFile;
+    boost::atomic<bool>     logChanged;
+    boost::mutex            logWatchMutex;
+
+    // If we are tracked by the session monitor
+    bool                    monitored;
+
+    // For having only a single update running
+    boost::mutex            updateMutex;
+
     // For having only a single system command running
     boost::mutex            execMutex;
 
+    // The configuration plan of the start sequence
+    VBoxConfigPlan          configPlan;
+
     /*  Default sysExecConfig */
     SysExecConfig           execConfig;
 
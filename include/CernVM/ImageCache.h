@@ -0,0 +1,188 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include <CernVM/Utilities.h>
+#include <CernVM/CrashReport.h>
+
+#include <map>
+#include <set>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+/**
+ * The name of the index file in the cache directory
+ */
+#define IMAGECACHE_INDEX            "images.idx"
+
+/**
+ * The file locked while an operation updates the index, so the processes
+ * sharing the cache do not overwrite each other's changes
+ */
+#define IMAGECACHE_LOCK             "images.idx.lock"
+
+/**
+ * Forward decleration of pointer types
+ */
+class ImageCache;
+typedef boost::shared_ptr< ImageCache >             ImageCachePtr;
+
+/**
+ * A content-addressed cache of the downloaded disk images.
+ *
+ * The images are stored under their checksum, so the same image downloaded
+ * from different mirrors is stored only once. The index file records the size
+ * and the last use of every image, the URLs it was found at and the sessions
+ * that have pinned it. When the cache grows above its quota, the least recently
+ * used images that are not pinned are removed.
+ *
+ * The index is re-read before every operation, so the changes of the other
+ * processes sharing the same cache are picked up. The operations that update
+ * it hold a lock on IMAGECACHE_LOCK from the moment they read it until they
+ * save it.
+ */
+class ImageCache {
+public:
+
+    /**
+     * Create a cache in the given directory with the given quota (in bytes)
+     */
+    ImageCache                  ( const std::string& dir, long long quota );
+
+    /**
+     * Return the path of the cached image with the given checksum (and mark it
+     * as used), or an empty string if it's not cached.
+     */
+    std::string                 lookup      ( const std::string& checksum );
+
+    /**
+     * Return the path of the cached image that was downloaded from the given URL
+     * (and mark it as used), or an empty string if it's not cached.
+     */
+    std::string                 lookupURL   ( const std::string& url, std::string * checksum = NULL );
+
+    /**
+     * Return the path of the most recently used cached image that was downloaded
+     * from a URL containing the given string (and mark it as used), or an empty
+     * string if there is none.
+     */
+    std::string                 lookupURLPart ( const std::string& urlPart, std::string * url = NULL );
+
+    /**
+     * Check if the image (given by checksum or by its path) is cached
+     */
+    bool                        contains    ( const std::string& image );
+
+    /**
+     * Return the URLs the image (given by checksum or by its path) was found at
+     */
+    std::set< std::string >     getURLs     ( const std::string& image );
+
+    /**
+     * Move a validated file in the cache and remember the URL it came from.
+     * If the image is already cached, the file is removed. Returns the path
+     * of the image in the cache, or the path of the file if it cannot be cached.
+     *
+     * If inPlace is true the file is indexed under its current path (it must be
+     * in the cache directory) and it's never moved or removed, since the
+     * hypervisor may already be using it.
+     */
+    std::string                 store       ( const std::string& file, const std::string& checksum, const std::string& url, bool inPlace = false );
+
+    /**
+     * Remember that the cached image was also found at the given URL
+     */
+    void                        alias       ( const std::string& checksum, const std::string& url );
+
+    /**
+     * Keep the image (given by checksum or by its path in the cache)
+     * from being evicted, until the owner unpins it.
+     */
+    bool                        pin         ( const std::string& image, const std::string& owner );
+
+    /**
+     * Release the pins of the given owner (on all the images if
+     * no image is specified)
+     */
+    void                        unpin       ( const std::string& owner, const std::string& image = "" );
+
+    /**
+     * Remove the least recently used images that are not pinned, until the
+     * cache has room for the given number of bytes. Returns the bytes freed.
+     */
+    long long                   evict       ( long long reserve = 0 );
+
+    /**
+     * Get/set the size quota of the cache (in bytes)
+     */
+    void                        setQuota    ( long long quota );
+    long long                   getQuota    ( );
+
+    /**
+     * Return the total size of the cached images (in bytes)
+     */
+    long long                   getUsage    ( );
+
+private:
+
+    /**
+     * A cached image
+     */
+    struct Entry {
+        std::string             file;
+        long long               size;
+        long long               lastUse;
+        std::set< std::string > urls;
+        std::set< std::string > pins;
+    };
+
+    /**
+     * Load/save the index (must be called with cacheMutex and the
+     * IMAGECACHE_LOCK held)
+     */
+    void                        load        ( );
+    bool                        save        ( );
+
+    /**
+     * Evict without locking (must be called with cacheMutex locked)
+     */
+    long long                   evictLocked ( long long reserve, const std::string& keep );
+
+    /**
+     * Find the checksum of the given image (checksum or path)
+     */
+    std::string                 resolve     ( const std::string& image );
+
+    // Configuration
+    std::string                 dir;
+    long long                   quota;
+
+    // The index
+    std::map< std::string, Entry >  entries;
+    boost::mutex                cacheMutex;
+
+};
+
+#endif /* end of include guard: IMAGECACHE_H */
@@ -28,6 +28,8 @@
 
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/recursive_mutex.hpp>
 
 /**
  * Shared pointer for the LocalConfig class
@@ -55,7 +57,7 @@ public:
     /**
      * Virtual destructor
      */
-    virtual ~LocalConfig() { };
+    virtual ~LocalConfig();
 
     /**
      * Return a LocalConfig Shared Pointer for the global config
@@ -142,6 +144,17 @@ public:
      */
     virtual bool                sync            ( );
 
+    /**
+     * Watch the config file for changes and synchronize automatically
+     * when it's modified by another process.
+     */
+    void                        watch           ( );
+
+    /**
+     * Stop watching the config file
+     */
+    void                        unwatch         ( );
+
     /**
      * Override the erase function so we can keep track of the 
      * changes done in the buffer.
@@ -201,6 +214,27 @@ private:
      */
     std::list<std::string>      keysDeleted;
 
+    /**
+     * The FileWatch ID, if the file is watched
+     */
+    int                         watchID;
+
+    /**
+     * Protects the watchID
+     */
+    boost::mutex                watchMutex;
+
+    /**
+     * Serializes the synchronization with the disk, since
+     * it can also be triggered from the FileWatch thread.
+     */
+    boost::recursive_mutex      syncMutex;
+
+    /**
+     * FileWatch callback
+     */
+    void                        fileChanged     ( const std::string& file );
+
 protected:
     
     /**
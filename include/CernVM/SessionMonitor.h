@@ -0,0 +1,135 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef SESSIONMONITOR_H
+#define SESSIONMONITOR_H
+
+#include <CernVM/Utilities.h>
+#include <CernVM/CrashReport.h>
+
+#include <map>
+#include <list>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+/**
+ * Forward decleration of pointer types
+ */
+class HVSession;
+class SessionMonitor;
+typedef boost::shared_ptr< HVSession >              HVSessionPtr;
+typedef boost::shared_ptr< SessionMonitor >         SessionMonitorPtr;
+
+/**
+ * A reactor that keeps the state of the open sessions up to date.
+ *
+ * The sessions notify the monitor when something has changed (ex. the
+ * FileWatch reported a change in the VirtualBox log) and the monitor runs
+ * their update() from its own thread. Many notifications of the same session
+ * are merged into a single update. If the session is busy, the update is
+ * deferred until the session reports that it's idle again.
+ *
+ * Nothing is polled, so the clients don't have to call update() periodically
+ * in order to receive the "stateChanged" events.
+ */
+class SessionMonitor {
+public:
+
+    /**
+     * Create a monitor (the thread is started on demand)
+     */
+    SessionMonitor              ( );
+
+    /**
+     * Destructor that stops the monitor thread
+     */
+    virtual ~SessionMonitor     ( );
+
+    /**
+     * Get the system-wide monitor singleton
+     */
+    static SessionMonitorPtr    Default     ( );
+
+    /**
+     * Start monitoring the specified session
+     */
+    void                        monitor     ( const HVSessionPtr& session );
+
+    /**
+     * Stop monitoring. When this function returns, the session
+     * is not updated by the monitor and it will not be again.
+     */
+    void                        unmonitor   ( HVSession * session );
+
+    /**
+     * Something has changed in the session, schedule an update
+     */
+    void                        notify      ( HVSession * session );
+
+    /**
+     * The session has become idle, run the update that was
+     * deferred while it was busy (if any).
+     */
+    void                        notifyIdle  ( HVSession * session );
+
+private:
+
+    /**
+     * A monitored session
+     */
+    struct Entry {
+        boost::weak_ptr< HVSession >    session;
+        bool                            queued;
+        bool                            deferred;
+    };
+
+    /**
+     * Monitor thread main loop
+     */
+    void                        monitorLoop ( );
+
+    /**
+     * Queue an update of the given entry
+     * (must be called with monitorMutex locked)
+     */
+    void                        enqueue     ( HVSession * session, Entry& e );
+
+    // The monitored sessions and the ones to be updated
+    std::map< HVSession*, Entry >   sessions;
+    std::list< HVSession* >         queue;
+
+    // Thread state
+    bool                        stopping;
+    boost::thread *             thread;
+    boost::mutex                monitorMutex;
+    boost::condition_variable   monitorCond;
+
+    // Held while a session is updated
+    boost::recursive_mutex      updateMutex;
+
+};
+
+#endif /* end of include guard: SESSIONMONITOR_H */
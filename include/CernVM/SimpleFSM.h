@@ -32,12 +32,29 @@
 #include <boost/thread.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/atomic.hpp>
 
-typedef boost::function< void () >	fsmHandler;
+/**
+ * The number of handler invocations kept for the trace
+ */
+#define FSM_TRACE_SIZE 				1024
+
+/**
+ * The maximum number of links of a node in a static FSM definition
+ */
+#define FSM_STATIC_LINKS 			8
 
 // Forward declerations
 struct  _FSMNode;
 typedef _FSMNode FSMNode;
+class 	SimpleFSM;
+class 	FSMWatchdog;
+
+typedef boost::function< void () >	fsmHandler;
+typedef void (*fsmStaticHandler)( SimpleFSM * fsm );
+class 	FSMExecutor;
+typedef boost::shared_ptr< FSMExecutor > 	FSMExecutorPtr;
 
 /**
  * Structure of the FSM node
@@ -45,12 +62,130 @@ typedef _FSMNode FSMNode;
  */
 struct  _FSMNode{
 
+	_FSMNode() : id(0), name(), type(0), handler(), staticHandler(NULL), children(), branches(), index(-1), timeout(0) { };
+
 	// FSM description
 	int								id;
+	std::string 					name;
 	unsigned char 					type;
 	fsmHandler						handler;
+	fsmStaticHandler 				staticHandler;
 	std::vector<FSMNode*>			children;
 
+	// Nodes whose handlers are started in parallel when entering this node
+	std::vector<FSMNode*>			branches;
+
+	// Index in the routing table
+	int 							index;
+
+	// Deadline of the handler (ms), or 0 if it can run for ever
+	int 							timeout;
+
+	// Check if it's an action node (and not a state)
+	bool 							hasHandler() const { return (staticHandler != NULL) || !handler.empty(); };
+
+};
+
+/**
+ * Next-hop routing table of an FSM graph.
+ *
+ * For every pair of nodes (from, to) it contains the index of the node to visit
+ * next in order to follow the shortest path, or -1 if 'to' is not reachable.
+ * It's computed once for every FSM definition and shared by all the instances.
+ */
+struct FSMRoutingTable {
+	size_t 							size;
+	std::vector<int> 				nextHop;
+};
+typedef boost::shared_ptr< const FSMRoutingTable > FSMRoutingTablePtr;
+
+/**
+ * An FSM graph: The nodes, their index in the routing table and the
+ * routing table itself. The graphs of the static FSM definitions are
+ * shared by all the instances, so they are never modified once built.
+ */
+struct FSMGraph {
+	FSMGraph() : nodes(), index(), routes(), root(NULL) { };
+	std::map<int,FSMNode> 			nodes;
+	std::vector<FSMNode*> 			index;
+	FSMRoutingTablePtr 				routes;
+	FSMNode * 						root;
+};
+typedef boost::shared_ptr< FSMGraph > FSMGraphPtr;
+
+/**
+ * Static FSM definition: A node, with its handler and its links
+ */
+struct FSMStaticNode {
+	int 							id;
+	fsmStaticHandler 				handler;
+	const char * 					name;
+	int 							timeout;
+	int 							links[FSM_STATIC_LINKS];
+};
+
+/**
+ * Static FSM definition: A fork/join group (see FSM_PARALLEL)
+ */
+struct FSMStaticFork {
+	int 							id;
+	int 							branch;
+};
+
+/**
+ * Static FSM definition: The complete graph
+ */
+struct FSMStaticDef {
+	int 							root;
+	const FSMStaticNode * 			nodes;
+	size_t 							nodeCount;
+	const FSMStaticFork * 			forks;
+	size_t 							forkCount;
+};
+
+/**
+ * Timing statistics of an FSM handler
+ */
+struct FSMHandlerStats {
+	int 							id;
+	std::string 					name;
+	unsigned int 					calls;		// Number of times the handler was called
+	unsigned int 					retries;	// Calls after the first one while heading to the same target
+	unsigned int 					execCalls;	// System commands invoked by the handler
+	unsigned int 					timeouts;	// Calls that missed the deadline of the handler
+	long long 						totalTime;	// Total wall-clock time (ms)
+	long long 						maxTime;	// Slowest call (ms)
+	long long 						lastTime;	// Last call (ms)
+	unsigned int 					gotoSerial;	// The FSMGoto of the last call (for detecting retries)
+};
+
+/**
+ * A completed handler invocation, as kept in the trace
+ */
+struct FSMTraceEvent {
+	int 							id;
+	std::string 					name;
+	long long 						begin;		// Start time (ms since the epoch)
+	long long 						duration;	// Wall-clock time (ms)
+	unsigned int 					execCalls;	// System commands invoked
+	bool 							branch;		// It was running as a parallel branch
+};
+
+/**
+ * A parallel branch of the FSM path.
+ *
+ * The handler of the branch node is running on its own thread, while the
+ * FSM continues on the nodes before it. Any FSMSkew/FSMJump requested by the
+ * branch handler is deferred until the path reaches the branch node.
+ * The system commands of the branch are cancelled through its own token
+ * (a child of the FSM token) if the path no longer goes through it.
+ */
+struct FSMBranch {
+	FSMNode * 						node;
+	boost::thread * 				thread;
+	SysExecTokenPtr 				token;
+	int 							redirectState;
+	bool 							redirectJump;
 };
 
 /**
@@ -62,11 +197,44 @@ struct  _FSMNode{
  	FSMRegistryEnd(root);
 
 #define FSM_HANDLER(id,cb,...) \
- 	FSMRegistryAdd(id, boost::bind(cb, this), __VA_ARGS__, 0);
+ 	FSMRegistryAdd(id, boost::bind(cb, this), __VA_ARGS__, 0); \
+ 	FSMRegistryName(id, #cb);
 
 #define FSM_STATE(id,...) \
  	FSMRegistryAdd(id, 0, __VA_ARGS__, 0);
 
+/**
+ * Deadline (in milliseconds) of the handler of node 'id'. If the handler
+ * is still running when it expires, the system commands it's waiting for
+ * are cancelled and FSMHandlerTimeout is called when it returns.
+ */
+#define FSM_TIMEOUT(id,ms) \
+ 	FSMRegistryTimeout(id, ms);
+
+/**
+ * Fork/join group: When entering node 'id', start the handlers of the
+ * given nodes in parallel, if they are further down the current path.
+ * The path joins them when it reaches them, instead of calling them again.
+ */
+#define FSM_PARALLEL(id,...) \
+ 	FSMRegistryParallel(id, __VA_ARGS__, 0);
+
+/**
+ * Helper macros for the static FSM definitions. Those are
+ * aggregate initializers of FSMStaticNode/FSMStaticDef.
+ */
+#define FSM_STATIC_STATE(id,...) \
+ 	{ id, NULL, NULL, 0, { __VA_ARGS__, 0 } }
+
+#define FSM_STATIC_HANDLER(cls,id,fn,...) \
+ 	{ id, &SimpleFSM::FSMStaticCall< cls, &cls::fn >, #fn, 0, { __VA_ARGS__, 0 } }
+
+#define FSM_STATIC_HANDLER_TIMEOUT(cls,id,fn,ms,...) \
+ 	{ id, &SimpleFSM::FSMStaticCall< cls, &cls::fn >, #fn, ms, { __VA_ARGS__, 0 } }
+
+#define FSM_STATIC_DEF(root,nodes,forks) \
+ 	{ root, nodes, sizeof(nodes) / sizeof(nodes[0]), forks, sizeof(forks) / sizeof(forks[0]) }
+
 /**
  * Auto-routed Finite-State-Machine class
  */
@@ -76,12 +244,18 @@ public:
 	/**
 	 * Constructor
 	 */
-	SimpleFSM() : fsmtPaused(true), fsmThread(NULL), fsmtPauseMutex(), fsmtPauseChanged(),
-			  	  fsmwState(NULL), fsmwStateWaiting(false), fsmwStateMutex(), fsmwStateChanged(),
-				  fsmInsideHandler(false), fsmProgress(), fsmGotoMutex(), fsmTargetState(0), 
-				  fsmwWaitCond(), fsmwWaitMutex(), fsmRootNode(NULL), fsmCurrentNode(),
-				  fsmTmpRouteLinks(), fsmNodes(), fsmCurrentPath(), fsmThreadActive(false),
-				  fsmtInterruptRequested(false)
+	SimpleFSM() : fsmProgress(), fsmTmpRouteLinks(), fsmGraph(boost::make_shared<FSMGraph>()), fsmCurrentNode(),
+				  fsmCurrentPath(), fsmTargetState(0), fsmInsideHandler(false), fsmThreadActive(false), fsmThread(NULL),
+				  fsmExecToken(boost::make_shared<SysExecToken>()), fsmtPaused(true), fsmtInterruptRequested(false),
+				  fsmtPauseMutex(), fsmtPauseChanged(), fsmwState(NULL), fsmwStateWaiting(false), fsmwStateMutex(),
+				  fsmwStateChanged(), fsmwWaitMutex(), fsmwWaitCond(), fsmGotoMutex(),
+				  fsmExecutor(), fsmxScheduled(false), fsmxPending(false), fsmxWorker(-1),
+				  fsmTmpBranchLinks(), fsmBranches(), fsmBranchMutex(), fsmProgressMutex(),
+				  fsmStatsMutex(), fsmStats(), fsmTrace(), fsmStatsExec(), fsmGotoSerial(0),
+				  fsmPendingTarget(0), fsmHandlerThread(),
+				  fsmObsSeq(0), fsmObsNode(0), fsmObsTarget(0), fsmObsActive(false),
+				  fsmDeadlineArmed(false), fsmDeadlineHit(false), fsmRedirectSerial(0),
+				  fsmDeadlineToken(), fsmDeadlineThread()
 				  { };
 
 	/**
@@ -120,6 +294,19 @@ public:
 	 */
 	void 							FSMThreadStop		();
 
+	/**
+	 * Run the FSM actions on the specified shared executor instead of a
+	 * dedicated thread. This must be called before FSMThreadStart.
+	 */
+	void 							FSMUseExecutor		( const FSMExecutorPtr & executor );
+
+	/**
+	 * Place the FSM on the given node without running any handler (ex. when
+	 * resuming from a journal). Returns false if the node does not exist
+	 * or if the FSM is busy.
+	 */
+	bool 							FSMRestore			( int state );
+
 	/**
 	 * Enable progress feedback on this SimpleFSM instance
 	 */
@@ -136,10 +323,54 @@ public:
 	void  							FSMWaitInactive		( int timeout = 0 );
 
 	/**
-	 * Check if the FSM is actively working in a node
+	 * Check if the FSM is actively working in a node.
+	 * This and the following functions are lock-free, so they can
+	 * be polled by any number of threads without blocking the FSM.
 	 */
 	bool 							FSMActive			( );
 
+	/**
+	 * Return the ID of the current node
+	 */
+	int 							FSMCurrentState		( );
+
+	/**
+	 * Return the ID of the target state
+	 */
+	int 							FSMTargetState		( );
+
+	/**
+	 * Get a consistent snapshot of the current node,
+	 * the target state and the active flag
+	 */
+	void 							FSMObserve			( int * state, int * target, bool * active );
+
+	/**
+	 * Return the timing statistics of the handlers, indexed by node ID
+	 */
+	std::map<int,FSMHandlerStats> 	FSMGetStats			( );
+
+	/**
+	 * Return the last FSM_TRACE_SIZE handler invocations
+	 */
+	std::vector<FSMTraceEvent> 		FSMGetTrace			( );
+
+	/**
+	 * Clear the timing statistics and the trace
+	 */
+	void 							FSMResetStats		( );
+
+	/**
+	 * Return the trace in the Chrome trace-event JSON format
+	 * (it can be loaded in chrome://tracing)
+	 */
+	std::string 					FSMTraceJSON		( );
+
+	/**
+	 * Write the trace JSON to the given file
+	 */
+	bool 							FSMDumpTrace		( const std::string & filename );
+
 	/**
 	 * Public progress feedback instance used by actions
 	 */
@@ -173,6 +404,22 @@ protected:
 	 */
 	virtual void 					FSMEnteringState	( const int state, const bool final );
 
+	/**
+	 * Overridable function to get notified when a handler missed its deadline.
+	 * It's called from the FSM thread after the handler has returned, with
+	 * 'redirected' set if the handler already called FSMSkew or FSMJump.
+	 */
+	virtual void 					FSMHandlerTimeout	( const int state, const bool redirected );
+
+	/**
+	 * Overridable function to get notified when a step of the path is completed,
+	 * with the node the FSM is on and the target it's heading to. It can be used
+	 * for journaling the progress, so it can be resumed later with FSMRestore.
+	 * If state equals target, the FSM has reached it and it's no longer active
+	 * (unless something else was requested in the mean time).
+	 */
+	virtual void 					FSMStepCompleted	( const int state, const int target );
+
 	/**
 	 * Trigger the "begin" action of the SimpleFSM progress feedback.
 	 * This function cannot be used when FSMDoing/FSMDone are used.
@@ -180,9 +427,40 @@ protected:
 	template <typename T>
 	 	boost::shared_ptr<T> 		FSMBegin 			( const std::string & message );
 
+	/**
+	 * Account a system command to the handler running on the current thread.
+	 * It should be called by the subclasses for every command they invoke.
+	 */
+	void 							FSMCountExec		( );
+
+	/**
+	 * Return the cancellation token for the system commands of the handler
+	 * running on the current thread. That's the token of the branch if it's
+	 * called from a parallel branch, the token of the running handler if it
+	 * has a deadline, or fsmExecToken otherwise.
+	 */
+	SysExecTokenPtr 				FSMExecToken		( );
+
 	// Registry functions encapsulated by the FSM_ macros
 	void 					        FSMRegistryBegin	();
 	void 					        FSMRegistryAdd		( int id, fsmHandler handler, ... );
+	void 					        FSMRegistryParallel	( int id, ... );
+	void 					        FSMRegistryName		( int id, const std::string & name );
+	void 					        FSMRegistryTimeout	( int id, int timeout );
+
+	/**
+	 * Use the given static FSM definition. The graph and the routing table
+	 * are built once for every definition and shared by all the instances,
+	 * while the handlers are called directly, without any binding.
+	 */
+	void 					        FSMRegistryStatic	( const FSMStaticDef & def );
+
+	/**
+	 * The static handler of FSM_STATIC_HANDLER, that calls the member
+	 * function on the instance.
+	 */
+	template <typename T, void (T::*fn)()>
+		static void 				FSMStaticCall		( SimpleFSM * fsm ) { (static_cast<T*>(fsm)->*fn)(); };
 	void 					        FSMRegistryEnd		( int rootID );
 
 	/**
@@ -192,15 +470,24 @@ protected:
 
 	// Private variables
     std::map<int,std::vector<int> > fsmTmpRouteLinks;
-	std::map<int,FSMNode>	        fsmNodes;
-	FSMNode	*						fsmRootNode;
+	FSMGraphPtr 					fsmGraph;
 	FSMNode *						fsmCurrentNode;
 	std::list<FSMNode*>				fsmCurrentPath;
+
+	// The target of the current path (protected by fsmPathMutex,
+	// it's written only while fsmGotoMutex is also locked)
 	int								fsmTargetState;
 	bool 							fsmInsideHandler;
 	bool 							fsmThreadActive;
 	boost::thread *					fsmThread;
 
+	/**
+	 * Cancellation token for the system commands invoked by the FSM handlers.
+	 * It's cancelled by FSMThreadStop() and reset by FSMThreadStart(). The
+	 * branches and the handlers with a deadline use child tokens of it.
+	 */
+	SysExecTokenPtr					fsmExecToken;
+
 private:
 
 	// Thread synchronization variables
@@ -235,6 +522,146 @@ private:
 
 	// Reusable function to run the node handler
 	bool 							_callHandler( FSMNode * node, bool inThread );
+	void 							_fsmInvoke( FSMNode * node );
+
+	// Executor mode: The executor and the scheduling state of
+	// this FSM (protected by the executor mutex)
+	friend class FSMExecutor;
+	FSMExecutorPtr 					fsmExecutor;
+	bool 							fsmxScheduled;
+	bool 							fsmxPending;
+	int 							fsmxWorker;
+
+	// Run a single action in executor mode
+	bool 							_fsmStep();
+
+	// Parallel branches: The fork/join declerations and the running
+	// branches (protected by fsmBranchMutex)
+    std::map<int,std::vector<int> > fsmTmpBranchLinks;
+	std::list<FSMBranch>			fsmBranches;
+	boost::mutex 					fsmBranchMutex;
+
+	// Serializes the progress feedback updates from the branches
+	boost::recursive_mutex 			fsmProgressMutex;
+
+	// Start the branches of the given node, join the branches that
+	// are completed by the given node, or stop all of them.
+	void 							_fsmForkBranches( FSMNode * node );
+	bool 							_fsmJoinBranches( FSMNode * node, int * redirectState, bool * redirectJump );
+	void 							_fsmStopBranches();
+	void 							_fsmBranchThread( FSMNode * node );
+
+	// Defer the redirection if we are called from a branch
+	bool 							_fsmDeferRedirect( int state, bool jump );
+
+	// Instrumentation: The statistics, the trace and the exec counters of
+	// the handlers running on every thread (protected by fsmStatsMutex)
+	boost::mutex 					fsmStatsMutex;
+	std::map<int,FSMHandlerStats> 	fsmStats;
+	std::list<FSMTraceEvent> 		fsmTrace;
+	std::map<boost::thread::id, std::vector<unsigned int> >
+									fsmStatsExec;
+	unsigned int 					fsmGotoSerial;
+
+	// Account the handler invocations
+	long long 						_fsmTraceBegin();
+	void 							_fsmTraceEnd( FSMNode * node, long long begin, bool branch );
+
+	// Request coalescing: The last target requested while a handler was
+	// running, and the thread running it (protected by fsmPathMutex)
+	int 							fsmPendingTarget;
+	boost::thread::id 				fsmHandlerThread;
+
+	// Check if the request can be merged and return true if it was
+	bool 							_fsmCoalesce( int state );
+	void 							_fsmLeaveHandler( bool applyPending );
+
+	// Lock-free observation: A seqlock-protected copy of the current node, the
+	// target and the active flag. It's updated by _fsmPublish(), which must be
+	// called with fsmPathMutex locked, so there is only one writer at a time.
+	boost::atomic<unsigned int> 	fsmObsSeq;
+	boost::atomic<int> 				fsmObsNode;
+	boost::atomic<int> 				fsmObsTarget;
+	boost::atomic<bool> 			fsmObsActive;
+	void 							_fsmPublish();
+
+	// Handler deadlines: Set while a handler with a deadline is running and
+	// when the deadline expires (both protected by the watchdog mutex). The
+	// redirect serial is increased by every FSMSkew/FSMJump.
+	friend class FSMWatchdog;
+	bool 							fsmDeadlineArmed;
+	bool 							fsmDeadlineHit;
+	boost::atomic<unsigned int> 	fsmRedirectSerial;
+
+	// The token of the handler with a running deadline and the thread
+	// it's running on (protected by fsmBranchMutex, see FSMExecToken)
+	SysExecTokenPtr 				fsmDeadlineToken;
+	boost::thread::id 				fsmDeadlineThread;
+
+	// Start and stop the deadline of the given node (the latter
+	// returns true if the deadline has expired in the mean time)
+	bool 							_fsmArmDeadline( FSMNode * node );
+	bool 							_fsmDisarmDeadline();
+	void 							_fsmDeadlineMissed( FSMNode * node, bool redirected );
+
+};
+
+/**
+ * A shared pool of worker threads that runs the actions of many SimpleFSM instances.
+ *
+ * Every FSM is scheduled as a task that runs a single action and re-queues itself
+ * while there are more actions in its path. An FSM is never queued twice, so its
+ * actions are serialized (like a strand), while the number of threads is bounded
+ * by the pool size instead of the number of FSM instances.
+ */
+class FSMExecutor {
+public:
+
+	/**
+	 * Create an executor with the given number of workers (or as many
+	 * as the CPU cores if zero). The workers are started on demand.
+	 */
+	FSMExecutor						( int concurrency = 0 );
+
+	/**
+	 * Stop and join the workers
+	 */
+	virtual ~FSMExecutor			( );
+
+	/**
+	 * Get the system-wide executor singleton
+	 */
+	static FSMExecutorPtr 			Default 			( );
+
+	/**
+	 * Schedule the next action of the given FSM
+	 */
+	void 							schedule 			( SimpleFSM * fsm );
+
+	/**
+	 * Remove the FSM from the queue and if it's running, interrupt it
+	 * and wait for the action to complete.
+	 */
+	void 							cancel 				( SimpleFSM * fsm );
+
+private:
+
+	/**
+	 * Worker thread main loop
+	 */
+	void 							workerLoop 			( int index );
+
+	// Pool state
+	int 							concurrency;
+	int 							numIdle;
+	bool 							stopping;
+	std::list< SimpleFSM * > 		queue;
+	std::vector< boost::thread * > 	threads;
+
+	// Synchronization
+	boost::mutex 					execMutex;
+	boost::condition_variable 		execCond;
+	boost::condition_variable 		doneCond;
 
 };
 
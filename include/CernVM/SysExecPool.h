@@ -0,0 +1,172 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#pragma once
+#ifndef SYSEXECPOOL_H
+#define SYSEXECPOOL_H
+
+#include <CernVM/Utilities.h>
+#include <CernVM/CrashReport.h>
+
+#include <list>
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+/**
+ * Forward decleration of pointer types
+ */
+class SysExecJob;
+class SysExecPool;
+typedef boost::shared_ptr< SysExecJob >             SysExecJobPtr;
+typedef boost::shared_ptr< SysExecPool >            SysExecPoolPtr;
+
+/**
+ * Callback fired when a job is completed with the exit code, the STDOUT lines and the STDERR buffer
+ */
+typedef boost::function< void ( int, const std::vector<std::string>&, const std::string& ) >  callbackSysExec;
+
+/**
+ * A command scheduled for execution in the SysExecPool.
+ *
+ * It can be used as a future, through the wait() function, or the
+ * results can be collected through the callback given to submit().
+ */
+class SysExecJob {
+public:
+
+    /**
+     * Constructor
+     */
+    SysExecJob( const std::string& app, const std::string& cmdline, const SysExecConfig& config, const callbackSysExec& cb, const sysExecHandler& handler );
+
+    /**
+     * Check if the job is completed
+     */
+    bool                        done        ( );
+
+    /**
+     * Wait for the job to complete and return it's exit code
+     */
+    int                         wait        ( );
+
+    /**
+     * Wait for the job to complete, up to the specified time (in milliseconds).
+     * Returns false if the job is still running.
+     */
+    bool                        waitFor     ( int timeout );
+
+    /**
+     * Cancel the job. If it's queued it will never run, otherwise
+     * the running process is killed.
+     */
+    void                        cancel      ( );
+
+    /**
+     * The results of the job (valid when done() is true)
+     */
+    int                         result;
+    std::vector<std::string>    stdoutList;
+    std::string                 stderrMsg;
+
+private:
+    friend class SysExecPool;
+
+    /**
+     * Run the job (called by the pool workers)
+     */
+    void                        run         ( );
+
+    // Job parameters
+    std::string                 app;
+    std::string                 cmdline;
+    SysExecConfig               config;
+    callbackSysExec             callback;
+    sysExecHandler              handler;
+
+    // Completion state
+    bool                        completed;
+    boost::mutex                jobMutex;
+    boost::condition_variable   jobCond;
+
+};
+
+/**
+ * A bounded pool of worker threads that run sysExec() commands in parallel.
+ */
+class SysExecPool {
+public:
+
+    /**
+     * Create a pool that runs up to the given number of commands in parallel
+     */
+    SysExecPool                 ( int concurrency = SYSEXEC_POOL_SIZE );
+
+    /**
+     * Destructor that cancels all the jobs and joins the workers
+     */
+    virtual ~SysExecPool        ( );
+
+    /**
+     * Get the system-wide pool singleton
+     */
+    static SysExecPoolPtr       Default     ( );
+
+    /**
+     * Schedule the given command for execution and return the job object
+     */
+    SysExecJobPtr               submit      ( const std::string& app, const std::string& cmdline, const SysExecConfig& config = SysExecConfig::Default(), const callbackSysExec& cb = callbackSysExec(), const sysExecHandler& handler = sysExecHandler() );
+
+    /**
+     * Change the maximum number of commands to run in parallel
+     */
+    void                        setConcurrency( int concurrency );
+
+    /**
+     * Cancel all the queued and running jobs
+     */
+    void                        cancelAll   ( );
+
+private:
+
+    /**
+     * The worker thread main loop
+     */
+    void                        workerLoop  ( );
+
+    // Pool state
+    int                         concurrency;
+    int                         numWorkers;
+    int                         numIdle;
+    bool                        stopping;
+    std::list< SysExecJobPtr >  queue;
+    std::list< SysExecJobPtr >  running;
+    boost::thread_group         workers;
+    boost::mutex                poolMutex;
+    boost::condition_variable   poolCond;
+
+};
+
+#endif /* end of include guard: SYSEXECPOOL_H */
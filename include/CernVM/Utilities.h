@@ -52,6 +52,7 @@
 #include <boost/function.hpp>
 #include <boost/shared_array.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/locks.hpp>
@@ -112,6 +113,15 @@
 #define SYSEXEC_SLEEP_DELAY 100
 #define SYSEXEC_RETRY_DELAY 1000
 
+// Size of the buffer used for reading the output of sysExec( )
+#define SYSEXEC_BUFFER_SIZE 0x10000
+
+// Default number of commands the SysExecPool runs in parallel
+#define SYSEXEC_POOL_SIZE   4
+
+// Special exit code of a sysExecHandler that requests a fork/exec fallback
+#define SYSEXEC_FALLBACK    251
+
 // GZip decompression block size (64k)
 #define GZ_BLOCK_SIZE 0x10000
 
@@ -150,6 +160,68 @@ typedef boost::function< void (const std::string&, const int, const std::string&
 typedef boost::function<void ( const boost::shared_array<uint8_t>&, const size_t)>   callbackData;
 typedef boost::function<void ( const size_t, const size_t, const std::string& )>     callbackProgress;
 
+/**
+ * Cancellation token for the sysExec() function.
+ *
+ * A token can be cancelled only once (until reset) and cancelling it also cancels
+ * all the tokens created through it's createChild() function.
+ */
+class SysExecToken;
+typedef boost::shared_ptr< SysExecToken >   SysExecTokenPtr;
+class SysExecToken {
+public:
+
+    /**
+     * Default Constructor
+     */
+    SysExecToken() : cancelled(false), tokenMutex(), children() { 
+#ifndef _WIN32
+        wakeFd[0] = -1; wakeFd[1] = -1;
+#endif
+    };
+
+    /**
+     * Destructor that releases the wake-up descriptors
+     */
+    virtual ~SysExecToken();
+
+    /**
+     * Cancel the token and all of it's children
+     */
+    void                        cancel();
+
+    /**
+     * Reset the cancelled state
+     */
+    void                        reset();
+
+    /**
+     * Check if the token is cancelled
+     */
+    bool                        isCancelled();
+
+    /**
+     * Create a token that is cancelled when this token is cancelled
+     */
+    SysExecTokenPtr             createChild();
+
+#ifndef _WIN32
+    /**
+     * Return a descriptor that becomes readable when the token is cancelled
+     */
+    int                         descriptor();
+#endif
+
+private:
+    bool                        cancelled;
+    boost::mutex                tokenMutex;
+    std::vector< boost::weak_ptr< SysExecToken > > children;
+#ifndef _WIN32
+    int                         wakeFd[2];
+#endif
+
+};
+
 /* Parameters for the SysExec Function */
 class SysExecConfig {
 public:
@@ -163,13 +235,13 @@ public:
      * Default Constructor
      */
     SysExecConfig( int v_retries = 1, int v_timeout = SYSEXEC_TIMEOUT, bool v_gui = false )
-        : retries(v_retries), timeout(v_timeout), gui(v_gui), errStrings() { };
+        : retries(v_retries), timeout(v_timeout), gui(v_gui), errStrings(), token() { };
 
     /**
      * Copy Constructor
      */
     SysExecConfig( const SysExecConfig& src )
-        : retries(src.retries), timeout(src.timeout), gui(src.gui), errStrings(src.errStrings) { };
+        : retries(src.retries), timeout(src.timeout), gui(src.gui), errStrings(src.errStrings), token(src.token) { };
 
     /**
      * Assign operator
@@ -198,13 +270,31 @@ public:
      */
     SysExecConfig&              setGUI( bool gui );
 
+    /**
+     * Change the cancellation token and return this class reference
+     */
+    SysExecConfig&              setToken( const SysExecTokenPtr& token );
+
+    /**
+     * Check if the execution was cancelled, either through the token
+     * or globally through abortSysExec()
+     */
+    bool                        isCancelled( ) const;
+
     int                         retries; 
     int                         timeout;
     bool                        gui;
     std::map<std::string,int>   errStrings;
+    SysExecTokenPtr             token;
 
 };
 
+/**
+ * A function that performs a single sysExec() attempt. It can return SYSEXEC_FALLBACK
+ * if it cannot serve the request, in which case the command is forked & executed as usual.
+ */
+typedef boost::function< int ( const std::string&, const std::string&, std::vector<std::string> *, std::string *, const SysExecConfig& ) > sysExecHandler;
+
 /**
  * Allocate a new GUID
  */
@@ -252,6 +342,45 @@ int                                                 sha256_file     ( std::strin
  */
 int                                                 sha256_buffer   ( std::string path, std::string * checksum );
 
+/**
+ * Incremental sha256 signature, for hashing the data while they are
+ * streamed (ex. downloaded), instead of reading them back from disk.
+ */
+class SHA256Stream {
+public:
+
+    /**
+     * Start a new signature
+     */
+    SHA256Stream                ( );
+    ~SHA256Stream               ( );
+
+    /**
+     * Restart the signature
+     */
+    void                        reset       ( );
+
+    /**
+     * Hash the given data
+     */
+    void                        update      ( const char * data, size_t len );
+
+    /**
+     * Complete the signature and return it in hex (like sha256_file)
+     */
+    std::string                 hexdigest   ( );
+
+private:
+
+    // The EVP_MD_CTX (opaque, so the openssl headers are not needed here)
+    void *                      mdctx;
+
+    // Non-copyable
+    SHA256Stream                ( const SHA256Stream& );
+    SHA256Stream&               operator=   ( const SHA256Stream& );
+
+};
+
 /**
  * Check if the given file is empty
  */
@@ -277,22 +406,50 @@ int                                                 sysExec         ( const std:
                                                                       const SysExecConfig& config
                                                                     );
 
+/**
+ * Same as sysExec() above, but every attempt is delegated to the specified handler
+ * instead of forking a new process.
+ */
+int                                                 sysExec         ( const std::string& app, 
+                                                                      const std::string& cmdline, 
+                                                                      std::vector<std::string> * stdoutList, 
+                                                                      std::string * rawStderr, 
+                                                                      const SysExecConfig& config,
+                                                                      const sysExecHandler& handler
+                                                                    );
+
 /**
  * Platform-independant function to execute the given command-line without
  * waiting for it to complete.
  */
 int                                                 sysExecAsync    ( std::string app, std::string cmdline );
 
+#ifndef _WIN32
+/**
+ * Close all the descriptors from the given one and above. It's meant to be used
+ * by a forked child before exec(), so it does not allocate any memory.
+ */
+void                                                closeDescriptorsFrom ( int lowfd );
+#endif
+
 /**
  * Initialize sysExec() environment
  */
 void                                                initSysExec     ( );
 
 /**
- * Abort an actively running sysExec() command
+ * Abort all the actively running sysExec() commands in the process.
+ *
+ * To abort only the commands of a particular caller, use a SysExecToken
+ * in the SysExecConfig instead.
  */
 void                                                abortSysExec    ( );
 
+/**
+ * Return the process-wide cancellation token that is cancelled by abortSysExec()
+ */
+SysExecTokenPtr                                     sysExecGlobalToken ( );
+
 /**
  * Cross-platform function to return the temporary folder path
  */
@@ -376,6 +533,52 @@ bool                                                isSanitized     ( std::strin
  */
 int                                                 decompressFile  ( const std::string& filename, const std::string& output );
 
+/**
+ * Incremental GZip decompression, for the data that are not on the disk yet
+ * (ex. while they are downloaded). The extracted data are written to the
+ * given stream.
+ */
+class GZInflateStream {
+public:
+
+    /**
+     * Start decompressing to the given stream
+     */
+    GZInflateStream             ( std::ostream * output );
+    ~GZInflateStream            ( );
+
+    /**
+     * Decompress the next block of compressed data.
+     * Returns HVE_IO_ERROR if the data are not valid or the output failed.
+     */
+    int                         update      ( const char * data, size_t len );
+
+    /**
+     * Check if the compressed data were complete.
+     * Returns HVE_OK if the GZip stream was fully decompressed.
+     */
+    int                         finish      ( );
+
+    /**
+     * The number of bytes extracted so far
+     */
+    long long                   size        ( );
+
+private:
+
+    // The z_stream (opaque, so the zlib headers are not needed here)
+    void *                      zstream;
+    std::ostream *              output;
+    long long                   written;
+    bool                        ended;
+    bool                        failed;
+
+    // Non-copyable
+    GZInflateStream             ( const GZInflateStream& );
+    GZInflateStream&            operator=   ( const GZInflateStream& );
+
+};
+
 /**
  * Encode the given string for URL
  */
@@ -21,8 +21,177 @@
 #include "CernVM/DownloadProvider.h"
 #include "CernVM/Hypervisor.h"
 
+#include <list>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
 DownloadProviderPtr systemProvider;
 
+/**
+ * A pipe that hashes, extracts and writes the downloaded data from a
+ * different thread, so the transfer does not have to wait for the disk.
+ *
+ * The data waiting in the pipe are limited to DP_PIPE_BUFFER_SIZE bytes,
+ * after which push() blocks until the extraction catches up.
+ */
+class DownloadInflatePipe {
+public:
+
+    /**
+     * Start the extraction thread
+     */
+    DownloadInflatePipe( std::ostream * output, SHA256Stream * digest ) 
+        : received(0), inflater(output), digest(digest), chunks(), bufferSize(0), closing(false), failed(false), pipeMutex(), pipeCond() {
+        CRASH_REPORT_BEGIN;
+        thread = new boost::thread( boost::bind( &DownloadInflatePipe::run, this ) );
+        CRASH_REPORT_END;
+    };
+
+    /**
+     * Stop the extraction thread
+     */
+    ~DownloadInflatePipe() {
+        CRASH_REPORT_BEGIN;
+        finish();
+        CRASH_REPORT_END;
+    };
+
+    /**
+     * Queue a block of downloaded data. Returns false if the
+     * extraction has failed and the transfer should be aborted.
+     */
+    bool push( const char * data, size_t len ) {
+        CRASH_REPORT_BEGIN;
+
+        // This runs in the cURL write callback, which we cannot throw through.
+        // An interrupted thread stops at the next progress callback instead.
+        boost::this_thread::disable_interruption noInterruption;
+
+        boost::mutex::scoped_lock lock(pipeMutex);
+        while (!failed && (bufferSize >= DP_PIPE_BUFFER_SIZE))
+            pipeCond.wait( lock );
+        if (failed) return false;
+        chunks.push_back( std::string( data, len ) );
+        bufferSize += len;
+        received += len;
+        pipeCond.notify_all();
+        return true;
+        CRASH_REPORT_END;
+    };
+
+    /**
+     * Wait for the queued data to be written and return
+     * HVE_OK if the extraction was completed.
+     */
+    int finish() {
+        CRASH_REPORT_BEGIN;
+
+        // The extraction thread must be gone before the pipe is, even if
+        // the calling thread was interrupted
+        boost::this_thread::disable_interruption noInterruption;
+
+        if (thread != NULL) {
+            {
+                boost::mutex::scoped_lock lock(pipeMutex);
+                closing = true;
+                pipeCond.notify_all();
+            }
+            thread->join();
+            delete thread;
+            thread = NULL;
+        }
+        if (failed) return HVE_IO_ERROR;
+        return inflater.finish();
+        CRASH_REPORT_END;
+    };
+
+    // The number of bytes pushed in the pipe
+    size_t                      received;
+
+private:
+
+    /**
+     * Extraction thread main loop
+     */
+    void run() {
+        CRASH_REPORT_BEGIN;
+        for (;;) {
+            std::string chunk;
+
+            // Wait for data
+            {
+                boost::mutex::scoped_lock lock(pipeMutex);
+                while (!closing && chunks.empty())
+                    pipeCond.wait( lock );
+                if (chunks.empty()) return;
+                chunk.swap( chunks.front() );
+                chunks.pop_front();
+                bufferSize -= chunk.length();
+                pipeCond.notify_all();
+            }
+
+            // Hash and extract
+            if (digest != NULL)
+                digest->update( chunk.c_str(), chunk.length() );
+            if (inflater.update( chunk.c_str(), chunk.length() ) != HVE_OK) {
+                boost::mutex::scoped_lock lock(pipeMutex);
+                failed = true;
+                chunks.clear();
+                bufferSize = 0;
+                pipeCond.notify_all();
+                return;
+            }
+
+        }
+        CRASH_REPORT_END;
+    };
+
+    GZInflateStream             inflater;
+    SHA256Stream *              digest;
+
+    // The data waiting to be extracted
+    std::list< std::string >    chunks;
+    size_t                      bufferSize;
+
+    // Thread state
+    bool                        closing;
+    bool                        failed;
+    boost::thread *             thread;
+    boost::mutex                pipeMutex;
+    boost::condition_variable   pipeCond;
+
+};
+
+/**
+ * Keep the state of a CURLProvider consistent while a transfer runs. When the
+ * object goes away (even with an exception) the output stream is closed, the
+ * extraction pipe is released and the operation is over.
+ */
+class CURLOperation {
+public:
+    CURLOperation( CURLProvider * self, DownloadInflatePipe * pipe = NULL ) : self(self), ownsPipe(pipe != NULL) {
+        if (ownsPipe) self->pipe = pipe;
+        self->operationInstances++;
+    };
+    ~CURLOperation() {
+        if (self->fStream.is_open()) self->fStream.close();
+        if (ownsPipe) self->pipe = NULL;
+        self->operationInstances--;
+    };
+private:
+    CURLProvider *              self;
+    bool                        ownsPipe;
+};
+
 /**
  * Get system-wide download provider singleton
  */
@@ -43,6 +212,44 @@ void DownloadProvider::setDefault( const DownloadProviderPtr& provider ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Download a file and calculate its checksum afterwards
+ * (for the providers that cannot do it while downloading)
+ */
+int DownloadProvider::downloadFileSHA256( const std::string &URL, const std::string &destination, std::string * checksum, const VariableTaskPtr& pf ) {
+    CRASH_REPORT_BEGIN;
+    int ans = downloadFile( URL, destination, pf );
+    if (ans != HVE_OK) return ans;
+    if (sha256_file( destination, checksum ) != 0) return HVE_IO_ERROR;
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Download a compressed file and extract it afterwards
+ * (for the providers that cannot do it while downloading)
+ */
+int DownloadProvider::downloadFileGZ( const std::string &URL, const std::string &destination, std::string * checksum, const VariableTaskPtr& pf ) {
+    CRASH_REPORT_BEGIN;
+    std::string sGZFilename = destination + ".gz";
+    int ans = downloadFileSHA256( URL, sGZFilename, checksum, pf );
+    if (ans == HVE_OK)
+        ans = decompressFile( sGZFilename, destination );
+    ::remove( sGZFilename.c_str() );
+    return ans;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Download a file normally
+ * (for the providers that cannot download segments)
+ */
+int DownloadProvider::downloadFileSegmented( const std::string &URL, const std::string &destination, int /* numSegments */, const VariableTaskPtr& pf ) {
+    CRASH_REPORT_BEGIN;
+    return downloadFile( URL, destination, pf );
+    CRASH_REPORT_END;
+}
+
 /**
  * Local function to fire the progress event accordingly
  */
@@ -66,11 +273,15 @@ void DownloadProvider::fireProgressEvent( const VariableTaskPtr& fb, size_t pos,
 /**
  * Local function to write data to osstream
  */
-void DownloadProvider::writeToStream( std::ostream * stream, const VariableTaskPtr& fb, long max_size, const char * ptr, size_t data ) {
+void DownloadProvider::writeToStream( std::ostream * stream, const VariableTaskPtr& fb, long max_size, const char * ptr, size_t data, SHA256Stream * digest ) {
     CRASH_REPORT_BEGIN;
     
     // Write data to the file
     stream->write( ptr, data );
+
+    // Hash the data while we have them
+    if (digest != NULL)
+        digest->update( ptr, data );
     
     // Update progress
     if (max_size != 0) {
@@ -87,24 +298,158 @@ void DownloadProvider::writeToStream( std::ostream * stream, const VariableTaskP
 }
 
 /**
- * Extract the content-length from function
+ * Check if the header line is the given header (case-insensitive)
+ * and get its value
+ */
+bool __curl_header( const std::string& line, const std::string& name, std::string * value ) {
+    CRASH_REPORT_BEGIN;
+    if (line.length() <= name.length()) return false;
+    for (size_t i = 0; i < name.length(); i++) {
+        if (tolower(line[i]) != tolower(name[i])) return false;
+    }
+    size_t a = line.find_first_not_of( " \t", name.length() );
+    size_t b = line.find_last_not_of( " \t\r\n" );
+    if ((a == std::string::npos) || (b == std::string::npos) || (b < a)) {
+        *value = "";
+    } else {
+        *value = line.substr( a, b - a + 1 );
+    }
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Extract the content-length and the validators of the file from the headers
  */
 size_t __curl_headerfunc( void *ptr, size_t size, size_t nmemb, CURLProvider * self) {
     CRASH_REPORT_BEGIN;
     size_t dataLen = size * nmemb;
+    std::string value;
     
     // Move data to std::String
     std::string cppString( (char *) ptr, dataLen );
-    if ((cppString.length() > 16) &&  (cppString.substr(0,16).compare("Content-Length: ") == 0)) {
-        cppString = cppString.substr(16, cppString.length()-18 );
-        CVMWA_LOG("Debug", "Found Content-Length: '" << cppString << "'");
-        self->maxStreamSize = ston<size_t>( cppString );
+    if ((cppString.length() > 5) && (cppString.substr(0,5).compare("HTTP/") == 0)) {
+        // The status of the response (or of the next one, after a redirect)
+        size_t a = cppString.find( ' ' );
+        self->httpStatus = (a == std::string::npos) ? 0 : ston<int>( cppString.substr( a+1, 3 ) );
+    } else if (__curl_header( cppString, "Content-Length:", &value )) {
+        CVMWA_LOG("Debug", "Found Content-Length: '" << value << "'");
+        self->maxStreamSize = ston<size_t>( value );
+        // A partial response contains only what we are missing
+        if (self->httpStatus == 206)
+            self->maxStreamSize += (long) self->partOffset;
+    } else if (__curl_header( cppString, "ETag:", &value )) {
+        self->httpETag = value;
+    } else if (__curl_header( cppString, "Last-Modified:", &value )) {
+        self->httpModified = value;
     }
     
     return dataLen;
     CRASH_REPORT_END;
 }
 
+/**
+ * Save the state of a resumable download, with the data up to the given offset.
+ * Returns false if the server did not send a validator, so it cannot be resumed.
+ */
+bool __curl_save_resume( CURLProvider * self, long long offset ) {
+    CRASH_REPORT_BEGIN;
+    if (self->httpETag.empty() && self->httpModified.empty()) return false;
+    if (self->digest == NULL) return false;
+
+    // Write the state file
+    std::string sStateFile = self->partFile + ".state";
+    std::ofstream fState( sStateFile.c_str(), std::ofstream::binary | std::ofstream::trunc );
+    fState << "url=" << self->partURL << std::endl;
+    fState << "etag=" << self->httpETag << std::endl;
+    fState << "modified=" << self->httpModified << std::endl;
+    fState << "offset=" << offset << std::endl;
+    fState.close();
+    if (fState.fail()) {
+        ::remove( sStateFile.c_str() );
+        return false;
+    }
+
+    self->partSaved = offset;
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Hash the first 'length' bytes of the given file
+ */
+bool __hash_file_prefix( const std::string& path, long long length, SHA256Stream * digest ) {
+    CRASH_REPORT_BEGIN;
+    std::ifstream file( path.c_str(), std::ifstream::in | std::ifstream::binary );
+    if (!file.good()) return false;
+    char buffer[4096];
+    while (length > 0) {
+        std::streamsize len = (length < (long long)sizeof(buffer)) ? (std::streamsize)length : (std::streamsize)sizeof(buffer);
+        file.read( buffer, len );
+        if (file.gcount() != len) return false;
+        digest->update( buffer, (size_t)len );
+        length -= len;
+    }
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Load the state of the interrupted download of partURL and prepare
+ * the partial file and the signature for continuing it.
+ */
+bool __curl_load_resume( CURLProvider * self ) {
+    CRASH_REPORT_BEGIN;
+    const std::string& partFile = self->partFile;
+    std::string sStateFile = partFile + ".state";
+    if (!file_exists( partFile ) || !file_exists( sStateFile )) return false;
+
+    // Read the state file
+    std::map< std::string, std::string > state;
+    std::ifstream fState( sStateFile.c_str() );
+    std::string line, key, value;
+    while (std::getline( fState, line )) {
+        if (getKV( line, &key, &value, '=', 0 ))
+            state[key] = value;
+    }
+    fState.close();
+
+    // It must be the same file, and we must have all the data it describes
+    if (state["url"] != self->partURL) return false;
+    long long partOffset = ston<long long>( state["offset"] );
+    boost::system::error_code ec;
+    boost::uintmax_t partSize = boost::filesystem::file_size( partFile, ec );
+    if (ec || (partOffset <= 0) || ((boost::uintmax_t)partOffset > partSize)) return false;
+
+    // Prefer a strong ETag, since weak ones cannot be used for ranges
+    std::string sETag = state["etag"];
+    if (!sETag.empty() && (sETag.substr(0,2) != "W/")) {
+        self->partValidator = sETag;
+    } else if (!state["modified"].empty()) {
+        self->partValidator = state["modified"];
+    } else {
+        return false;
+    }
+
+    // Drop whatever was written after the saved offset and hash the rest
+    // again. Reading the partial file back costs less than downloading it,
+    // and the state does not depend on the internals of the hash.
+    if (partSize > (boost::uintmax_t)partOffset) {
+        boost::filesystem::resize_file( partFile, partOffset, ec );
+        if (ec) return false;
+    }
+    self->digest->reset();
+    if (!__hash_file_prefix( partFile, partOffset, self->digest )) return false;
+
+    // Keep the validators, in case the next try fails before
+    // the server sends them again
+    self->partOffset = partOffset;
+    self->httpETag = sETag;
+    self->httpModified = state["modified"];
+    return true;
+    CRASH_REPORT_END;
+}
+
 /**
  * Callback function for CURL data
  */
@@ -114,8 +459,37 @@ size_t __curl_datacb_file(void *ptr, size_t size, size_t nmemb, CURLProvider * s
 
     //CVMWA_LOG("Debug", "cURL File callback (size=" << dataLen << ")");
 
+    // Pass it to the extraction thread, or abort the transfer if it has failed
+    if (self->pipe != NULL) {
+        if (!self->pipe->push( (const char *) ptr, dataLen )) return 0;
+        if (self->maxStreamSize != 0)
+            DownloadProvider::fireProgressEvent( self->pf, self->pipe->received, self->maxStreamSize );
+        return dataLen;
+    }
+
+    // We asked for the rest of the file, but the server sent all of it
+    // (it does not support ranges or the file has changed), so start over
+    if ((self->partOffset > 0) && (self->httpStatus == 200)) {
+        CVMWA_LOG("Info", "Cannot resume the download, starting from the beginning");
+        self->fStream.close();
+        self->fStream.clear();
+        self->fStream.open( self->partFile.c_str(), std::ofstream::binary | std::ofstream::trunc );
+        if (self->digest != NULL) self->digest->reset();
+        self->partOffset = 0;
+        self->partSaved = 0;
+    }
+
     // Write to file stream
-    DownloadProvider::writeToStream( &(self->fStream), self->pf, self->maxStreamSize, (const char *) ptr, dataLen );
+    DownloadProvider::writeToStream( &(self->fStream), self->pf, self->maxStreamSize, (const char *) ptr, dataLen, self->digest );
+
+    // Save the resume state every now and then
+    if (!self->partFile.empty()) {
+        long long pos = self->fStream.tellp();
+        if (pos - self->partSaved >= DP_RESUME_SAVE_INTERVAL) {
+            self->fStream.flush();
+            if (!self->fStream.fail()) __curl_save_resume( self, pos );
+        }
+    }
     
     // Return data len
     return dataLen;
@@ -139,6 +513,184 @@ size_t __curl_datacb_string(void *ptr, size_t size, size_t nmemb, CURLProvider *
     CRASH_REPORT_END;
 }
 
+/**
+ * A range of the file fetched by a segmented download
+ */
+struct CURLSegment {
+    CURLProvider *              self;
+    CURL *                      curl;
+    int                         fd;
+    long long                   offset;
+    long long                   end;
+    long long *                 received;
+    long long                   size;
+    int                         retries;
+    bool                        checked;
+    bool                        fatal;
+    std::string                 range;
+};
+
+/**
+ * Write data at the given position of the file
+ */
+bool __segment_write( int fd, const char * ptr, size_t len, long long offset ) {
+    CRASH_REPORT_BEGIN;
+    while (len > 0) {
+#ifdef _WIN32
+        // The segments are written from a single thread, so seeking is safe
+        if (_lseeki64( fd, offset, SEEK_SET ) < 0) return false;
+        int ans = _write( fd, ptr, (unsigned int) len );
+#else
+        ssize_t ans = pwrite( fd, ptr, len, (off_t) offset );
+#endif
+        if (ans <= 0) return false;
+        ptr += ans;
+        len -= ans;
+        offset += ans;
+    }
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Callback function for the data of a segment
+ */
+size_t __curl_datacb_segment(void *ptr, size_t size, size_t nmemb, CURLSegment * seg ) {
+    CRASH_REPORT_BEGIN;
+    size_t dataLen = size * nmemb;
+
+    // The server must send exactly the range we asked for
+    if (!seg->checked) {
+        long code = 0;
+        curl_easy_getinfo( seg->curl, CURLINFO_RESPONSE_CODE, &code );
+        if (code != 206) {
+            CVMWA_LOG("Error", "The server did not send the requested range (HTTP " << code << ")");
+            seg->fatal = true;
+            return 0;
+        }
+        seg->checked = true;
+    }
+    if (seg->offset + (long long)dataLen > seg->end + 1) {
+        CVMWA_LOG("Error", "The server sent more data than requested");
+        seg->fatal = true;
+        return 0;
+    }
+
+    // Write it in place
+    if (!__segment_write( seg->fd, (const char *) ptr, dataLen, seg->offset )) {
+        CVMWA_LOG("Error", "Unable to write the downloaded data");
+        seg->fatal = true;
+        return 0;
+    }
+    seg->offset += dataLen;
+
+    // Update the progress of the whole file
+    *(seg->received) += dataLen;
+    DownloadProvider::fireProgressEvent( seg->self->pf, (size_t) *(seg->received), (size_t) seg->size );
+
+    return dataLen;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Discard the data of a probe request
+ */
+size_t __curl_datacb_discard(void * /* ptr */, size_t size, size_t nmemb, void * /* unused */ ) {
+    return size * nmemb;
+}
+
+/**
+ * Extract the total size of the file from the headers of a probe request
+ */
+size_t __curl_headerfunc_probe( void *ptr, size_t size, size_t nmemb, std::map< std::string, std::string > * headers ) {
+    CRASH_REPORT_BEGIN;
+    size_t dataLen = size * nmemb;
+    std::string cppString( (char *) ptr, dataLen ), value;
+    if (__curl_header( cppString, "Content-Range:", &value )) {
+        (*headers)["range"] = value;
+    } else if (__curl_header( cppString, "ETag:", &value )) {
+        (*headers)["etag"] = value;
+    } else if (__curl_header( cppString, "Last-Modified:", &value )) {
+        (*headers)["modified"] = value;
+    }
+    return dataLen;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Apply the common options of the file transfers to the given handle
+ */
+void __curl_setup( CURL * curl ) {
+    CRASH_REPORT_BEGIN;
+    curl_easy_setopt(curl, CURLOPT_AUTOREFERER, 1);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L );
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 7200L );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the server can send ranges of the file, and get its
+ * size, its final URL (after redirects) and a validator for it.
+ */
+bool __curl_probe_ranges( const std::string& url, long long * size, std::string * finalURL, std::string * validator ) {
+    CRASH_REPORT_BEGIN;
+    std::map< std::string, std::string > headers;
+    CURL * curl = curl_easy_init();
+    if (!curl) return false;
+
+    // Ask for the first byte
+    __curl_setup( curl );
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_RANGE, "0-0");
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L );
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, __curl_headerfunc_probe);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, __curl_datacb_discard);
+    CURLcode res = curl_easy_perform(curl);
+
+    // We need a partial response with the total size in it
+    long code = 0;
+    char * effectiveURL = NULL;
+    curl_easy_getinfo( curl, CURLINFO_RESPONSE_CODE, &code );
+    curl_easy_getinfo( curl, CURLINFO_EFFECTIVE_URL, &effectiveURL );
+    if (effectiveURL != NULL) *finalURL = effectiveURL;
+    curl_easy_cleanup( curl );
+    if ((res != CURLE_OK) || (code != 206)) return false;
+    size_t a = headers["range"].find( '/' );
+    if (a == std::string::npos) return false;
+    *size = ston<long long>( headers["range"].substr( a+1 ) );
+
+    // Prefer a strong ETag, since weak ones cannot be used for ranges
+    std::string sETag = headers["etag"];
+    if (!sETag.empty() && (sETag.substr(0,2) != "W/")) {
+        *validator = sETag;
+    } else {
+        *validator = headers["modified"];
+    }
+    return (*size > 0);
+    CRASH_REPORT_END;
+}
+
+/**
+ * Start (or continue) the download of a segment
+ */
+void __curl_segment_start( CURLM * multi, CURLSegment * seg, const std::string& url, struct curl_slist * headers ) {
+    CRASH_REPORT_BEGIN;
+    seg->checked = false;
+    seg->range = ntos<long long>( seg->offset ) + "-" + ntos<long long>( seg->end );
+    curl_easy_setopt(seg->curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(seg->curl, CURLOPT_RANGE, seg->range.c_str());
+    curl_easy_setopt(seg->curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(seg->curl, CURLOPT_WRITEFUNCTION, __curl_datacb_segment);
+    curl_easy_setopt(seg->curl, CURLOPT_WRITEDATA, seg);
+    curl_easy_setopt(seg->curl, CURLOPT_PRIVATE, seg);
+    curl_multi_add_handle( multi, seg->curl );
+    CRASH_REPORT_END;
+}
+
 /**
  * Callback function for checking for aborted CURL state
  */
@@ -151,6 +703,11 @@ int __curl_xferinfo(CURLProvider * self, curl_off_t dltotal, curl_off_t dlnow, c
         return -1;
     }
 
+    // Also stop if the thread we are running on was interrupted (ex. an
+    // abandoned FSM branch), since we cannot throw through cURL
+    if (boost::this_thread::interruption_requested())
+        return -1;
+
     // Return 0 to continue downlad
     return 0;
 
@@ -158,13 +715,24 @@ int __curl_xferinfo(CURLProvider * self, curl_off_t dltotal, curl_off_t dlnow, c
 }
 
 /**
- * Download a file using CURL
+ * Download a file using CURL, over many connections if configured so
  */
 int CURLProvider::downloadFile( const std::string& url, const std::string& destination, const VariableTaskPtr& pf ) {
     CRASH_REPORT_BEGIN;
+    if (segments > 1)
+        return downloadFileSegmented( url, destination, segments, pf );
+    return downloadFileSingle( url, destination, pf );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Download a file using CURL over a single connection
+ */
+int CURLProvider::downloadFileSingle( const std::string& url, const std::string& destination, const VariableTaskPtr& pf ) {
+    CRASH_REPORT_BEGIN;
 
     // We are in operation
-    operationInstances++;
+    CURLOperation operation( this );
 
     // Setup CURL url
     CVMWA_LOG("Debug", "Downloading file from '" << url << "'");
@@ -191,35 +759,305 @@ int CURLProvider::downloadFile( const std::string& url, const std::string& desti
     curl_easy_setopt(curl, CURLOPT_HEADERDATA, this); //sharedPtr.get() );
     curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
     curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0);
+
+    // Continue a partial download, if the file was not changed in the mean time
+    // (using CURLOPT_RANGE, because CURLOPT_RESUME_FROM fails if the server
+    //  sends the whole file instead)
+    struct curl_slist * headers = NULL;
+    std::string sRange = ntos<long long>( partOffset ) + "-";
+    this->httpStatus = 0;
+    if (partOffset > 0) {
+        headers = curl_slist_append( headers, ("If-Range: " + partValidator).c_str() );
+        curl_easy_setopt(curl, CURLOPT_RANGE, sRange.c_str() );
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers );
+    }
     
     // Open local file
     CVMWA_LOG("Debug", "Oppening local output stream '" << destination << "'");
     fStream.clear();
-    fStream.open( destination.c_str(), std::ofstream::binary );
+    if (partOffset > 0) {
+        fStream.open( destination.c_str(), std::ofstream::binary | std::ofstream::in | std::ofstream::out );
+        fStream.seekp( partOffset );
+    } else {
+        fStream.open( destination.c_str(), std::ofstream::binary );
+    }
     if (fStream.fail()) {
         CVMWA_LOG("Error", "OFStream error" );
-        operationInstances--;
+        curl_easy_setopt(curl, CURLOPT_RANGE, NULL );
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL );
+        curl_slist_free_all( headers );
         return HVE_IO_ERROR;
     }
     
     // Initiate connection (we have specified CURLOPT_CONNECT_ONLY)
     CURLcode res = curl_easy_perform(curl);
+
+    // Don't resume the next transfers
+    curl_easy_setopt(curl, CURLOPT_RANGE, NULL );
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL );
+    curl_slist_free_all( headers );
+
+    // Wait for the extraction thread to write everything
+    int pipeRes = HVE_OK;
+    if (pipe != NULL) pipeRes = pipe->finish();
+
     if (res != CURLE_OK) {
         CVMWA_LOG("Error", "cURL Error #" << res );
-        operationInstances--;
         return HVE_IO_ERROR;
+    } else if (pipeRes != HVE_OK) {
+        CVMWA_LOG("Error", "Unable to extract the downloaded data" );
+        return pipeRes;
     } else {
         CVMWA_LOG("Info", "cURL Download completed" );
     }
 
     // Notify completion
     if (pf) pf->complete("Download completed");
+    return HVE_OK;
     
-    // Close stream
-    fStream.close();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Download a file using CURL and hash it while it's written. The data are
+ * kept in a partial file until the download is completed, so an interrupted
+ * download can be resumed from where it stopped.
+ */
+int CURLProvider::downloadFileSHA256( const std::string& url, const std::string& destination, std::string * checksum, const VariableTaskPtr& pf ) {
+    CRASH_REPORT_BEGIN;
+
+    // The segments are hashed after the download. SHA256 needs the data in order,
+    // but the segments progress in parallel, so only the first one could be hashed
+    // while it's written. The rest would have to be kept in memory (up to the whole
+    // file) or be read back anyway. Reading them right after they are written at
+    // least finds them in the page cache.
+    if (segments > 1)
+        return DownloadProvider::downloadFileSHA256( url, destination, checksum, pf );
+
+    SHA256Stream sha;
+    std::string sPartFile = destination + ".part";
+    std::string sStateFile = sPartFile + ".state";
+
+    // Check if we have already downloaded a part of it
+    this->digest = &sha;
+    this->partFile = sPartFile;
+    this->partURL = url;
+    this->partOffset = 0;
+    this->partValidator = "";
+    this->httpETag = "";
+    this->httpModified = "";
+    if (__curl_load_resume( this )) {
+        CVMWA_LOG("Info", "Resuming download of '" << url << "' from " << partOffset << " bytes" );
+    } else {
+        sha.reset();
+        this->partOffset = 0;
+        this->partValidator = "";
+        this->httpETag = "";
+        this->httpModified = "";
+        ::remove( sPartFile.c_str() );
+        ::remove( sStateFile.c_str() );
+    }
+
+    // Download with the digest attached to the write callback
+    this->partSaved = partOffset;
+    int ans = downloadFileSingle( url, sPartFile, pf );
+
+    // Check for write errors, since we did not read the file back
+    bool writeError = fStream.fail();
+    if ((ans == HVE_OK) && writeError) {
+        CVMWA_LOG("Error", "OFStream error while writing '" << destination << "'" );
+        ans = HVE_IO_ERROR;
+    }
+
+    // Keep what we have for the next try, unless the server
+    // refused the request or we could not write the data
+    if (ans != HVE_OK) {
+        long code = 0;
+        curl_easy_getinfo( curl, CURLINFO_RESPONSE_CODE, &code );
+        boost::system::error_code ec;
+        boost::uintmax_t partSize = boost::filesystem::file_size( sPartFile, ec );
+        if (writeError || ec || (partSize == 0) || ((code >= 400) && (code < 500)) || !__curl_save_resume( this, partSize )) {
+            ::remove( sPartFile.c_str() );
+            ::remove( sStateFile.c_str() );
+        }
+    }
+
+    this->digest = NULL;
+    this->partFile = "";
+    this->partOffset = 0;
+    if (ans != HVE_OK) return ans;
+
+    // Put it in place
+    ::remove( sStateFile.c_str() );
+    ::remove( destination.c_str() );
+    if (::rename( sPartFile.c_str(), destination.c_str() ) != 0) {
+        CVMWA_LOG("Error", "Unable to rename '" << sPartFile << "' to '" << destination << "'" );
+        ::remove( sPartFile.c_str() );
+        return HVE_IO_ERROR;
+    }
+
+    *checksum = sha.hexdigest();
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Download a compressed file using CURL and extract it while it's downloaded
+ */
+int CURLProvider::downloadFileGZ( const std::string& url, const std::string& destination, std::string * checksum, const VariableTaskPtr& pf ) {
+    CRASH_REPORT_BEGIN;
+    SHA256Stream sha;
+
+    // Download through the extraction pipe
+    DownloadInflatePipe inflatePipe( &fStream, &sha );
+    int ans;
+    {
+        CURLOperation operation( this, &inflatePipe );
+        ans = downloadFileSingle( url, destination, pf );
+    }
+    if (ans != HVE_OK) return ans;
+
+    *checksum = sha.hexdigest();
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Download a file using CURL over many connections, each one fetching a
+ * different range of it and writing it in place. If the server cannot
+ * send ranges, or the file is small, it's downloaded normally.
+ */
+int CURLProvider::downloadFileSegmented( const std::string& url, const std::string& destination, int numSegments, const VariableTaskPtr& pf ) {
+    CRASH_REPORT_BEGIN;
+
+    // Check if the server supports ranges
+    long long size = 0;
+    std::string sURL = url, sValidator;
+    if (!__curl_probe_ranges( url, &size, &sURL, &sValidator )) {
+        CVMWA_LOG("Info", "The server does not support ranges, downloading '" << url << "' normally");
+        return downloadFileSingle( url, destination, pf );
+    }
+
+    // Don't make segments smaller than DP_SEGMENT_MIN_SIZE
+    if ((long long)numSegments > size / DP_SEGMENT_MIN_SIZE)
+        numSegments = (int)( size / DP_SEGMENT_MIN_SIZE );
+    if (numSegments < 2)
+        return downloadFileSingle( url, destination, pf );
+
+    // Create the file in its final size
+    CVMWA_LOG("Debug", "Downloading '" << sURL << "' (" << size << " bytes) in " << numSegments << " segments");
+#ifdef _WIN32
+    int fd = _open( destination.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE );
+    if ((fd >= 0) && (_chsize_s( fd, size ) != 0)) { _close(fd); fd = -1; }
+#else
+    int fd = ::open( destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+#ifdef __linux__
+    if ((fd >= 0) && (posix_fallocate( fd, 0, (off_t) size ) != 0) && (ftruncate( fd, (off_t) size ) != 0)) { ::close(fd); fd = -1; }
+#else
+    if ((fd >= 0) && (ftruncate( fd, (off_t) size ) != 0)) { ::close(fd); fd = -1; }
+#endif
+#endif
+    if (fd < 0) {
+        CVMWA_LOG("Error", "Unable to create '" << destination << "'" );
+        return HVE_IO_ERROR;
+    }
+
+    // We are in operation
+    operationInstances++;
+    this->pf = pf;
+    if (pf) pf->__lastEventTime = getMillis();
+
+    // All the segments must come from the same copy of the file
+    struct curl_slist * headers = NULL;
+    if (!sValidator.empty())
+        headers = curl_slist_append( headers, ("If-Range: " + sValidator).c_str() );
+
+    // Split the file
+    long long received = 0;
+    long long segmentSize = size / numSegments;
+    std::vector< CURLSegment > parts( numSegments );
+    CURLM * multi = curl_multi_init();
+    for (int i = 0; i < numSegments; i++) {
+        CURLSegment& seg = parts[i];
+        seg.self = this;
+        seg.curl = curl_easy_init();
+        seg.fd = fd;
+        seg.offset = i * segmentSize;
+        seg.end = (i == numSegments - 1) ? (size - 1) : ((i + 1) * segmentSize - 1);
+        seg.received = &received;
+        seg.size = size;
+        seg.retries = DP_SEGMENT_RETRIES;
+        seg.fatal = false;
+        __curl_setup( seg.curl );
+        __curl_segment_start( multi, &seg, sURL, headers );
+    }
+
+    // Run the transfers
+    int pending = numSegments, running = 0;
+    bool failed = false;
+    while ((pending > 0) && !failed) {
+        if (curl_multi_perform( multi, &running ) != CURLM_OK) {
+            failed = true;
+            break;
+        }
+
+        // Check the completed segments
+        CURLMsg * msg;
+        int msgsLeft;
+        while ((msg = curl_multi_info_read( multi, &msgsLeft )) != NULL) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            CURLSegment * seg = NULL;
+            curl_easy_getinfo( msg->easy_handle, CURLINFO_PRIVATE, (char **) &seg );
+            curl_multi_remove_handle( multi, msg->easy_handle );
+
+            if (seg->offset == seg->end + 1) {
+                pending--;
+            } else if (!seg->fatal && (seg->retries-- > 0)) {
+                // Continue from where it stopped
+                CVMWA_LOG("Warning", "Segment " << seg->range << " interrupted (cURL Error #" << msg->data.result << "), continuing");
+                __curl_segment_start( multi, seg, sURL, headers );
+            } else {
+                CVMWA_LOG("Error", "Segment " << seg->range << " failed (cURL Error #" << msg->data.result << ")");
+                failed = true;
+            }
+        }
+
+        // Check for abort
+        if (abortFlag) {
+            abortFlag = abortPersistsFlag;
+            failed = true;
+        }
+        if (boost::this_thread::interruption_requested())
+            failed = true;
+
+        // Wait for activity
+        if ((pending > 0) && !failed)
+            curl_multi_wait( multi, NULL, 0, 250, NULL );
+    }
+
+    // Cleanup
+    for (int i = 0; i < numSegments; i++) {
+        curl_multi_remove_handle( multi, parts[i].curl );
+        curl_easy_cleanup( parts[i].curl );
+    }
+    curl_multi_cleanup( multi );
+    curl_slist_free_all( headers );
+#ifdef _WIN32
+    if (_close( fd ) != 0) failed = true;
+#else
+    if (::close( fd ) != 0) failed = true;
+#endif
     operationInstances--;
+
+    if (failed) {
+        CVMWA_LOG("Error", "Segmented download of '" << url << "' failed" );
+        return HVE_IO_ERROR;
+    }
+
+    // Notify completion
+    CVMWA_LOG("Info", "cURL Download completed" );
+    if (pf) pf->complete("Download completed");
     return HVE_OK;
-    
     CRASH_REPORT_END;
 }
 
@@ -287,8 +1125,10 @@ int CURLProvider::downloadText( const std::string& url, std::string * destinatio
  * Create a clone of this instance
  */
 DownloadProviderPtr CURLProvider::clone() {
-    // Just return a new CURL instance
-    return boost::make_shared< CURLProvider >();
+    // Just return a new CURL instance with the same configuration
+    CURLProviderPtr provider = boost::make_shared< CURLProvider >();
+    provider->setSegments( segments );
+    return provider;
 }
 
 /**
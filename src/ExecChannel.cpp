@@ -0,0 +1,344 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/ExecChannel.h>
+#include <CernVM/Hypervisor.h>
+
+using namespace std;
+
+#ifndef _WIN32
+
+// Prevent SIGPIPE when the co-process dies under our feet
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/**
+ * Quote the given argument so it's passed verbatim through the shell
+ */
+std::string __shellQuote( const std::string& arg ) {
+    CRASH_REPORT_BEGIN;
+    string ans = "'";
+    for (size_t i=0; i<arg.length(); i++) {
+        if (arg[i] == '\'') {
+            ans += "'\\''";
+        } else {
+            ans += arg[i];
+        }
+    }
+    ans += "'";
+    return ans;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the given buffer is terminated with the specified marker
+ * and if yes, strip it and return the position where the marker starts.
+ */
+size_t __findMarker( const std::string& buffer, const std::string& marker ) {
+    CRASH_REPORT_BEGIN;
+    if (buffer.empty() || (buffer[buffer.length()-1] != '\n')) return string::npos;
+    size_t pos = buffer.rfind( "\n" + marker );
+    if (pos == string::npos) return string::npos;
+    if (buffer.find('\n', pos+1) != buffer.length()-1) return string::npos;
+    return pos;
+    CRASH_REPORT_END;
+}
+
+#endif
+
+/**
+ * Initialize the channel
+ */
+ExecChannel::ExecChannel( const std::string& app ) : app(app), channelMutex(), sequence(0) {
+    CRASH_REPORT_BEGIN;
+#ifndef _WIN32
+    pid = 0;
+    fdIn = -1; fdOut = -1; fdErr = -1;
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Terminate the co-process on destruction
+ */
+ExecChannel::~ExecChannel() {
+    CRASH_REPORT_BEGIN;
+    close();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the co-process is alive
+ */
+bool ExecChannel::isOpen() {
+    CRASH_REPORT_BEGIN;
+#ifndef _WIN32
+    if (pid <= 0) return false;
+
+    // Check if the process has exited
+    int status;
+    if (waitpid( pid, &status, WNOHANG ) != 0) {
+        CVMWA_LOG("Debug", "Exec channel co-process " << pid << " has exited");
+        pid = 0;
+        close();
+        return false;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Start the co-process
+ */
+bool ExecChannel::open() {
+    CRASH_REPORT_BEGIN;
+#ifndef _WIN32
+
+    // Check if we are already open
+    if (isOpen()) return true;
+
+    // We use a socket for the STDIN, so we can send without
+    // raising SIGPIPE if the co-process has died.
+    int infd[2]; if (socketpair(AF_UNIX, SOCK_STREAM, 0, infd) < 0) return false;
+    int outfd[2]; if (pipe(outfd) < 0) {
+        ::close(infd[0]); ::close(infd[1]);
+        return false;
+    }
+    int errfd[2]; if (pipe(errfd) < 0) {
+        ::close(infd[0]); ::close(infd[1]);
+        ::close(outfd[0]); ::close(outfd[1]);
+        return false;
+    }
+
+#ifdef SO_NOSIGPIPE
+    int nosig = 1;
+    setsockopt( infd[0], SOL_SOCKET, SO_NOSIGPIPE, &nosig, sizeof(nosig) );
+#endif
+
+    // Fork to create the co-process
+    pid_t pidChild = fork();
+    if (pidChild == -1) {
+        ::close(infd[0]); ::close(infd[1]);
+        ::close(outfd[0]); ::close(outfd[1]);
+        ::close(errfd[0]); ::close(errfd[1]);
+        return false;
+
+    } else if (!pidChild) {
+
+        // Become a process group leader, so we can kill
+        // the shell along with the command it's running
+        setpgid(0, 0);
+
+        // Replace the standard descriptors
+        if ((dup2(infd[1], 0) < 0) || (dup2(outfd[1], 1) < 0) || (dup2(errfd[1], 2) < 0))
+            _exit(127);
+
+        // Close any other debris from the parent
+        closeDescriptorsFrom( 3 );
+
+        // Launch shell
+        execl( EXEC_CHANNEL_SHELL, "sh", (char *)NULL );
+        _exit(127);
+
+    }
+
+    // Release the child ends
+    ::close(infd[1]); ::close(outfd[1]); ::close(errfd[1]);
+    fdIn = infd[0]; fdOut = outfd[0]; fdErr = errfd[0];
+    pid = pidChild;
+
+    CVMWA_LOG("Debug", "Started exec channel co-process " << pid << " for " << app);
+    return true;
+
+#else
+    return false;
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Terminate the co-process
+ */
+void ExecChannel::close() {
+    CRASH_REPORT_BEGIN;
+#ifndef _WIN32
+
+    // Close descriptors
+    if (fdIn >= 0) ::close(fdIn);
+    if (fdOut >= 0) ::close(fdOut);
+    if (fdErr >= 0) ::close(fdErr);
+    fdIn = -1; fdOut = -1; fdErr = -1;
+
+    // Kill the process group and reap the shell
+    if (pid > 0) {
+        kill( -pid, SIGKILL );
+        waitpid( pid, NULL, 0 );
+        pid = 0;
+    }
+
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Run a command through the co-process
+ */
+int ExecChannel::execute( const std::string& app, const std::string& cmdline, std::vector<std::string> * stdoutList, std::string * rawStderr, const SysExecConfig& config ) {
+    CRASH_REPORT_BEGIN;
+#ifndef _WIN32
+
+    // Only the binary we were created for goes through the channel
+    if (app.compare(this->app) != 0)
+        return SYSEXEC_FALLBACK;
+
+    // If another command is using the channel, fork as usual
+    // instead of waiting for it to complete
+    boost::unique_lock<boost::mutex> lock( channelMutex, boost::try_to_lock );
+    if (!lock.owns_lock())
+        return SYSEXEC_FALLBACK;
+
+    // Make sure the co-process is running
+    if (!open())
+        return SYSEXEC_FALLBACK;
+
+    // Build the command marker
+    ostringstream oss;
+    oss << "--EXEC-CHANNEL-" << pid << "-" << (++sequence) << "--";
+    string marker = oss.str();
+
+    // Build the command to send to the shell. STDIN is detached so the
+    // command does not consume the rest of our command stream.
+    vector<string> args;
+    splitArguments( cmdline, &args );
+    string cmd = __shellQuote( app );
+    for (vector<string>::iterator it = args.begin(); it != args.end(); ++it) {
+        cmd += " " + __shellQuote( *it );
+    }
+    cmd += " </dev/null; __ec=$?; "
+           "printf '\\n%s %d\\n' '" + marker + "' $__ec; "
+           "printf '\\n%s\\n' '" + marker + "' >&2\n";
+
+    // Send command
+    const char * ptr = cmd.c_str();
+    size_t remains = cmd.length();
+    while (remains > 0) {
+        ssize_t sent = send( fdIn, ptr, remains, MSG_NOSIGNAL );
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            CVMWA_LOG("Error", "Unable to send command to the exec channel");
+            close();
+            return SYSEXEC_FALLBACK;
+        }
+        ptr += sent;
+        remains -= sent;
+    }
+
+    // Prepare the poll fd list
+    struct pollfd fds[4];
+    fds[0].fd = fdOut; fds[0].events = POLLIN;
+    fds[1].fd = fdErr; fds[1].events = POLLIN;
+    fds[2].fd = sysExecGlobalToken()->descriptor();
+    fds[2].events = POLLIN;
+    fds[3].fd = config.token ? config.token->descriptor() : -1;
+    fds[3].events = POLLIN;
+
+    // Read until both streams are terminated with the marker
+    string rawStdout = "";
+    *rawStderr = "";
+    char data[SYSEXEC_BUFFER_SIZE];
+    ssize_t dataLen;
+    size_t posOut = string::npos, posErr = string::npos;
+    long startTime = getMillis();
+    while ((posOut == string::npos) || (posErr == string::npos)) {
+
+        // Abort if it takes way too long. There is no way to tell the shell
+        // to stop the running command, so we have to kill the co-process.
+        long remaining = config.timeout - (getMillis() - startTime);
+        bool aborted = config.isCancelled();
+        if ( aborted || (remaining <= 0) ) {
+            close();
+            if (aborted) {
+                CVMWA_LOG("Debug", "Aborting execution");
+                *rawStderr = "ERROR: Aborted";
+                return 254;
+            } else {
+                CVMWA_LOG("Debug", "Timed out while waiting for response");
+                *rawStderr = "ERROR: Timed out";
+                return 255;
+            }
+        }
+
+        // Block until something happens
+        int ret = poll(fds, 4, (int)remaining);
+        if (ret > 0) {
+            for (int i=0; i<2; i++) {
+                if (fds[i].revents & (POLLIN | POLLHUP)) {
+                    dataLen = read(fds[i].fd, data, sizeof(data));
+                    if (dataLen <= 0) {
+
+                        // The co-process has died. If we haven't got anything
+                        // yet, it's safe to fall back to fork/exec
+                        CVMWA_LOG("Error", "Exec channel co-process died unexpectedly");
+                        close();
+                        if (rawStdout.empty() && rawStderr->empty()) return SYSEXEC_FALLBACK;
+                        *rawStderr = "ERROR: Exec channel closed";
+                        return 254;
+
+                    } else if (i == 0) {
+                        rawStdout.append(data, dataLen);
+                        posOut = __findMarker( rawStdout, marker );
+                    } else {
+                        rawStderr->append(data, dataLen);
+                        posErr = __findMarker( *rawStderr, marker );
+                    }
+                }
+            }
+        }
+
+    }
+
+    // Extract exit code
+    int exitCode = ston<int>( rawStdout.substr( posOut + marker.length() + 2 ) );
+
+    // Strip markers
+    rawStdout = rawStdout.substr( 0, posOut );
+    *rawStderr = rawStderr->substr( 0, posErr );
+
+#if defined(DEBUG) || defined(LOGGING) || defined(CRASH_REPORTING)
+    if (!rawStderr->empty())
+        CVMWA_LOG("Debug", "Exec STDERR: " << *rawStderr);
+#endif
+
+    // Split stdout lines
+    splitLines( rawStdout, stdoutList );
+
+    // Return a waitpid()-compatible status, like __sysExec does
+    return (exitCode & 0xFF) << 8;
+
+#else
+    return SYSEXEC_FALLBACK;
+#endif
+    CRASH_REPORT_END;
+}
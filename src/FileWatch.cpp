@@ -0,0 +1,355 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/FileWatch.h>
+
+#include <algorithm>
+#include <boost/filesystem.hpp>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#endif
+
+using namespace std;
+
+FileWatchPtr        systemFileWatch;
+boost::once_flag    systemFileWatchOnce = BOOST_ONCE_INIT;
+
+/**
+ * Allocate the system-wide watcher
+ */
+void __initFileWatch() {
+    systemFileWatch = boost::make_shared< FileWatch >();
+}
+
+/**
+ * Get the modification time and the size of the specified file,
+ * or -1 if the file is missing.
+ */
+void __fileWatchStat( const std::string& file, long long * fileTime, long long * fileSize ) {
+    CRASH_REPORT_BEGIN;
+    boost::system::error_code ec;
+    boost::filesystem::path p( file );
+    *fileTime = -1;
+    *fileSize = -1;
+    if (!boost::filesystem::exists( p, ec )) return;
+    std::time_t t = boost::filesystem::last_write_time( p, ec );
+    if (!ec) *fileTime = (long long)t;
+    boost::uintmax_t sz = boost::filesystem::file_size( p, ec );
+    if (!ec) *fileSize = (long long)sz;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Create the watcher
+ */
+FileWatch::FileWatch( int pollInterval ) : pollInterval(pollInterval), watches(), lastID(0), stopping(false), thread(NULL), watchMutex(), watchCond(), fireMutex() {
+    CRASH_REPORT_BEGIN;
+#ifdef __linux__
+    fdWake[0] = -1; fdWake[1] = -1;
+    fdNotify = inotify_init();
+    if (fdNotify < 0) {
+        CVMWA_LOG("Warning", "Unable to initialize inotify, falling back to polling");
+    } else if (pipe(fdWake) < 0) {
+        ::close(fdNotify);
+        fdNotify = -1;
+    } else {
+        fcntl( fdNotify, F_SETFL, fcntl(fdNotify, F_GETFL) | O_NONBLOCK );
+        fcntl( fdWake[0], F_SETFL, fcntl(fdWake[0], F_GETFL) | O_NONBLOCK );
+    }
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Stop the watcher thread
+ */
+FileWatch::~FileWatch() {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::mutex::scoped_lock lock(watchMutex);
+        stopping = true;
+    }
+    wakeUp();
+    if (thread != NULL) {
+        thread->join();
+        delete thread;
+    }
+#ifdef __linux__
+    if (fdNotify >= 0) ::close(fdNotify);
+    if (fdWake[0] >= 0) ::close(fdWake[0]);
+    if (fdWake[1] >= 0) ::close(fdWake[1]);
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Get system-wide watcher singleton
+ */
+FileWatchPtr FileWatch::Default() {
+    CRASH_REPORT_BEGIN;
+    boost::call_once( __initFileWatch, systemFileWatchOnce );
+    return systemFileWatch;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Start watching a file
+ */
+int FileWatch::watch( const std::string& file, const callbackFileChanged& cb ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(watchMutex);
+
+    // Prepare entry
+    boost::filesystem::path p( file );
+    Watch w;
+    w.file = file;
+    w.dir = p.parent_path().string();
+    w.name = p.filename().string();
+    w.callback = cb;
+    w.wd = -1;
+    __fileWatchStat( file, &w.fileTime, &w.fileSize );
+    addNative( w );
+
+    // Store it
+    int id = ++lastID;
+    watches[id] = w;
+
+    // Start the thread on demand
+    if (thread == NULL)
+        thread = new boost::thread( boost::bind( &FileWatch::watchLoop, this ) );
+
+    return id;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Stop watching a file
+ */
+void FileWatch::unwatch( int id ) {
+    CRASH_REPORT_BEGIN;
+
+    // Wait for the running callbacks to complete
+    boost::recursive_mutex::scoped_lock fireLock(fireMutex);
+    boost::mutex::scoped_lock lock(watchMutex);
+
+    std::map< int, Watch >::iterator it = watches.find( id );
+    if (it == watches.end()) return;
+    removeNative( (*it).second );
+    watches.erase( it );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Start native watching on the directory of the file
+ */
+void FileWatch::addNative( Watch& w ) {
+    CRASH_REPORT_BEGIN;
+#ifdef __linux__
+    if (fdNotify < 0) return;
+    w.wd = inotify_add_watch( fdNotify, w.dir.c_str(),
+        IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO );
+    if (w.wd >= 0) dirRefs[w.wd]++;
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Stop native watching on the directory of the file
+ */
+void FileWatch::removeNative( Watch& w ) {
+    CRASH_REPORT_BEGIN;
+#ifdef __linux__
+    if (w.wd < 0) return;
+
+    // inotify returns the same descriptor for the same directory,
+    // so remove it only when the last file in it is not watched
+    if (--dirRefs[w.wd] <= 0) {
+        dirRefs.erase( w.wd );
+        inotify_rm_watch( fdNotify, w.wd );
+    }
+    w.wd = -1;
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Wake-up the watcher thread
+ */
+void FileWatch::wakeUp() {
+    CRASH_REPORT_BEGIN;
+#ifdef __linux__
+    if (fdWake[1] >= 0) {
+        char c = 0;
+        if (write( fdWake[1], &c, 1 ) < 0) { };
+    }
+#endif
+    watchCond.notify_all();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check the polled files for changes
+ */
+void FileWatch::pollChanges( std::vector<int>& ids, bool all ) {
+    CRASH_REPORT_BEGIN;
+    long long fileTime, fileSize;
+    for (std::map< int, Watch >::iterator it = watches.begin(); it != watches.end(); ++it) {
+        Watch& w = (*it).second;
+
+        // Retry native watching (the directory might be there now)
+        if (w.wd < 0) {
+            addNative( w );
+        } else if (!all) {
+            continue;
+        }
+
+        // Check for changes
+        __fileWatchStat( w.file, &fileTime, &fileSize );
+        if ((fileTime != w.fileTime) || (fileSize != w.fileSize)) {
+            w.fileTime = fileTime;
+            w.fileSize = fileSize;
+            if (std::find( ids.begin(), ids.end(), (*it).first ) == ids.end())
+                ids.push_back( (*it).first );
+        }
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Fire the callbacks of the specified watches
+ */
+void FileWatch::fire( const std::vector<int>& ids ) {
+    CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock fireLock(fireMutex);
+    for (std::vector<int>::const_iterator it = ids.begin(); it != ids.end(); ++it) {
+        callbackFileChanged cb;
+        string file;
+
+        // The watch might have been removed in the mean time
+        {
+            boost::mutex::scoped_lock lock(watchMutex);
+            std::map< int, Watch >::iterator jt = watches.find( *it );
+            if (jt == watches.end()) continue;
+            cb = (*jt).second.callback;
+            file = (*jt).second.file;
+        }
+
+        // Fire callback
+        if (cb) cb( file );
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Watcher thread main loop
+ */
+void FileWatch::watchLoop() {
+    CRASH_REPORT_BEGIN;
+    long lastPoll = getMillis();
+    for (;;) {
+        std::vector<int> ids;
+
+#ifdef __linux__
+        if (fdNotify >= 0) {
+
+            // Wait for events
+            struct pollfd fds[2];
+            fds[0].fd = fdNotify; fds[0].events = POLLIN;
+            fds[1].fd = fdWake[0]; fds[1].events = POLLIN;
+            int ret = poll( fds, 2, pollInterval );
+            {
+                boost::mutex::scoped_lock lock(watchMutex);
+                if (stopping) return;
+            }
+
+            // Drain the wake-up pipe
+            char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+            if ((ret > 0) && (fds[1].revents & POLLIN)) {
+                while (read( fdWake[0], buf, sizeof(buf) ) > 0) { };
+            }
+
+            // Collect the files affected by the events
+            if ((ret > 0) && (fds[0].revents & POLLIN)) {
+                ssize_t len;
+                boost::mutex::scoped_lock lock(watchMutex);
+                while ((len = read( fdNotify, buf, sizeof(buf) )) > 0) {
+                    for (char * ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len) {
+                        struct inotify_event * ev = (struct inotify_event *) ptr;
+
+                        // The directory has gone away, fall back to polling
+                        if (ev->mask & IN_IGNORED) {
+                            dirRefs.erase( ev->wd );
+                            for (std::map< int, Watch >::iterator it = watches.begin(); it != watches.end(); ++it) {
+                                if ((*it).second.wd == ev->wd) (*it).second.wd = -1;
+                            }
+                            continue;
+                        }
+
+                        // Match the files in the directory
+                        if (ev->len == 0) continue;
+                        for (std::map< int, Watch >::iterator it = watches.begin(); it != watches.end(); ++it) {
+                            Watch& w = (*it).second;
+                            if ((w.wd == ev->wd) && (w.name.compare( ev->name ) == 0)) {
+                                __fileWatchStat( w.file, &w.fileTime, &w.fileSize );
+                                if (std::find( ids.begin(), ids.end(), (*it).first ) == ids.end())
+                                    ids.push_back( (*it).first );
+                            }
+                        }
+
+                    }
+                }
+            }
+
+            // Poll the files that cannot be watched natively
+            if (getMillis() - lastPoll >= pollInterval) {
+                lastPoll = getMillis();
+                boost::mutex::scoped_lock lock(watchMutex);
+                pollChanges( ids, false );
+            }
+
+        } else
+#endif
+        {
+
+            // Wait for the next poll
+            {
+                boost::mutex::scoped_lock lock(watchMutex);
+                boost::system_time const deadline = boost::get_system_time() + boost::posix_time::milliseconds(pollInterval);
+                while (!stopping) {
+                    if (!watchCond.timed_wait(lock, deadline)) break;
+                }
+                if (stopping) return;
+                pollChanges( ids, true );
+            }
+
+        }
+
+        // Notify listeners
+        if (!ids.empty()) fire( ids );
+
+    }
+    CRASH_REPORT_END;
+}
@@ -35,6 +35,7 @@
 #include "CernVM/Utilities.h"
 #include "CernVM/Hypervisor.h"
 #include "CernVM/DaemonCtl.h"
+#include "CernVM/LocalConfig.h"
 
 #include "contextiso.h"
 #include "floppyIO.h"
@@ -377,6 +378,26 @@ int HVInstance::getUsage( HVINFO_RES * resCount ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Update the state of all open sessions, one by one
+ */
+int HVInstance::refreshAll( ) {
+    CRASH_REPORT_BEGIN;
+
+    // Work on a copy, since the sessions can be opened or closed meanwhile
+    std::list< HVSessionPtr > sessList;
+    {
+        boost::recursive_mutex::scoped_lock lock(openSessionsMutex);
+        sessList = openSessions;
+    }
+
+    for (std::list< HVSessionPtr >::iterator it = sessList.begin(); it != sessList.end(); ++it) {
+        (*it)->update( false );
+    }
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
 /**
  * Use LibcontextISO to create a cd-rom for this VM
  */
@@ -426,12 +447,43 @@ int HVInstance::buildFloppyIO ( std::string userData, std::string * filename, co
  */
 std::string HVInstance::cernVMVersion( std::string filename ) {
     CRASH_REPORT_BEGIN;
+
+    // The ISOs of earlier versions were named after their version
     std::string base = this->dirDataCache + "/ucernvm-";
-    if (filename.substr(0,base.length()).compare(base) != 0) return ""; // Invalid
-    return filename.substr(base.length(), filename.length()-base.length()-4); // Strip extension
+    if (filename.substr(0,base.length()).compare(base) == 0)
+        return filename.substr(base.length(), filename.length()-base.length()-4); // Strip extension
+
+    // The cached ones are named after their checksum, so look where they came from
+    std::string prefix = "/ucernvm-images.";
+    std::set< std::string > urls = imageCache->getURLs( filename );
+    for (std::set< std::string >::iterator it = urls.begin(); it != urls.end(); ++it) {
+        size_t iStart = (*it).find( prefix );
+        if (iStart == std::string::npos) continue;
+        iStart += prefix.length();
+        size_t iEnd = (*it).find( ".cernvm.", iStart );
+        if (iEnd == std::string::npos) continue;
+        return (*it).substr( iStart, iEnd - iStart );
+    }
+    return ""; // Invalid
     CRASH_REPORT_END;
 };
 
+/**
+ * Index the ISO an earlier version stored under its CernVM version, so it
+ * counts towards the cache quota and it's found by its checksum. It stays
+ * where it is, since a VM may be using it.
+ */
+std::string __cernVMIndexLegacy( const ImageCachePtr& imageCache, const std::string& dirDataCache, const std::string& version ) {
+    CRASH_REPORT_BEGIN;
+    std::string sFilename = dirDataCache + "/ucernvm-" + version + ".iso";
+    if (!file_exists(sFilename)) return "";
+    if (imageCache->contains(sFilename)) return sFilename;
+
+    std::string sChecksum;
+    sha256_file( sFilename, &sChecksum );
+    return imageCache->store( sFilename, sChecksum, "", true );
+    CRASH_REPORT_END;
+}
 
 /**
  * Check if the given CernVM version is cached
@@ -439,8 +491,12 @@ std::string HVInstance::cernVMVersion( std::string filename ) {
  */
 int HVInstance::cernVMCached( std::string version, std::string * filename ) {
     CRASH_REPORT_BEGIN;
-    string sOutput = this->dirDataCache + "/ucernvm-" + version + ".iso";
-    if (file_exists(sOutput)) {
+
+    // Look for an ISO downloaded for this version
+    string sOutput = imageCache->lookupURLPart( "/ucernvm-images." + version + ".cernvm." );
+    if (sOutput.empty()) sOutput = __cernVMIndexLegacy( imageCache, this->dirDataCache, version );
+
+    if (!sOutput.empty()) {
         if (filename != NULL) *filename = sOutput;
         return 1;
     } else {
@@ -509,6 +565,9 @@ int HVInstance::cernVMDownload( std::string& version, const std::string flavor,
                             + "." + version \
                             + ".cernvm." + machineArch + ".iso";
 
+    // If an earlier version downloaded this ISO, it's used from the cache
+    __cernVMIndexLegacy( imageCache, this->dirDataCache, version );
+
     // Download file
     pf->doing("Downloading CernVM");
     return this->downloadFileURL(
@@ -631,15 +690,17 @@ int __downloadFile( const std::string & fileURL, const std::string & sOutFilenam
     // Start actual file download and validation
     if (pf) pf->doing("Preparing file download");
     for (int i=0; i<retries; i++) {
+        std::string     sChecksumFile = "";
 
-        // (3) If file does not exist, download it
+        // (3) If file does not exist, download it (and get its
+        //     checksum while it's written)
         if (!file_exists(sOutFilename)) {
 
             // Restart VariableTaskPtr
             if (pfDownload) pfDownload->restart("Downloading file", false);
 
             // Download file
-            ans = downloadProvider->downloadFile( fileURL, sOutFilename, pfDownload );
+            ans = downloadProvider->downloadFileSHA256( fileURL, sOutFilename, &sChecksumFile, pfDownload );
             if (ans != HVE_OK) {
                 // Invalid contents. Erase and re-download
                 if (pf) pf->doing("Error while downloading. Will retry.");
@@ -652,9 +713,9 @@ int __downloadFile( const std::string & fileURL, const std::string & sOutFilenam
         // (4) File exists, validate contents
         if (file_exists(sOutFilename)) {
 
-            // Calculate checksum
-            std::string     sChecksumFile = "";
-            sha256_file( sOutFilename, &sChecksumFile );
+            // Calculate checksum (if the file was already there)
+            if (sChecksumFile.empty())
+                sha256_file( sOutFilename, &sChecksumFile );
 
             // Compare checksums
             if (sChecksumFile.compare( sChecksumString ) != 0) {
@@ -721,7 +782,28 @@ int HVInstance::downloadFileURL ( const std::string & fileURL, const std::string
             checksumURL, sOutChecksum, pfDownload, pf, dp,
             retries, &sChecksumString
         );
-    if (ans != HVE_OK) return ans;
+    if (ans != HVE_OK) {
+
+        // If we cannot get the checksum, use the file we got from there last time
+        std::string sCached = imageCache->lookupURL( fileURL );
+        if (sCached.empty()) return ans;
+        if (pf) pf->complete("Using cached file");
+        *filename = sCached;
+        return HVE_OK;
+
+    }
+
+    // Check if we have it already
+    std::string sCached = imageCache->lookup( sChecksumString );
+    if (!sCached.empty()) {
+        imageCache->alias( sChecksumString, fileURL );
+        if (pf) pf->complete("File found in cache");
+        *filename = sCached;
+        return HVE_OK;
+    }
+
+    // A file left by an earlier version may be in use by a VM, so it's cached where it is
+    bool bInUse = file_exists( sOutFilename );
 
     // Download file
     pfDownload = pf->begin<VariableTask>("Downloading file");    
@@ -733,7 +815,7 @@ int HVInstance::downloadFileURL ( const std::string & fileURL, const std::string
 
     // Update the string
     if (pf) pf->complete("File download completed");
-    *filename = sOutFilename;
+    *filename = imageCache->store( sOutFilename, sChecksumString, fileURL, bInUse );
     
     // Return OK
     return HVE_OK;
@@ -760,10 +842,22 @@ int HVInstance::downloadFile ( const std::string & fileURL, const std::string &
     // Calculate full path for the output file
     sOutFilename = dirData + "/cache/" + sOutFilenameHash + "-" + sOutFilename;
 
+    // Check if we have it already
+    std::string sCached = imageCache->lookup( checksumString );
+    if (!sCached.empty()) {
+        imageCache->alias( checksumString, fileURL );
+        if (pf) pf->complete("File found in cache");
+        *filename = sCached;
+        return HVE_OK;
+    }
+
     // Prepare progress objects
     VariableTaskPtr   pfDownload;
     if (pf) pf->setMax(3);
 
+    // A file left by an earlier version may be in use by a VM, so it's cached where it is
+    bool bInUse = file_exists( sOutFilename );
+
     // Download file
     pfDownload = pf->begin<VariableTask>("Downloading file");    
     ans = __downloadFile(
@@ -774,7 +868,7 @@ int HVInstance::downloadFile ( const std::string & fileURL, const std::string &
 
     // Update the string
     if (pf) pf->complete("File download completed");
-    *filename = sOutFilename;
+    *filename = imageCache->store( sOutFilename, checksumString, fileURL, bInUse );
     
     // Return OK
     return HVE_OK;
@@ -808,39 +902,37 @@ int HVInstance::downloadFileGZ ( const std::string & fileURL, const std::string
     sOutFilename = dirData + "/cache/" + sOutFilenameHash + "-" + sOutFilename;
     sExtractedFilename = dirData + "/cache/" + sOutFilenameHash + "-" + sExtractedFilename;
 
+    // The file is extracted here until it's validated
+    std::string     sPartFilename = sExtractedFilename + ".part";
+
+    // Check if we have it already
+    std::string     sCached = imageCache->lookup( checksumString );
+    if (!sCached.empty()) {
+        imageCache->alias( checksumString, fileURL );
+        if (pf) pf->complete("File found in cache");
+        *filename = sCached;
+        return HVE_OK;
+    }
+
     // Prepare progress objects
     VariableTaskPtr pfDownload;
     if (pf) pf->setMax(3);
 
+    // An image extracted by an earlier version may be in use by a VM, so it's cached where it is
+    bool            bInUse = file_exists( sExtractedFilename );
+
     // File OK flag
     bool            bFileOK = false;
 
     // Start actual file download and validation
     pfDownload = pf->begin<VariableTask>("Downloading file");
     for (int i=0; i<retries; i++) {
+        std::string  sChecksumFile = "";
 
-        // (1) If no file exists, download compressed file
-        if ( !file_exists(sExtractedFilename) && !file_exists(sOutFilename) ) {
-
-            // Restart VariableTaskPtr
-            if (pfDownload) pfDownload->restart("Downloading compressed file", false);
-
-            // Download file
-            ans = dp->downloadFile( fileURL, sOutFilename, pfDownload );
-            if (ans != HVE_OK) {
-                // Invalid contents. Erase and re-download
-                if (pf) pf->doing("Error while downloading. Will retry.");
-                ::remove( sOutFilename.c_str());
-                continue;
-            }
-
-        }
-
-        // (2) If input file exists, but no extracted file exists, decompress
+        // (1) If a compressed file was left from an earlier download, validate and extract it
         if ( !file_exists(sExtractedFilename) && file_exists(sOutFilename) ) {
 
             // Validate downloaded file checksum
-            std::string  sChecksumFile = "";
             sha256_file( sOutFilename, &sChecksumFile );
 
             // Compare checksums
@@ -853,11 +945,11 @@ int HVInstance::downloadFileGZ ( const std::string & fileURL, const std::string
 
             // Decompress GZip file
             if (pf) pf->doing("Extracting file");
-            if (decompressFile( sOutFilename, sExtractedFilename ) != HVE_OK) {
+            if ((decompressFile( sOutFilename, sPartFilename ) != HVE_OK) || (::rename( sPartFilename.c_str(), sExtractedFilename.c_str() ) != 0)) {
                 // Could not extract. Erase and re-download
                 if (pf) pf->doing("Could not extract file. Re-downloading.");
                 ::remove( sOutFilename.c_str());
-                ::remove( sExtractedFilename.c_str());
+                ::remove( sPartFilename.c_str());
                 continue;
             };
 
@@ -866,8 +958,43 @@ int HVInstance::downloadFileGZ ( const std::string & fileURL, const std::string
 
         }
 
-        // (4) If only extracted file exists, it means that validation was successful
-        if ( file_exists(sExtractedFilename) && !file_exists(sOutFilename) ) {
+        // (2) If no file exists, download it and extract it on the fly
+        if ( !file_exists(sExtractedFilename) ) {
+
+            // Restart VariableTaskPtr
+            if (pfDownload) pfDownload->restart("Downloading compressed file", false);
+
+            // Download and extract file
+            ans = dp->downloadFileGZ( fileURL, sPartFilename, &sChecksumFile, pfDownload );
+            if (ans != HVE_OK) {
+                // Invalid contents. Erase and re-download
+                if (pf) pf->doing("Error while downloading. Will retry.");
+                ::remove( sPartFilename.c_str());
+                continue;
+            }
+
+            // Compare the checksum of the compressed data
+            if (sChecksumFile.compare( checksumString ) != 0) {
+                // Invalid contents. Erase and re-download
+                if (pf) pf->doing("Downloaded file checksum invalid. Re-downloading.");
+                ::remove( sPartFilename.c_str());
+                continue;
+            }
+
+            // It's valid, put it in place
+            if (::rename( sPartFilename.c_str(), sExtractedFilename.c_str() ) != 0) {
+                if (pf) pf->doing("Unable to store the downloaded file. Will retry.");
+                ::remove( sPartFilename.c_str());
+                continue;
+            }
+
+        }
+
+        // (3) If the extracted file exists, it means that validation was successful
+        if ( file_exists(sExtractedFilename) ) {
+
+            // Remove any compressed file left behind
+            ::remove( sOutFilename.c_str());
 
             // We are good
             if (pf) pf->done("Downloaded file in place");
@@ -882,6 +1009,7 @@ int HVInstance::downloadFileGZ ( const std::string & fileURL, const std::string
     if (!bFileOK) {
         if (pf) pf->fail("Unable to download file", HVE_IO_ERROR);
         ::remove( sOutFilename.c_str());
+        ::remove( sPartFilename.c_str());
         ::remove( sExtractedFilename.c_str());
         return HVE_IO_ERROR;
     } else {
@@ -890,13 +1018,38 @@ int HVInstance::downloadFileGZ ( const std::string & fileURL, const std::string
 
     // Update the string
     if (pf) pf->complete("File downloaded");
-    *filename = sOutFilename;
+    *filename = imageCache->store( sExtractedFilename, checksumString, fileURL, bInUse );
     
     // Return OK
     return HVE_OK;
     CRASH_REPORT_END;
 }
 
+/**
+ * Download a disk image in the image cache ahead of time
+ */
+int HVInstance::imagePrewarm ( const std::string & fileURL, const std::string & checksumString, const std::string & pinOwner, const FiniteTaskPtr & pf, const int retries, const DownloadProviderPtr& customProvider ) {
+    CRASH_REPORT_BEGIN;
+    std::string sFilename;
+    int ans;
+
+    // Compressed images are stored extracted
+    if (getURLFilename(fileURL).find(".gz") != std::string::npos) {
+        ans = downloadFileGZ( fileURL, checksumString, &sFilename, pf, retries, customProvider );
+    } else {
+        ans = downloadFile( fileURL, checksumString, &sFilename, pf, retries, customProvider );
+    }
+    if (ans != HVE_OK) return ans;
+
+    // Keep it until the owner releases it
+    if (!pinOwner.empty() && !imageCache->pin( sFilename, pinOwner )) {
+        CVMWA_LOG("Warning", "Unable to pin '" << sFilename << "' in the image cache");
+    }
+
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
 
 /**
  * Cross-platform exec and return for the hypervisor control binary
@@ -915,7 +1068,12 @@ int HVInstance::exec( string args, vector<string> * stdoutList, string * stderrM
     
         /* Execute */
         string execError;
-        execRes = sysExec( this->hvBinary, args, stdoutList, &execError, config );
+        if (execChannel) {
+            execRes = sysExec( this->hvBinary, args, stdoutList, &execError, config, 
+                               boost::bind( &ExecChannel::execute, execChannel.get(), _1, _2, _3, _4, _5 ) );
+        } else {
+            execRes = sysExec( this->hvBinary, args, stdoutList, &execError, config );
+        }
         if (stderrMsg != NULL) *stderrMsg = execError;
 
         /* Store the last error occured */
@@ -928,16 +1086,32 @@ int HVInstance::exec( string args, vector<string> * stdoutList, string * stderrM
     CRASH_REPORT_END;
 }
 
+/**
+ * Schedule the execution of the hypervisor binary in the exec pool
+ */
+SysExecJobPtr HVInstance::execAsync( string args, const SysExecConfig& config, const callbackSysExec& cb ) {
+    CRASH_REPORT_BEGIN;
+    sysExecHandler handler;
+    if (execChannel)
+        handler = boost::bind( &ExecChannel::execute, execChannel, _1, _2, _3, _4, _5 );
+    return SysExecPool::Default()->submit( this->hvBinary, args, config, cb, handler );
+    CRASH_REPORT_END;
+}
+
 /**
  * Initialize hypervisor 
  */
-HVInstance::HVInstance() : version(""), openSessions(), sessions(), downloadProvider(), userInteraction() {
+HVInstance::HVInstance() : version(""), openSessions(), openSessionsMutex(), sessions(), downloadProvider(), userInteraction(), execChannel(), fsmExecutor() {
     CRASH_REPORT_BEGIN;
     this->sessionID = 1;
     
     // Pick a system folder to store persistent information
     this->dirData = getAppDataPath();
     this->dirDataCache = this->dirData + "/cache";
+
+    // The downloaded images are kept in a size-limited cache (quota in MB)
+    long long cacheQuota = (long long) LocalConfig::global()->getNum<int>( "cacheQuota", DEFAULT_CACHE_QUOTA );
+    imageCache = boost::make_shared< ImageCache >( this->dirDataCache, cacheQuota * 1048576LL );
     
     // Unless overriden use the default downloadProvider and 
     // userInteraction pointers
@@ -1061,8 +1235,11 @@ HVSessionPtr HVInstance::sessionOpen( const ParameterMapPtr& parameters, const F
     sess->parameters->unlock();
 
     // Store it on open sessions
-    sess->instances += 1;
-    openSessions.push_back( sess );
+    {
+        boost::recursive_mutex::scoped_lock lock(openSessionsMutex);
+        sess->instances += 1;
+        openSessions.push_back( sess );
+    }
     
     // Return the handler
     return sess;
@@ -1155,6 +1332,24 @@ void HVInstance::setUserInteraction( UserInteractionPtr p ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Change the executor of the session FSMs
+ */
+void HVInstance::setFSMExecutor( FSMExecutorPtr p ) {
+    CRASH_REPORT_BEGIN;
+    this->fsmExecutor = p;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the executor of the session FSMs
+ */
+FSMExecutorPtr HVInstance::getFSMExecutor( ) {
+    CRASH_REPORT_BEGIN;
+    return this->fsmExecutor;
+    CRASH_REPORT_END;
+}
+
 
 /**
  * Search the system's folders and try to detect what hypervisor
@@ -332,7 +332,7 @@ int vboxInstall( const DownloadProviderPtr & downloadProvider, DomainKeystore &
         // Download installer
         tmpHypervisorInstall = getTmpFile( getURLFilename(data->get(kDownloadUrl) ));
         CVMWA_LOG( "Info", "Downloading " << data->get(kDownloadUrl) << " to " << tmpHypervisorInstall  );
-        res = downloadProvider->downloadFile( data->get(kDownloadUrl), tmpHypervisorInstall, downloadPf );
+        res = downloadProvider->downloadFileSHA256( data->get(kDownloadUrl), tmpHypervisorInstall, &checksum, downloadPf );
         CVMWA_LOG( "Info", "    : Got " << res  );
         if ( res != HVE_OK ) {
             if (tries<retries) {
@@ -349,7 +349,6 @@ int vboxInstall( const DownloadProviderPtr & downloadProvider, DomainKeystore &
         
         // Validate checksum
         if (pf) pf->doing("Validating download");
-        sha256_file( tmpHypervisorInstall, &checksum );
 
         CVMWA_LOG( "Info", "File checksum " << checksum << " <-> " << data->get(kChecksum)  );
         if (checksum.compare( data->get(kChecksum) ) != 0) {
@@ -790,4 +789,43 @@ std::string _vbox_changeUpperIP( std::string baseIP, int value ) {
     if (iDot == string::npos) return "";
     return baseIP.substr(0, iDot) + "." + ntos<int>(value);
     CRASH_REPORT_END;
-};
\ No newline at end of file
+};
+
+/**
+ * Tool function to parse the output of a --machinereadable VBoxManage command
+ */
+std::map< const std::string, const std::string > _vbox_parseMachineReadable( std::vector< std::string > * lines ) {
+    CRASH_REPORT_BEGIN;
+    map< const string, const string > ans;
+    string key, value;
+
+    // Every line is like: key="value", "key"="value" or key=value
+    for (vector<string>::iterator it = lines->begin(); it != lines->end(); ++it) {
+        const string& line = *it;
+        size_t iEq;
+
+        // Extract key
+        if (!line.empty() && (line[0] == '"')) {
+            size_t iQuote = line.find('"', 1);
+            if (iQuote == string::npos) continue;
+            key = line.substr(1, iQuote-1);
+            iEq = iQuote + 1;
+            if ((iEq >= line.length()) || (line[iEq] != '=')) continue;
+        } else {
+            iEq = line.find('=');
+            if (iEq == string::npos) continue;
+            key = line.substr(0, iEq);
+        }
+
+        // Extract value and strip the quotes
+        value = line.substr(iEq+1);
+        if ((value.length() >= 2) && (value[0] == '"') && (value[value.length()-1] == '"'))
+            value = value.substr(1, value.length()-2);
+
+        ans.insert(std::pair< const string, const string >( key, value ));
+    }
+
+    return ans;
+    CRASH_REPORT_END;
+};
+
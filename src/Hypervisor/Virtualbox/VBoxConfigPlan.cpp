@@ -0,0 +1,200 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/Hypervisor/Virtualbox/VBoxConfigPlan.h>
+
+#include <algorithm>
+#include <sstream>
+
+using namespace std;
+
+/**
+ * Normalize a value from the machine info in order to compare it with a
+ * modifyvm argument: Lower-case it and strip the trailing units ('MB' and '%').
+ */
+std::string __planNormalize( std::string value ) {
+    CRASH_REPORT_BEGIN;
+    std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+    if ((value.length() > 2) && (value.substr(value.length()-2) == "mb"))
+        value = value.substr(0, value.length()-2);
+    if ((value.length() > 1) && (value[value.length()-1] == '%'))
+        value = value.substr(0, value.length()-1);
+    return value;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Create an empty plan
+ */
+VBoxConfigPlan::VBoxConfigPlan() : vboxid(""), vmOptions(), natOptions(), appliedOptions(), pendingOptions() {
+}
+
+/**
+ * Start a new plan
+ */
+void VBoxConfigPlan::reset( const std::string& vboxid, const std::string& applied ) {
+    CRASH_REPORT_BEGIN;
+    this->vboxid = vboxid;
+    vmOptions.clear();
+    natOptions.clear();
+    pendingOptions.clear();
+
+    // Parse the applied options (stored as 'option=value;option=value')
+    appliedOptions.clear();
+    vector<string> parts;
+    string kk, kv;
+    explodeStr( applied, ";", &parts );
+    for (vector<string>::iterator it = parts.begin(); it != parts.end(); ++it) {
+        if (getKV( *it, &kk, &kv, '=', 0 ))
+            appliedOptions[kk] = kv;
+    }
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Request an option if it's different than the current value
+ */
+void VBoxConfigPlan::setVMOption( const std::string& option, const std::string& value, const std::string& current ) {
+    CRASH_REPORT_BEGIN;
+    if (__planNormalize(value) != __planNormalize(current))
+        setVMOption( option, value );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Request an option unconditionally
+ */
+void VBoxConfigPlan::setVMOption( const std::string& option, const std::string& value ) {
+    CRASH_REPORT_BEGIN;
+
+    // Replace the previous value if the option is already there
+    for (vector< pair<string, string> >::iterator it = vmOptions.begin(); it != vmOptions.end(); ++it) {
+        if ((*it).first == option) {
+            (*it).second = value;
+            return;
+        }
+    }
+    vmOptions.push_back( make_pair(option, value) );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Request an option that we cannot read back
+ */
+void VBoxConfigPlan::setBlindVMOption( const std::string& option, const std::string& value ) {
+    CRASH_REPORT_BEGIN;
+    map<string, string>::iterator it = appliedOptions.find( option );
+    if ((it != appliedOptions.end()) && ((*it).second == value))
+        return;
+    setVMOption( option, value );
+    pendingOptions[option] = value;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Ensure a NAT rule exists
+ */
+void VBoxConfigPlan::setNATRule( int nic, const std::string& name, const std::string& proto, const std::string& hostIP,
+                                 int hostPort, int guestPort, const std::map<const std::string, const std::string>& machineInfo ) {
+    CRASH_REPORT_BEGIN;
+    ostringstream oss;
+
+    // The rule as it should be listed in the machine info
+    oss.str(""); oss << name << "," << proto << "," << hostIP << "," << hostPort << ",," << guestPort;
+    string ruleSpec = oss.str();
+
+    // Look for a rule with the same name in the machine info. The rules are
+    // listed like: Forwarding(0)="guestapi,tcp,127.0.0.1,5555,,80"
+    bool found = false;
+    for (int i=0; ; i++) {
+        oss.str(""); oss << "Forwarding(" << i << ")";
+        map<const string, const string>::const_iterator it = machineInfo.find( oss.str() );
+        if (it == machineInfo.end()) break;
+
+        // Check the rule name and if it's the same rule
+        const string& rule = (*it).second;
+        if (rule.compare(0, name.length()+1, name + ",") != 0) continue;
+        if (rule == ruleSpec) return;
+        found = true;
+        break;
+    }
+
+    // Remove the stale rule and create the new one
+    if (found) {
+        oss.str(""); oss << "--natpf" << nic << " delete \"" << name << "\"";
+        natOptions.push_back( oss.str() );
+    }
+    oss.str(""); oss << "--natpf" << nic << " \"" << ruleSpec << "\"";
+    natOptions.push_back( oss.str() );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if there is nothing to apply
+ */
+bool VBoxConfigPlan::empty( bool withNATRules ) {
+    CRASH_REPORT_BEGIN;
+    return vmOptions.empty() && (!withNATRules || natOptions.empty());
+    CRASH_REPORT_END;
+}
+
+/**
+ * Build the modifyvm command line
+ */
+std::string VBoxConfigPlan::getModifyVMCommand( bool withNATRules ) {
+    CRASH_REPORT_BEGIN;
+    ostringstream args;
+    args << "modifyvm " << vboxid;
+    for (vector< pair<string, string> >::iterator it = vmOptions.begin(); it != vmOptions.end(); ++it) {
+        args << " --" << (*it).first << " \"" << (*it).second << "\"";
+    }
+    if (withNATRules) {
+        for (vector<string>::iterator it = natOptions.begin(); it != natOptions.end(); ++it) {
+            args << " " << *it;
+        }
+    }
+    return args.str();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Mark everything as applied
+ */
+std::string VBoxConfigPlan::commit( ) {
+    CRASH_REPORT_BEGIN;
+    for (map<string, string>::iterator it = pendingOptions.begin(); it != pendingOptions.end(); ++it) {
+        appliedOptions[(*it).first] = (*it).second;
+    }
+    vmOptions.clear();
+    natOptions.clear();
+    pendingOptions.clear();
+
+    // Serialize the applied options
+    string applied = "";
+    for (map<string, string>::iterator it = appliedOptions.begin(); it != appliedOptions.end(); ++it) {
+        if (!applied.empty()) applied += ";";
+        applied += (*it).first + "=" + (*it).second;
+    }
+    return applied;
+    CRASH_REPORT_END;
+}
@@ -24,6 +24,7 @@
 #include <iostream>
 #include <sstream>
 #include <map>
+#include <set>
 #include <algorithm>
 
 #include <CernVM/Config.h>
@@ -122,29 +123,127 @@ bool VBoxInstance::validateIntegrity() {
  */
 map<const string, const string> VBoxInstance::getMachineInfo( std::string uuid, int timeout ) {
     CRASH_REPORT_BEGIN;
-    vector<string> lines;
-    map<const string, const string> dat;
-    string err;
     
     // Local exec config
     SysExecConfig config(execConfig);
     config.timeout = timeout;
 
-    // Perform property update
+    return getMachineInfo( uuid, config );
+    CRASH_REPORT_END;
+};
+
+/** 
+ * Return virtual machine information, using the specified exec config.
+ * The information is shared with all the callers for MACHINE_INFO_TTL ms.
+ */
+map<const string, const string> VBoxInstance::getMachineInfo( std::string uuid, const SysExecConfig& config ) {
+    CRASH_REPORT_BEGIN;
+    vector<string> lines;
+    map<const string, const string> dat;
+    string err;
+
+    // Perform property update, unless somebody else did it while we were waiting
     int ans;
     NAMED_MUTEX_LOCK( uuid );
-    ans = this->exec("showvminfo "+uuid, &lines, &err, config );
-    NAMED_MUTEX_UNLOCK;
+    {
+        boost::mutex::scoped_lock lock(machineInfoMutex);
+        std::map< std::string, long >::iterator it = machineInfoTimestamp.find( uuid );
+        if ((it != machineInfoTimestamp.end()) && (getMillis() - (*it).second < MACHINE_INFO_TTL))
+            return machineInfoCache[uuid];
+    }
+    ans = this->exec("showvminfo "+uuid+" --machinereadable", &lines, &err, config );
     if (ans != 0) {
         dat.insert(make_pair(":ERROR:", ntos<int>( ans )));
         return dat;
     }
-    
-    /* Tokenize response */
-    return tokenize( &lines, ':' );
+
+    // Parse response and update cache
+    dat = _vbox_parseMachineReadable( &lines );
+    {
+        boost::mutex::scoped_lock lock(machineInfoMutex);
+        machineInfoCache.erase( uuid );
+        machineInfoCache.insert( std::make_pair( uuid, dat ) );
+        machineInfoTimestamp[uuid] = getMillis();
+    }
+    NAMED_MUTEX_UNLOCK;
+
+    return dat;
     CRASH_REPORT_END;
 };
 
+/**
+ * Return the information of many virtual machines at once. The queries of the
+ * machines that are not cached run in parallel on the exec pool.
+ */
+map< string, map<const string, const string> > VBoxInstance::getMachineInfo( const std::vector< std::string >& uuids, const SysExecConfig& config ) {
+    CRASH_REPORT_BEGIN;
+    map< string, map<const string, const string> > ans;
+    map< string, SysExecJobPtr > jobs;
+
+    // Use the cached information where possible and query the rest
+    for (std::vector< std::string >::const_iterator it = uuids.begin(); it != uuids.end(); ++it) {
+        const string& uuid = *it;
+        if (uuid.empty() || (ans.find(uuid) != ans.end()) || (jobs.find(uuid) != jobs.end())) continue;
+        {
+            boost::mutex::scoped_lock lock(machineInfoMutex);
+            std::map< std::string, long >::iterator jt = machineInfoTimestamp.find( uuid );
+            if ((jt != machineInfoTimestamp.end()) && (getMillis() - (*jt).second < MACHINE_INFO_TTL)) {
+                ans[uuid] = machineInfoCache[uuid];
+                continue;
+            }
+        }
+        jobs[uuid] = this->execAsync( "showvminfo "+uuid+" --machinereadable", config );
+    }
+
+    // Collect the results and update the cache
+    for (map< string, SysExecJobPtr >::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        const string& uuid = (*it).first;
+        SysExecJobPtr job = (*it).second;
+        map<const string, const string> dat;
+        int res = job->wait();
+        if (res != 0) {
+            dat.insert(make_pair(":ERROR:", ntos<int>( res )));
+            ans[uuid] = dat;
+            continue;
+        }
+
+        dat = _vbox_parseMachineReadable( &job->stdoutList );
+        {
+            boost::mutex::scoped_lock lock(machineInfoMutex);
+            machineInfoCache.erase( uuid );
+            machineInfoCache.insert( std::make_pair( uuid, dat ) );
+            machineInfoTimestamp[uuid] = getMillis();
+        }
+        ans[uuid] = dat;
+    }
+
+    return ans;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Drop the cached information of the specified VM. This should be
+ * called after every command that modifies the VM.
+ */
+void VBoxInstance::invalidateMachineInfo( const std::string& uuid ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(machineInfoMutex);
+
+    // The VM might also be cached by name
+    std::map< std::string, std::map< const std::string, const std::string > >::iterator it = machineInfoCache.begin();
+    while (it != machineInfoCache.end()) {
+        std::map< const std::string, const std::string >::iterator jt = (*it).second.find("UUID");
+        if (((*it).first == uuid) || ((jt != (*it).second.end()) && ((*jt).second == uuid))) {
+            machineInfoTimestamp.erase( (*it).first );
+            machineInfoCache.erase( it++ );
+        } else {
+            ++it;
+        }
+    }
+
+    CRASH_REPORT_END;
+}
+
 /**
  * Return all the properties of the guest
  */
@@ -385,13 +484,22 @@ int VBoxInstance::getCapabilities ( HVINFO_CAPS * caps ) {
     string err;
     int v;
     
+    // Query the system properties in parallel
+    SysExecJobPtr propJob = this->execAsync("list systemproperties", execConfig);
+
     // List the CPUID information
     int ans;
     NAMED_MUTEX_LOCK("generic");
     ans = this->exec("list hostcpuids", &lines, &err, execConfig);
     NAMED_MUTEX_UNLOCK;
-    if (ans != 0) return HVE_QUERY_ERROR;
-    if (lines.empty()) return HVE_EXTERNAL_ERROR;
+    if (ans != 0) {
+        propJob->cancel();
+        return HVE_QUERY_ERROR;
+    }
+    if (lines.empty()) {
+        propJob->cancel();
+        return HVE_EXTERNAL_ERROR;
+    }
     
     // Process lines
     for (vector<string>::iterator i = lines.begin(); i != lines.end(); i++) {
@@ -441,10 +549,9 @@ int VBoxInstance::getCapabilities ( HVINFO_CAPS * caps ) {
     caps->cpu.has64bit =
         ( (caps->cpu.featuresC & 0x20000000) != 0 ); // Long mode 'lm'
         
-    // List the system properties
-    NAMED_MUTEX_LOCK("generic");
-    ans = this->exec("list systemproperties", &lines, &err, execConfig);
-    NAMED_MUTEX_UNLOCK;
+    // Collect the system properties
+    ans = propJob->wait();
+    lines = propJob->stdoutList;
     if (ans != 0) return HVE_QUERY_ERROR;
     if (lines.empty()) return HVE_EXTERNAL_ERROR;
 
@@ -468,25 +575,160 @@ int VBoxInstance::getCapabilities ( HVINFO_CAPS * caps ) {
 };
 
 /**
- * Get a list of mediums managed by VirtualBox
+ * Return the modification time of the VirtualBox global configuration, that
+ * changes every time a medium or a VM is (un-)registered.
  */
-std::vector< std::map< const std::string, const std::string > > VBoxInstance::getDiskList() {
+std::time_t __vboxConfigTime() {
+    CRASH_REPORT_BEGIN;
+    vector<string> candidates;
+    struct stat st;
+
+    // Collect the possible locations of VirtualBox.xml
+    const char * vboxHome = getenv("VBOX_USER_HOME");
+    if (vboxHome != NULL) {
+        candidates.push_back( string(vboxHome) + "/VirtualBox.xml" );
+    } else {
+        #ifdef _WIN32
+        const char * home = getenv("USERPROFILE");
+        #else
+        const char * home = getenv("HOME");
+        #endif
+        if (home != NULL) {
+            #if defined(__APPLE__) && defined(__MACH__)
+            candidates.push_back( string(home) + "/Library/VirtualBox/VirtualBox.xml" );
+            #endif
+            candidates.push_back( string(home) + "/.config/VirtualBox/VirtualBox.xml" );
+            candidates.push_back( string(home) + "/.VirtualBox/VirtualBox.xml" );
+        }
+    }
+
+    // Pick the first one
+    for (vector<string>::iterator it = candidates.begin(); it != candidates.end(); ++it) {
+        if (stat( (*it).c_str(), &st ) == 0)
+            return st.st_mtime;
+    }
+    return 0;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Normalize a medium location for indexing
+ */
+std::string __vboxMediaKey( std::string location ) {
+    CRASH_REPORT_BEGIN;
+    std::replace( location.begin(), location.end(), '\\', '/' );
+    return location;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Update the cached media registry if it's missing, expired or changed.
+ * This function must be called with mediaMutex locked.
+ */
+void VBoxInstance::updateDiskList() {
     CRASH_REPORT_BEGIN;
     vector<string> lines;
-    std::vector< std::map< const std::string, const std::string > > emptyMap;
     string err;
 
-    // List the running VMs in the system
+    // Check if the cache is still valid
+    unsigned long ms = getMillis();
+    std::time_t configTime = __vboxConfigTime();
+    if (mediaLoaded && (ms < mediaTimestamp + MEDIA_REGISTRY_TTL) && (configTime == mediaConfigTime))
+        return;
+
+    // List the disks in the system
     int ans;
     NAMED_MUTEX_LOCK("generic");
     ans = this->exec("list hdds", &lines, &err, execConfig);
     NAMED_MUTEX_UNLOCK;
-    if (ans != 0) return emptyMap;
-    if (lines.empty()) return emptyMap;
 
-    // Tokenize lists
-    std::vector< std::map< const std::string, const std::string > > resMap = tokenizeList( &lines, ':' );
-    return resMap;
+    // Reset the cache
+    mediaList.clear();
+    mediaByUUID.clear();
+    mediaByLocation.clear();
+    mediaLoaded = false;
+    if (ans != 0) return;
+
+    // Tokenize lists and index them
+    mediaList = tokenizeList( &lines, ':' );
+    for (size_t i=0; i<mediaList.size(); i++) {
+        map<const string, const string>::iterator it;
+        it = mediaList[i].find("UUID");
+        if (it != mediaList[i].end())
+            mediaByUUID[(*it).second] = i;
+        it = mediaList[i].find("Location");
+        if (it != mediaList[i].end())
+            mediaByLocation[__vboxMediaKey((*it).second)] = i;
+    }
+
+    // Keep the cache validation information
+    mediaLoaded = true;
+    mediaTimestamp = ms;
+    mediaConfigTime = configTime;
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the properties of all the disks in the media registry
+ */
+std::vector< std::map< const std::string, const std::string > > VBoxInstance::getDiskList() {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(mediaMutex);
+    updateDiskList();
+    return mediaList;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the properties of the disk with the specified UUID
+ */
+std::map<const std::string, const std::string> VBoxInstance::findDiskByUUID( const std::string& uuid ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(mediaMutex);
+    updateDiskList();
+    std::map< std::string, size_t >::iterator it = mediaByUUID.find( uuid );
+    if (it == mediaByUUID.end()) return map<const string, const string>();
+    return mediaList[(*it).second];
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the properties of the disk in the specified location
+ */
+std::map<const std::string, const std::string> VBoxInstance::findDiskByLocation( const std::string& location ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(mediaMutex);
+    updateDiskList();
+    std::map< std::string, size_t >::iterator it = mediaByLocation.find( __vboxMediaKey(location) );
+    if (it == mediaByLocation.end()) return map<const string, const string>();
+    return mediaList[(*it).second];
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the UUID of the multi-attach master disk in the specified location
+ */
+std::string VBoxInstance::findMultiAttachMaster( const std::string& location ) {
+    CRASH_REPORT_BEGIN;
+    map<const string, const string> disk = findDiskByLocation( location );
+    if ( (disk.find("Type") != disk.end()) && (disk.find("Parent UUID") != disk.end()) && (disk.find("UUID") != disk.end()) ) {
+        if ( (disk["Type"].compare("multiattach") == 0) && (disk["Parent UUID"].compare("base") == 0) ) {
+            return disk["UUID"];
+        }
+    }
+    return "";
+    CRASH_REPORT_END;
+}
+
+/**
+ * Invalidate the cached media registry. This should be called
+ * after every operation that (un-)registers a medium.
+ */
+void VBoxInstance::invalidateDiskList() {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(mediaMutex);
+    mediaLoaded = false;
     CRASH_REPORT_END;
 }
 
@@ -595,18 +837,25 @@ void VBoxInstance::sessionDelete ( const HVSessionPtr& session ) {
         if ( uuid.compare(session->uuid) == 0 ) {
 
             // Loook for the session object in the open sessions
-            for (std::list< HVSessionPtr >::iterator jt = openSessions.begin(); jt != openSessions.end(); ++jt) {
-                HVSessionPtr openSess = (*jt);
-                // Check if the session has gone away
-                if ( uuid.compare(openSess->uuid) == 0 ) {
-                    // Remove from open sessions
-                    openSessions.erase( jt );
-                    // Let session know that it has gone away
-                    boost::static_pointer_cast<VBoxSession>(sess)->hvNotifyDestroyed();
-                    break;
+            bool wasOpen = false;
+            {
+                boost::recursive_mutex::scoped_lock lock(openSessionsMutex);
+                for (std::list< HVSessionPtr >::iterator jt = openSessions.begin(); jt != openSessions.end(); ++jt) {
+                    HVSessionPtr openSess = (*jt);
+                    // Check if the session has gone away
+                    if ( uuid.compare(openSess->uuid) == 0 ) {
+                        // Remove from open sessions
+                        openSessions.erase( jt );
+                        wasOpen = true;
+                        break;
+                    }
                 }
             }
 
+            // Let session know that it has gone away
+            if (wasOpen)
+                boost::static_pointer_cast<VBoxSession>(sess)->hvNotifyDestroyed();
+
             // Erase session from the sessions list
             this->sessions.erase( i );
 
@@ -615,6 +864,9 @@ void VBoxInstance::sessionDelete ( const HVSessionPtr& session ) {
             oss << "vbsess-" << uuid;
             LocalConfig::forRuntime(oss.str())->clear();
 
+            // Release the cached images it was using
+            imageCache->unpin( uuid );
+
             // Done
             return;
         }
@@ -630,20 +882,26 @@ void VBoxInstance::sessionClose( const HVSessionPtr& session ) {
     CRASH_REPORT_BEGIN;
 
     // Check if there are many open sessions
-    if (--session->instances > 0)
-        return;
+    {
+        boost::recursive_mutex::scoped_lock lock(openSessionsMutex);
+        if (--session->instances > 0)
+            return;
+    }
 
     // Abort any open session FSM
     session->abort();
 
     // Loook for the session object in the open sessions & remove it
-    for (std::list< HVSessionPtr >::iterator jt = openSessions.begin(); jt != openSessions.end(); ++jt) {
-        HVSessionPtr openSess = (*jt);
-        // Check if the session has gone away
-        if ( session->uuid.compare(openSess->uuid) == 0 ) {
-            // Remove from open sessions
-            openSessions.erase( jt );
-            break;
+    {
+        boost::recursive_mutex::scoped_lock lock(openSessionsMutex);
+        for (std::list< HVSessionPtr >::iterator jt = openSessions.begin(); jt != openSessions.end(); ++jt) {
+            HVSessionPtr openSess = (*jt);
+            // Check if the session has gone away
+            if ( session->uuid.compare(openSess->uuid) == 0 ) {
+                // Remove from open sessions
+                openSessions.erase( jt );
+                break;
+            }
         }
     }
 
@@ -671,7 +929,7 @@ int VBoxInstance::loadSessions( const FiniteTaskPtr & pf ) {
 
     // Initialize progress feedback
     if (pf) {
-        pf->setMax(4);
+        pf->setMax(5);
         pf->doing("Loading sessions from disk");
     }
 
@@ -766,30 +1024,53 @@ int VBoxInstance::loadSessions( const FiniteTaskPtr & pf ) {
     // Forward progress
     if (pf) {
         pf->done("Sessions cleaned-up");
-        pf->doing("Releasing old open sessions");
+        pf->doing("Loading machine information");
     }
 
-    // [4] Check if some of the currently open session 
-    //     was lost.
+    // [4] Query the information of all the remaining
+    //     VMs in parallel and pass it to the sessions
     // ===========================================
-    for (std::list< HVSessionPtr >::iterator it = openSessions.begin(); it != openSessions.end(); ++it) {
-        HVSessionPtr sess = (*it);
-
-        // Check if the session has gone away
-        if (sessions.find(sess->uuid) == sessions.end()) {
-   
-            // Let session know that it has gone away
-            boost::static_pointer_cast<VBoxSession>(sess)->hvNotifyDestroyed();
+    vector< string > vboxIds;
+    for (std::map< std::string,HVSessionPtr >::iterator it = this->sessions.begin(); it != this->sessions.end(); ++it) {
+        vboxIds.push_back( (*it).second->parameters->get("vboxid") );
+    }
+    map< string, map<const string, const string> > machineInfo = getMachineInfo( vboxIds, execConfig );
+    for (std::map< std::string,HVSessionPtr >::iterator it = this->sessions.begin(); it != this->sessions.end(); ++it) {
+        HVSessionPtr sess = (*it).second;
+        map< string, map<const string, const string> >::iterator jt = machineInfo.find( sess->parameters->get("vboxid") );
+        if ((jt == machineInfo.end()) || ((*jt).second.find(":ERROR:") != (*jt).second.end())) continue;
+        sess->machine->fromMap( &(*jt).second, true );
+    }
 
-            // Remove it from open and rewind
-            openSessions.erase( it );
-            it = openSessions.begin();
+    // Forward progress
+    if (pf) {
+        pf->done("Machine information loaded");
+        pf->doing("Releasing old open sessions");
+    }
 
-            // Quit if we are done
-            if (openSessions.size() == 0) break;
+    // [5] Check if some of the currently open session 
+    //     was lost.
+    // ===========================================
+    std::list< HVSessionPtr > lostSessions;
+    {
+        boost::recursive_mutex::scoped_lock lock(openSessionsMutex);
+        std::list< HVSessionPtr >::iterator it = openSessions.begin();
+        while (it != openSessions.end()) {
+
+            // Check if the session has gone away
+            if (sessions.find((*it)->uuid) == sessions.end()) {
+                lostSessions.push_back( *it );
+                openSessions.erase( it++ );
+            } else {
+                ++it;
+            }
 
         }
+    }
 
+    // Let them know that they have gone away
+    for (std::list< HVSessionPtr >::iterator it = lostSessions.begin(); it != lostSessions.end(); ++it) {
+        boost::static_pointer_cast<VBoxSession>(*it)->hvNotifyDestroyed();
     }
 
     // Notify progress
@@ -800,20 +1081,113 @@ int VBoxInstance::loadSessions( const FiniteTaskPtr & pf ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Translate the 'VMState' of the machine-readable VM information into
+ * a session state. Returns -1 for the transient states.
+ */
+int __vboxMachineState( const std::string& state ) {
+    CRASH_REPORT_BEGIN;
+    if (state == "running") {
+        return SS_RUNNING;
+    } else if (state == "paused") {
+        return SS_PAUSED;
+    } else if (state == "saved") {
+        return SS_SAVED;
+    } else if ((state == "poweroff") || (state == "aborted")) {
+        return SS_POWEROFF;
+    }
+    return -1;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Update the state of all the open sessions. One 'list vms' finds the VMs that
+ * are still registered and the machine-readable information of all of them is
+ * queried in parallel, through the shared machine information cache.
+ */
+int VBoxInstance::refreshAll( ) {
+    CRASH_REPORT_BEGIN;
+    vector<string> lines;
+    string err;
+
+    // Work on a copy, since the sessions can be opened or closed meanwhile
+    std::list< HVSessionPtr > sessList;
+    {
+        boost::recursive_mutex::scoped_lock lock(openSessionsMutex);
+        sessList = openSessions;
+    }
+
+    // Nothing to do if there are no open sessions
+    if (sessList.empty()) return HVE_OK;
+
+    // [1] Find the registered VMs
+    // ============================
+    if (this->exec( "list vms", &lines, &err, execConfig ) != 0)
+        return HVE_QUERY_ERROR;
+    std::set< string > registered;
+    map<const string, const string> vms = tokenize( &lines, '{' );
+    for (std::map<const string, const string>::iterator it=vms.begin(); it!=vms.end(); ++it) {
+        string uuid = (*it).second;
+        registered.insert( uuid.substr(0, uuid.length()-1) );
+    }
+
+    // [2] Query the state of the registered VMs in parallel
+    // ======================================================
+    vector<string> vboxIds;
+    for (std::list< HVSessionPtr >::iterator it = sessList.begin(); it != sessList.end(); ++it) {
+        string vboxid = (*it)->parameters->get("vboxid", "");
+        if (registered.find(vboxid) != registered.end())
+            vboxIds.push_back( vboxid );
+    }
+    map< string, map<const string, const string> > machineInfo = getMachineInfo( vboxIds, execConfig );
+
+    // [3] Fan-out the states to the open sessions
+    // ============================================
+    for (std::list< HVSessionPtr >::iterator it = sessList.begin(); it != sessList.end(); ++it) {
+        VBoxSessionPtr sess = boost::static_pointer_cast<VBoxSession>( *it );
+        string vboxid = sess->parameters->get("vboxid", "");
+        if (vboxid.empty()) continue;
+
+        // Sessions not registered any more are gone
+        if (registered.find(vboxid) == registered.end()) {
+            sess->hvNotifyState( SS_MISSING );
+            continue;
+        }
+
+        // Pass the state of the rest
+        map< string, map<const string, const string> >::iterator jt = machineInfo.find( vboxid );
+        if (jt == machineInfo.end()) continue;
+        map<const string, const string>::iterator kt = (*jt).second.find( "VMState" );
+        if (kt == (*jt).second.end()) continue;
+        int state = __vboxMachineState( (*kt).second );
+        if (state != -1) sess->hvNotifyState( state );
+
+    }
+
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
 /**
  * Abort what's happening and prepare for shutdown
  */
 void VBoxInstance::abort() {
     CRASH_REPORT_BEGIN;
 
+    // Take the open sessions
+    std::list< HVSessionPtr > sessList;
+    {
+        boost::recursive_mutex::scoped_lock lock(openSessionsMutex);
+        sessList.swap( openSessions );
+    }
+
     // Abort all open sessions
-    for (std::list< HVSessionPtr >::iterator it = openSessions.begin(); it != openSessions.end(); ++it) {
+    for (std::list< HVSessionPtr >::iterator it = sessList.begin(); it != sessList.end(); ++it) {
         HVSessionPtr sess = (*it);
         sess->abort();
     }
 
     // Cleanup
-    openSessions.clear();
     sessions.clear();
 
     CRASH_REPORT_END;
@@ -919,7 +1293,7 @@ int VBoxInstance::installExtPack( DomainKeystore & keystore, const DownloadProvi
     // Download extension pack
     string tmpExtpackFile = getTmpDir() + "/" + getFilename( data->get(kExtpackUrl) );
     CVMWA_LOG( "Info", "Downloading " << data->get(kExtpackUrl) << " to " << tmpExtpackFile  );
-    res = downloadProvider->downloadFile( data->get(kExtpackUrl), tmpExtpackFile, downloadPf );
+    res = downloadProvider->downloadFileSHA256( data->get(kExtpackUrl), tmpExtpackFile, &checksum, downloadPf );
     CVMWA_LOG( "Info", "    : Got " << res  );
     if ( res != HVE_OK ) {
         if (pf) pf->fail("Unable to download extension pack", res);
@@ -928,7 +1302,6 @@ int VBoxInstance::installExtPack( DomainKeystore & keystore, const DownloadProvi
     
     // Validate checksum
     if (pf) pf->doing("Validating extension pack integrity");
-    sha256_file( tmpExtpackFile, &checksum );
     CVMWA_LOG( "Info", "File checksum " << checksum << " <-> " << data->get(kExtpackChecksum)  );
     if (checksum.compare( data->get(kExtpackChecksum) ) != 0) {
         if (pf) pf->fail("Extension pack integrity was not validated", HVE_NOT_VALIDATED);
@@ -29,154 +29,227 @@ bool VBoxLogProbe::exists() {
 	return file_exists(logFile);
 }
 
+/**
+ * Read the first bytes of the given file
+ */
+std::string __logProbeHeader( const std::string& file ) {
+    CRASH_REPORT_BEGIN;
+    char buffer[LOGPROBE_HEADER_SIZE];
+    ifstream fIn(file.c_str(), ifstream::in | ifstream::binary);
+    if (!fIn.is_open()) return "";
+    fIn.read( buffer, LOGPROBE_HEADER_SIZE );
+    return string( buffer, (size_t)fIn.gcount() );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Forget the position in the log file
+ */
+void VBoxLogProbe::reset() {
+    CRASH_REPORT_BEGIN;
+    offset = 0;
+    started = false;
+    stateBlocked = false;
+    header = "";
+    lineBuffer = "";
+    CRASH_REPORT_END;
+}
+
 /**
  * Analyze log file
  */
 void VBoxLogProbe::analyze() {
     CRASH_REPORT_BEGIN;
 
-	// Reset state
+	// Reset the event flags
 	hasState = false;
-    state = SS_POWEROFF;
-
-    // Reset failures
     hasFailures = false;
     failures = 0;
-
-	// Reset resolution
 	hasResolutionChange = false;
-    resWidth = 0;
-    resHeight = 0;
-    resBpp = 0;
-
-    // Local config
-    bool blockStateChange = false;
 
     // Locate Logfile
-    CVMWA_LOG("Debug", "Looking for state change  in " << logFile );
     if (!file_exists(logFile)) {
     	state = SS_MISSING;
+        reset();
     	return;
     }
 
-    // Open input stream
-    ifstream fIn(logFile.c_str(), ifstream::in);
-
-    // Read as few bytes as possible
-    string inBufferLine, stateStr;
-    size_t iStart, iEnd, i1, i2, qStart, qEnd;
-    char inBuffer[1024];
-
-    // If we are doing tailRead, seek to the
-    // specified tail size.
-    if (tailSize > 0) {
+    // Check if the file was rotated. The header of the file we were following
+    // should still be there (it might have grown if the file was tiny).
+    string newHeader = __logProbeHeader( logFile );
+    if (started && (newHeader.compare( 0, header.length(), header ) != 0)) {
+        CVMWA_LOG("Debug", "Log file " << logFile << " was rotated");
 
-		// Calculate file length
-		fIn.seekg( 0, fIn.end );
-		int seekSize = fIn.tellg();
-		if (seekSize > tailSize) seekSize = tailSize;
+        // VirtualBox renames the old file to VBox.log.1, so
+        // collect what was appended before the rotation.
+        string rotatedFile = logFile + ".1";
+        if (__logProbeHeader( rotatedFile ).compare( 0, header.length(), header ) == 0)
+            follow( rotatedFile );
+        if (!lineBuffer.empty()) parseLine( lineBuffer );
 
-		// Move 80kb before te end of the file
-		fIn.clear();
-		fIn.seekg( -seekSize, fIn.end );
+        // Start following the new file from the beginning
+        reset();
+        started = true;
 
     }
+    header = newHeader;
 
-    // Start scanning
-    while (!fIn.eof()) {
+    // Process the new data
+    follow( logFile );
 
-        // Read line
-        fIn.getline( inBuffer, 1023 );
-
-        // Handle it via higher-level API
-        inBufferLine.assign( inBuffer );
-
-        if ( ((iStart = inBufferLine.find("Changing the VM state from")) != string::npos) && !blockStateChange ) {
+    CRASH_REPORT_END;
+}
 
-        	// We got a state change
-			hasState = true;
+/**
+ * Read the new bytes of the given file
+ */
+void VBoxLogProbe::follow( const std::string& file ) {
+    CRASH_REPORT_BEGIN;
 
-            // Pick the appropriate ending
-            iEnd = inBufferLine.length();
-            i1 = inBufferLine.find("\r");
-            i2 = inBufferLine.find("\n");
-            if (i1 < iEnd) iEnd=i1;
-            if (i2 < iEnd) iEnd=i2;
+    // Open input stream
+    ifstream fIn(file.c_str(), ifstream::in | ifstream::binary);
+    if (!fIn.is_open()) return;
+
+    // Calculate file length
+    fIn.seekg( 0, fIn.end );
+    std::streamoff fileSize = fIn.tellg();
+
+    // The first time we only read the tail of the file. If we start
+    // in the middle of a line, it will be dropped.
+    bool dropLine = false;
+    if (!started) {
+        started = true;
+        offset = 0;
+        if ((tailSize > 0) && (fileSize > tailSize)) {
+            offset = fileSize - tailSize;
+            dropLine = true;
+        }
+    }
 
-            // Find first quotation
-            qStart = inBufferLine.find('\'', iStart);
-            if (qStart == string::npos) continue;
-            qEnd = inBufferLine.find('\'', qStart+1);
-            if (qEnd == string::npos) continue;
+    // If the file was truncated, start over
+    if (fileSize < offset) {
+        offset = 0;
+        lineBuffer = "";
+        dropLine = false;
+    }
 
-            // Find second quotation
-            qStart = inBufferLine.find('\'', qEnd+1);
-            if (qStart == string::npos) continue;
-            qEnd = inBufferLine.find('\'', qStart+1);
-            if (qEnd == string::npos) continue;
+    // Nothing new
+    if (fileSize == offset) return;
+
+    // Read the new bytes
+    char inBuffer[4096];
+    size_t lineStart, lineEnd;
+    fIn.clear();
+    fIn.seekg( offset, fIn.beg );
+    while (fIn.good() && (offset < fileSize)) {
+        fIn.read( inBuffer, sizeof(inBuffer) );
+        std::streamsize bytes = fIn.gcount();
+        if (bytes <= 0) break;
+        offset += bytes;
+        lineBuffer.append( inBuffer, (size_t)bytes );
+
+        // Process the complete lines
+        lineStart = 0;
+        while ((lineEnd = lineBuffer.find('\n', lineStart)) != string::npos) {
+            if (dropLine) {
+                dropLine = false;
+            } else {
+                parseLine( lineBuffer.substr( lineStart, lineEnd - lineStart ) );
+            }
+            lineStart = lineEnd + 1;
+        }
+        lineBuffer.erase( 0, lineStart );
+    }
 
-            // Extract string
-            stateStr = inBufferLine.substr( qStart+1, qEnd-qStart-1 );
+    fIn.close();
 
-            // Compare to known state names
-            CVMWA_LOG("Debug","Got switch to " << stateStr);
-            if      (stateStr.compare("RUNNING") == 0) state = SS_RUNNING;
-            else if (stateStr.compare("SUSPENDED") == 0) state = SS_PAUSED;
-            else if (stateStr.compare("OFF") == 0) state = SS_POWEROFF;
+    CRASH_REPORT_END;
+}
 
+/**
+ * Parse a single line of the log file
+ */
+void VBoxLogProbe::parseLine( const std::string& inBufferLine ) {
+    CRASH_REPORT_BEGIN;
+    string stateStr;
+    size_t iStart, qStart, qEnd;
+
+    if ((iStart = inBufferLine.find("Changing the VM state from")) != string::npos) {
+
+        // After 'SAVING' the state is saved, regardless of what follows
+        if (stateBlocked) return;
+
+        // Find first quotation
+        qStart = inBufferLine.find('\'', iStart);
+        if (qStart == string::npos) return;
+        qEnd = inBufferLine.find('\'', qStart+1);
+        if (qEnd == string::npos) return;
+
+        // Find second quotation
+        qStart = inBufferLine.find('\'', qEnd+1);
+        if (qStart == string::npos) return;
+        qEnd = inBufferLine.find('\'', qStart+1);
+        if (qEnd == string::npos) return;
+
+        // Extract string
+        stateStr = inBufferLine.substr( qStart+1, qEnd-qStart-1 );
+
+        // Compare to known state names
+        CVMWA_LOG("Debug","Got switch to " << stateStr);
+        if      (stateStr.compare("RUNNING") == 0) state = SS_RUNNING;
+        else if (stateStr.compare("SUSPENDED") == 0) state = SS_PAUSED;
+        else if (stateStr.compare("OFF") == 0) state = SS_POWEROFF;
+        else if (stateStr.compare("SAVING") == 0) {
             // If we got 'SAVING' it means the VM was saved
-            if (stateStr.compare("SAVING") == 0) {
-                fIn.close();
-                blockStateChange = true;
-                state = SS_SAVED;
-            }
-
-        } else if ((iStart = inBufferLine.find("Display::handleDisplayResize")) != string::npos) {
+            stateBlocked = true;
+            state = SS_SAVED;
+        }
+        else return;
 
-        	// We got a resolutino change
-        	hasResolutionChange = true;
+        // We got a state change
+        hasState = true;
 
-			// Get W component
-			qStart = inBufferLine.find("w=", iStart);
-			if (qStart == string::npos) continue;
-			qEnd = inBufferLine.find(" ", qStart);
-			if (qEnd == string::npos) continue;
-			resWidth = ston<int>( inBufferLine.substr( qStart+2, qEnd-qStart-2 ) );
+    } else if ((iStart = inBufferLine.find("Display::handleDisplayResize")) != string::npos) {
 
-			// Get H component
-			qStart = inBufferLine.find("h=", iStart);
-			if (qStart == string::npos) continue;
-			qEnd = inBufferLine.find(" ", qStart);
-			if (qEnd == string::npos) continue;
-			resHeight = ston<int>( inBufferLine.substr( qStart+2, qEnd-qStart-2 ) );
+        // Get W component
+        qStart = inBufferLine.find("w=", iStart);
+        if (qStart == string::npos) return;
+        qEnd = inBufferLine.find(" ", qStart);
+        if (qEnd == string::npos) return;
+        resWidth = ston<int>( inBufferLine.substr( qStart+2, qEnd-qStart-2 ) );
 
-			// Get BPP component
-			qStart = inBufferLine.find("bpp=", iStart);
-			if (qStart == string::npos) continue;
-			qEnd = inBufferLine.find(" ", qStart);
-			if (qEnd == string::npos) continue;
-			resBpp = ston<int>( inBufferLine.substr( qStart+2, qEnd-qStart-4 ) );
+        // Get H component
+        qStart = inBufferLine.find("h=", iStart);
+        if (qStart == string::npos) return;
+        qEnd = inBufferLine.find(" ", qStart);
+        if (qEnd == string::npos) return;
+        resHeight = ston<int>( inBufferLine.substr( qStart+2, qEnd-qStart-2 ) );
 
-        } else if ((iStart = inBufferLine.find("WARNING! ")) != string::npos) {
+        // Get BPP component
+        qStart = inBufferLine.find("bpp=", iStart);
+        if (qStart == string::npos) return;
+        qEnd = inBufferLine.find(" ", qStart);
+        if (qEnd == string::npos) return;
+        resBpp = ston<int>( inBufferLine.substr( qStart+4, qEnd-qStart-4 ) );
 
-            // We got failures
-            hasFailures = true;
+        // We got a resolution change
+        hasResolutionChange = true;
 
-            // Check what kind of warning this was
-            if (inBufferLine.find("64-bit guest type selected but the host CPU does NOT support 64-bit") != string::npos) {
-                failures |= HFL_NO_VIRTUALIZATION;
+    } else if (inBufferLine.find("WARNING! ") != string::npos) {
 
-            } else if (inBufferLine.find("64-bit guest type selected but the host CPU does NOT support HW virtualization") != string::npos) {
-                failures |= HFL_NO_VIRTUALIZATION;
+        // We got failures
+        hasFailures = true;
 
-            }
+        // Check what kind of warning this was
+        if (inBufferLine.find("64-bit guest type selected but the host CPU does NOT support 64-bit") != string::npos) {
+            failures |= HFL_NO_VIRTUALIZATION;
 
+        } else if (inBufferLine.find("64-bit guest type selected but the host CPU does NOT support HW virtualization") != string::npos) {
+            failures |= HFL_NO_VIRTUALIZATION;
 
         }
 
     }
 
-    fIn.close();
-
     CRASH_REPORT_END;
-}
\ No newline at end of file
+}
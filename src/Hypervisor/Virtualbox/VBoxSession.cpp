@@ -23,6 +23,7 @@
 #include <CernVM/Hypervisor/Virtualbox/VBoxInstance.h>
 #include <CernVM/Hypervisor/Virtualbox/VBoxProbes.h>
 #include <CernVM/Utilities.h>
+#include <CernVM/FileWatch.h>
 
 #include <boost/filesystem.hpp> 
 
@@ -36,6 +37,96 @@ const char kPathSeparator =
     '/';
 #endif
 
+/////////////////////////////////////
+/////////////////////////////////////
+////
+//// FSM definition
+////
+/////////////////////////////////////
+/////////////////////////////////////
+
+/**
+ * The states and the actions of the VBoxSession FSM. The actions that drive
+ * the hypervisor have a deadline, after which they are routed to the error state.
+ */
+const FSMStaticNode VBoxSession::fsmNodeTable[] = {
+
+    // Target states
+    FSM_STATIC_STATE(1, 100),                                               // Entry point
+    FSM_STATIC_STATE(2, 102,112),                                           // Error
+    FSM_STATIC_STATE(3, 104),                                               // Destroyed
+    FSM_STATIC_STATE(4, 105,108),                                           // Power off
+    FSM_STATIC_STATE(5, 107,211),                                           // Saved
+    FSM_STATIC_STATE(6, 109,111),                                           // Paused
+    FSM_STATIC_STATE(7, 110,106),                                           // Running
+
+    // 100: INITIALIZE HYPERVISOR
+    FSM_STATIC_HANDLER(VBoxSession, 100, Initialize,            101),
+
+    // 101: UPDATE SESSION STATE FROM THE HYPERVISOR
+    FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 101, UpdateSession,        SESSION_HANDLER_TIMEOUT, 2,3,4,5,6,7),
+
+    // 102: HANDLE ERROR SEQUENCE
+    FSM_STATIC_HANDLER(VBoxSession, 102, HandleError,           103),
+        FSM_STATIC_HANDLER(VBoxSession, 103, CureError,         101),       // Try to recover error and recheck state
+
+    // 104: CREATE SEQUENCE
+    FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 104, CreateVM,             SESSION_HANDLER_TIMEOUT, 4),         // Create new VM
+
+    // 105: DESTROY SEQUENCE
+    FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 105, ReleaseVMScratch,     SESSION_HANDLER_TIMEOUT, 207),       // Release Scratch storage
+        FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 207, ReleaseVMBoot,    SESSION_HANDLER_TIMEOUT, 208),       // Release Boot Media
+        FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 208, DestroyVM,        SESSION_HANDLER_TIMEOUT, 3),         // Destroy VM
+
+    // 106: POWEROFF SEQUENCE
+    FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 106, PoweroffVM,           SESSION_HANDLER_TIMEOUT, 209),       // Power off the VM
+        FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 209, ReleaseVMAPI,     SESSION_HANDLER_TIMEOUT, 4),         // Release the VM API media
+
+    // 211: CHECK VMAPI STATE
+    FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 211, CheckVMAPI,           SESSION_HANDLER_TIMEOUT, 206),       // Check if we can resume from current VMAPI Data of we should restart
+
+    // 107: DISCARD STATE SEQUENCE
+    FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 107, DiscardVMState,       SESSION_HANDLER_TIMEOUT, 209),       // Discard saved state of the VM (and release the VM API media)
+
+    // 108: START SEQUENCE
+    FSM_STATIC_HANDLER(VBoxSession, 108, PrepareVMBoot,         210),       // Prepare start parameters
+        FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 210, ConfigNetwork,    SESSION_HANDLER_TIMEOUT, 201),       // Configure the network devices
+        FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 201, ConfigureVM,      SESSION_HANDLER_TIMEOUT, 202),       // Configure VM
+        FSM_STATIC_HANDLER(VBoxSession, 202, DownloadMedia,     203),       // Download required media files
+        FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 203, ConfigureVMBoot,  SESSION_HANDLER_TIMEOUT, 204),       // Configure Boot media
+        FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 204, ConfigureVMScratch, SESSION_HANDLER_TIMEOUT, 205),     // Configure Scratch storage
+        FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 205, ConfigureVMAPI,   SESSION_HANDLER_TIMEOUT, 206),       // Configure API Disks
+        FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 206, StartVM,          SESSION_HANDLER_TIMEOUT, 7),         // Launch the VM
+
+    // 109: SAVE STATE SEQUENCE
+    FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 109, SaveVMState,          SESSION_HANDLER_TIMEOUT, 5),         // Save VM state
+
+    // 110: PAUSE SEQUENCE
+    FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 110, PauseVM,              SESSION_HANDLER_TIMEOUT, 6),         // Pause VM
+
+    // 111: PAUSE SEQUENCE
+    FSM_STATIC_HANDLER_TIMEOUT(VBoxSession, 111, ResumeVM,             SESSION_HANDLER_TIMEOUT, 7),         // Resume VM
+
+    // 112: FATAL ERROR HANDLING
+    FSM_STATIC_HANDLER(VBoxSession, 112, FatalErrorSink,        0),         // Fatal Error Sink
+
+};
+
+/**
+ * The fork/join groups of the VBoxSession FSM
+ */
+const FSMStaticFork VBoxSession::fsmForkTable[] = {
+
+    // Download the media while configuring the VM, joining before the boot media are attached
+    { 108, 202 },
+
+};
+
+/**
+ * The complete VBoxSession FSM, with entry point on '1'
+ */
+const FSMStaticDef VBoxSession::fsmDefinition = FSM_STATIC_DEF( 1, VBoxSession::fsmNodeTable, VBoxSession::fsmForkTable );
+
 /////////////////////////////////////
 /////////////////////////////////////
 ////
@@ -113,6 +204,20 @@ std::string macroReplace( ParameterMapPtr mapData, std::string iString ) {
     CRASH_REPORT_END;
 };
 
+/**
+ * Check if the given VBoxManage command modifies the VM configuration or state
+ */
+bool __vbox_isMutating( const std::string& cmd ) {
+    CRASH_REPORT_BEGIN;
+    static const char * verbs[] = { "modifyvm ", "storageattach ", "storagectl ", "controlvm ", 
+                                    "startvm ", "discardstate ", "unregistervm ", "snapshot ", NULL };
+    for (int i=0; verbs[i] != NULL; i++) {
+        if (cmd.compare(0, strlen(verbs[i]), verbs[i]) == 0) return true;
+    }
+    return false;
+    CRASH_REPORT_END;
+}
+
 /**
  * Function to cleanup a folder and all of it's sub-files
  */
@@ -262,6 +367,7 @@ void VBoxSession::UpdateSession() {
 
     // Store machine info
     machine->fromMap( &info, true );
+    watchLog();
 
     // If we got an error, the VM is missing
     if (info.find(":ERROR:") != info.end()) {
@@ -280,10 +386,10 @@ void VBoxSession::UpdateSession() {
 
     } else {
         // Route according to state
-        if (info.find("State") != info.end()) {
+        if (info.find("VMState") != info.end()) {
 
             // Switch according to state
-            string state = info["State"];
+            string state = info["VMState"];
             if (state.find("running") != string::npos) {
                 FSMSkew(7); // Running state
                 FSMDone("Session is running");
@@ -296,7 +402,7 @@ void VBoxSession::UpdateSession() {
             } else if (state.find("aborted") != string::npos) {
                 FSMSkew(4); // Aborted is also a 'powered-off' state
                 FSMDone("Session is aborted");
-            } else if (state.find("powered off") != string::npos) {
+            } else if (state.find("poweroff") != string::npos) {
                 FSMSkew(4); // Powered off state
                 FSMDone("Session is powered off");
             } else {
@@ -431,7 +537,7 @@ void VBoxSession::CreateVM() {
     // flag for each one of these.
     ostringstream oss;
     for (int i=0; i<4; i++) {
-        oss.str(""); oss << "Storage Controller Name (" << i << ")";
+        oss.str(""); oss << "storagecontrollername" << i;
         if (machine->contains(oss.str())) {
             string controllerName = machine->get(oss.str());
             if (controllerName.compare("IDE") == 0) {
@@ -501,6 +607,9 @@ void VBoxSession::CreateVM() {
     // The current (known) VM state is 'created'
     local->set("state", "0");
 
+    // We don't know which of the options were applied on this VM
+    local->erase(PLAN_APPLIED_KEY);
+
     FSMDone("Session initialized");
     CRASH_REPORT_END;
 }
@@ -514,10 +623,6 @@ void VBoxSession::ConfigureVM() {
     CRASH_REPORT_BEGIN;
     if (isAborting) return;
     FSMDoing("Configuring Virtual Machine");
-    ostringstream args;
-    vector<string> lines;
-    map<string, string> toks;
-    string uuid;
     int ans;
 
     // Extract flags
@@ -536,147 +641,79 @@ void VBoxSession::ConfigureVM() {
     string bootMedium = "dvd";
     if ((flags & HVF_DEPLOYMENT_HDD) != 0) bootMedium = "disk";
 
-    // Modify VM to match our needs
-    args.str("");
-    args << "modifyvm " << parameters->get("vboxid");
-
-    // Go through the machine configuration
+    // Go through the machine configuration and plan only the changes
     {
-        string vM, vC;
+        string vM;
 
         // 1) CPUS
-        vC = parameters->get("cpus", "2"); vM = machine->get("Number of CPUs", "");
-        if (vC != vM)
-            args << " --cpus "                  << vC;
+        configPlan.setVMOption( "cpus", parameters->get("cpus", "2"), machine->get("cpus", "") );
 
         // 2) Memory
-        vC = parameters->get("memory", "1024"); vM = machine->get("Memory size", "");
-        if (vM.find("MB") != string::npos) vM = vM.substr(0, vM.length()-2);
-        if (vC != vM)
-            args << " --memory "                << vC;
+        configPlan.setVMOption( "memory", parameters->get("memory", "1024"), machine->get("memory", "") );
 
-        /*
-        // 3) Execution cap
-        vC = parameters->get("executionCap", "80"); vM = machine->get("CPU exec cap", "");
-        if (vM.find("%") != string::npos) vM = vM.substr(0, vM.length()-1);
-        if (vC != vM)
-        */
         // 3) Always apply execution cap
-        args    << " --cpuexecutioncap "       << parameters->get("executionCap", "80");
+        configPlan.setVMOption( "cpuexecutioncap", parameters->get("executionCap", "80") );
 
         // 4) VRAM
-        vC = parameters->get("vram", "32"); vM = machine->get("VRAM size", "");
-        if (vM.find("MB") != string::npos) vM = vM.substr(0, vM.length()-2);
-        if (vC != vM)
-            args << " --vram "                  << vC;
+        configPlan.setVMOption( "vram", parameters->get("vram", "32"), machine->get("vram", "") );
 
         // 5) ACPI
-        vC = "on"; vM = machine->get("ACPI", "");
-        if (vC != vM)
-            args << " --acpi "                  << vC;
+        configPlan.setVMOption( "acpi", "on", machine->get("acpi", "") );
 
         // 5) IOAPIC
-        vC = "on"; vM = machine->get("IOAPIC", "");
-        if (vC != vM)
-            args << " --ioapic "                << vC;
+        configPlan.setVMOption( "ioapic", "on", machine->get("ioapic", "") );
 
         // 6) VRDE
-        vM = machine->get("VRDE", "");
-        if (vM.empty() || (vM == "disabled")) {
-            args << " --vrde "                   << "on"
-                 << " --vrdeaddress "            << "127.0.0.1"
-                 << " --vrdeauthtype "           << "null"
-                 << " --vrdemulticon "           << "on"
-                 << " --vrdeport "               << rdpPort;
-        } else {
-
-            std::vector< std::string > argList;
-            std::map< std::string, std::string > vrdeOptions;
-            explodeStr( vM.substr(8, vM.length()-9), ", ", &argList );
-            parseLines( &argList, &vrdeOptions, ":", " ", 0, 1 );
-
-            // Stringify rtpPort
-            vC = ntos<int>(rdpPort);
-            
-            // Check for misconfigured VRDE
-            vM = ""; if (vrdeOptions.find("Address")!=vrdeOptions.end()) vM=vrdeOptions["Address"];
-            if (vM != "127.0.0.1")
-                args << " --vrdeaddress "        << "127.0.0.1";
-            vM = ""; if (vrdeOptions.find("Authentication type")!=vrdeOptions.end()) vM=vrdeOptions["Authentication type"];
-            if (vM != "null")
-                args << " --vrdeauthtype "        << "null";
-            vM = ""; if (vrdeOptions.find("Ports")!=vrdeOptions.end()) vM=vrdeOptions["Ports"];
-            if (vM != vC)
-                args << " --vrdeport "            << rdpPort;
-            vM = ""; if (vrdeOptions.find("MultiConn")!=vrdeOptions.end()) vM=vrdeOptions["MultiConn"];
-            if (vM != "on")
-                args << " --vrdemulticon "        << "on";
-
-            // And of course, enable
-            args << " --vrde "                    << "on";
-
-        }
+        configPlan.setVMOption( "vrde", "on", machine->get("vrde", "") );
+        configPlan.setVMOption( "vrdeaddress", "127.0.0.1", machine->get("vrdeaddress", "") );
+        configPlan.setVMOption( "vrdeauthtype", "null", machine->get("vrdeauthtype", "") );
+        configPlan.setVMOption( "vrdemulticon", "on", machine->get("vrdemulticon", "") );
+        configPlan.setVMOption( "vrdeport", ntos<int>(rdpPort), machine->get("vrdeports", "") );
 
         // 7) Boot medium
-        vC = bootMedium; vM = machine->get("Boot Device (1)", "");
-        std::transform(vM.begin(), vM.end(), vM.begin(), ::tolower);
-        if (vC != vM)
-            args << " --boot1 "             << vC;
+        configPlan.setVMOption( "boot1", bootMedium, machine->get("boot1", "") );
 
         // 8) NIC 1
-        vM = machine->get("NIC 1", "");
-        if (vM.empty() || (vM == "disabled")) {
-            args << " --nic1 "              << "nat";
+        vM = machine->get("nic1", "");
+        if (vM.empty() || (vM == "none")) {
+            configPlan.setVMOption( "nic1", "nat" );
         }
 
         // 9) NAT DNS Host Resolver (bugfix for hibernate cases)
-        args << " --natdnshostresolver1 "    << "on";
+        configPlan.setBlindVMOption( "natdnshostresolver1", "on" );
 
         // 10) Enable graphical additions if instructed to do so
         if ((flags & HVF_GRAPHICAL) != 0) {
-            args << " --draganddrop "       << "hosttoguest"
-                 << " --clipboard "         << "bidirectional";
+            configPlan.setVMOption( "draganddrop", "hosttoguest", machine->get("draganddrop", "") );
+            configPlan.setVMOption( "clipboard", "bidirectional", machine->get("clipboard", "") );
         }
 
         // 11) Second nost-only NIC
         if ((flags & HVF_DUAL_NIC) != 0) {
-            vM = machine->get("NIC 2", "");
-            if (vM.empty() || (vM == "disabled")) {
-                args << " --nic2 "          << "hostonly" 
-                     << " --hostonlyadapter2 \"" << local->get("hostonlyif") << "\"";
+            vM = machine->get("nic2", "");
+            if (vM.empty() || (vM == "none")) {
+                configPlan.setVMOption( "nic2", "hostonly" );
+                configPlan.setVMOption( "hostonlyadapter2", local->get("hostonlyif") );
             }
         }
 
-    }
-
-    // Execute and handle errors
-    ans = this->wrapExec(args.str(), &lines, NULL, execConfig);
-    if (ans != 0) {
-        errorOccured("Unable to modify the Virtual Machine", HVE_EXTERNAL_ERROR);
-        return;
-    }
-
-    // We add the NIC rules in a separate step, because if the NIC was previously
-    // disabled, there was no way to know which rules there were applied 
-    if ((flags & HVF_DUAL_NIC) == 0) {
-        args.str("");
-        args << "modifyvm " 
-             << parameters->get("vboxid")
-             << " --natpf1 " << "guestapi,tcp,127.0.0.1," << local->get("apiPort") << ",," << parameters->get("apiPort");
-
-        // Use custom execConfig to ignore "already exists" errors
-        SysExecConfig localExecCfg( execConfig );
-        localExecCfg.handleErrString( "A NAT rule of this name already exists", 100 );
-
-        // Add NAT rule
-        ans = this->wrapExec(args.str(), &lines, NULL, localExecCfg);
-        if ((ans != 0) && (ans != 100)) {
-            errorOccured("Unable to modify the Virtual Machine", HVE_EXTERNAL_ERROR);
-            return;
+        // 12) The API port forwarding rule if we are not using a second NIC
+        if ((flags & HVF_DUAL_NIC) == 0) {
+            map<const string, const string> machineInfo;
+            machine->toMap( &machineInfo );
+            configPlan.setNATRule( 1, "guestapi", "tcp", "127.0.0.1", 
+                                   local->getNum<int>("apiPort", 0), parameters->getNum<int>("apiPort", 0),
+                                   machineInfo );
         }
 
     }
 
+    // Apply all the changes at once
+    ans = applyConfigPlan();
+    if (ans != HVE_OK) {
+        errorOccured("Unable to modify the Virtual Machine", ans);
+        return;
+    }
 
 //        << " --cpus "                   << parameters->get("cpus", "2")
 //        << " --memory "                 << parameters->get("memory", "1024")
@@ -849,9 +886,6 @@ void VBoxSession::DownloadMedia() {
                             downloadProvider
                         );
 
-            // Strip .gz from the filename
-            sFilename = sFilename.substr(0, sFilename.length() - 3 );
-
         } else {
             // Download boot disk
             ans = hypervisor->downloadFile(
@@ -871,6 +905,9 @@ void VBoxSession::DownloadMedia() {
             return;
         }
 
+        // Keep the image in the cache while the session uses it
+        hypervisor->imageCache->pin( sFilename, uuid );
+
         // Store boot iso image
         local->set("bootDisk", sFilename);
 
@@ -924,6 +961,9 @@ void VBoxSession::DownloadMedia() {
             return;
         }
 
+        // Keep the image in the cache while the session uses it
+        hypervisor->imageCache->pin( sFilename, uuid );
+
         // Store boot iso image
         local->set("bootISO", sFilename);
 
@@ -1073,7 +1113,8 @@ void VBoxSession::ConfigureVMScratch() {
     int ans;
 
     // Check if we have a scratch disk attached to the machine
-    if (!machine->contains(SCRATCH_DSK)) {
+    string scratchFile, scratchUUID;
+    if (!getMountedDisk( SCRATCH_CONTROLLER, SCRATCH_PORT, SCRATCH_DEVICE, &scratchFile, &scratchUUID )) {
 
         // Skip this if the scratch disk has size=0
         if (parameters->getNum<int>("disk") == 0) {
@@ -1118,9 +1159,12 @@ void VBoxSession::ConfigureVMScratch() {
             return;
         }
 
+        // The media registry has changed
+        boost::static_pointer_cast<VBoxInstance>(hypervisor)->invalidateDiskList();
+
         // Everything worked as expected.
         // Update disk file path in the scratch disk controller
-        machine->set(SCRATCH_DSK, vmDisk + " (UUID: " + diskGUID + ")");
+        setMountedDisk( SCRATCH_CONTROLLER, SCRATCH_PORT, SCRATCH_DEVICE, vmDisk, diskGUID );
 
         FSMDone("Scratch storage prepared");
     } else {
@@ -1240,13 +1284,6 @@ void VBoxSession::ConfigureVMAPI() {
     // ------------------------------------------------
     if ((flags & HVF_FLOPPY_IO) != 0) {
 
-        // Unmount/remove previous VMAPI floppy
-        ans = unmountDisk( FLOPPYIO_CONTROLLER, FLOPPYIO_PORT, FLOPPYIO_DEVICE, T_FLOPPY, true );
-        if (ans != HVE_OK) {
-            errorOccured("Unable detach previously attached context floppy", HVE_EXTERNAL_ERROR);
-            return;
-        }
-
         // Prepare and store the VMAPI data
         std::string data = getUserData();
         local->set("vmapi_contents", data);
@@ -1258,9 +1295,9 @@ void VBoxSession::ConfigureVMAPI() {
             return;
         }
 
-        // Mount the new floppy disk
+        // Mount the new floppy disk, replacing (and deleting) the previous one
         ans = mountDisk( FLOPPYIO_CONTROLLER, FLOPPYIO_PORT, FLOPPYIO_DEVICE, T_FLOPPY,
-                         sFilename, false );
+                         sFilename, false, true );
 
         // Check result
         if (ans == HVE_ALREADY_EXISTS) {
@@ -1280,13 +1317,6 @@ void VBoxSession::ConfigureVMAPI() {
     // ------------------------------------------------
     else {
 
-        // Unmount/remove previous VMAPI iso
-        ans = unmountDisk( CONTEXT_CONTROLLER, CONTEXT_PORT, CONTEXT_DEVICE, T_DVD, true );
-        if (ans != HVE_OK) {
-            errorOccured("Unable detach previously attached context iso", HVE_EXTERNAL_ERROR);
-            return;
-        }
-
         // Prepare and store the VMAPI data
         std::string data = getUserData();
         local->set("vmapi_contents", data);
@@ -1298,9 +1328,9 @@ void VBoxSession::ConfigureVMAPI() {
             return;
         }
 
-        // Mount the new iso disk
+        // Mount the new iso disk, replacing (and deleting) the previous one
         ans = mountDisk( CONTEXT_CONTROLLER, CONTEXT_PORT, CONTEXT_DEVICE, T_DVD,
-                         sFilename, false );
+                         sFilename, false, true );
 
         // Check result
         if (ans == HVE_ALREADY_EXISTS) {
@@ -1362,6 +1392,10 @@ void VBoxSession::PrepareVMBoot() {
     if (isAborting) return;
     FSMDoing("Preparing for VM Boot");
 
+    // Start a new configuration plan. The following configuration steps
+    // will diff against the cached machine info and apply only the changes.
+    configPlan.reset( parameters->get("vboxid"), local->get(PLAN_APPLIED_KEY, "") );
+
     FSMDone("VM prepared for boot");
     CRASH_REPORT_END;
 }
@@ -1384,6 +1418,9 @@ void VBoxSession::DestroyVM() {
         return;
     }
 
+    // The cached images can now be evicted
+    hypervisor->imageCache->unpin( uuid );
+
     FSMDone("VM Destroyed");
     CRASH_REPORT_END;
 }
@@ -1468,7 +1505,7 @@ void VBoxSession::StartVM() {
     }
 
     // Get PID from the log file
-    local->setNum<int>("pid", getPIDFromFile( machine->get("Log folder") ));
+    local->setNum<int>("pid", getPIDFromFile( machine->get("LogFldr") ));
 
     // We are done
     FSMDone("VM Started");
@@ -1572,10 +1609,51 @@ int VBoxSession::open ( ) {
 
     // Reset properties
     isAborting = false;    
+
+    // Pick up the changes to the session config done by other processes
+    LocalConfigPtr config = boost::dynamic_pointer_cast< LocalConfig >( parameters );
+    if (config) config->watch();
+
+    // Use the shared executor if the hypervisor has one
+    if (hypervisor) {
+        FSMExecutorPtr executor = hypervisor->getFSMExecutor();
+        if (executor) FSMUseExecutor( executor );
+    }
     
     // Start the FSM thread
     FSMThreadStart();
 
+    // Let the session monitor update us when the VM changes
+    SessionMonitor::Default()->monitor( shared_from_this() );
+    monitored = true;
+
+    // Keep the images of the VM in the cache while the session exists
+    // (including the ones from earlier versions, once they are indexed)
+    if (hypervisor) {
+        if (!local->get("bootDisk", "").empty()) hypervisor->imageCache->pin( local->get("bootDisk"), uuid );
+        if (!local->get("bootISO", "").empty()) hypervisor->imageCache->pin( local->get("bootISO"), uuid );
+    }
+
+    // If we were interrupted in the middle of a transition, resume from
+    // the last completed step instead of probing the VM again. If things
+    // have changed in the mean time, the actions will fail and go through
+    // the error state, which updates the session.
+    int jState = local->getNum<int>("fsmState", 0);
+    int jTarget = local->getNum<int>("fsmTarget", 0);
+    long jTime = local->getNum<long>("fsmTime", 0);
+    if ((jState != 0) && (jTarget != 0) && (jState != jTarget) && parameters->contains("vboxid") &&
+        (getMillis() - jTime < SESSION_JOURNAL_EXPIRE) && FSMRestore(jState)) {
+        CVMWA_LOG("Info", "Resuming from step " << jState << " towards " << jTarget);
+
+        // The configuration plan is started by PrepareVMBoot, which
+        // is skipped when we resume in the middle of the boot sequence
+        configPlan.reset( parameters->get("vboxid"), local->get(PLAN_APPLIED_KEY, "") );
+
+        watchLog();
+        FSMGoto(jTarget);
+        return HVE_SCHEDULED;
+    }
+
     // Goto SessionUpdate
     FSMGoto(101);
 
@@ -1877,34 +1955,43 @@ int VBoxSession::update ( bool waitTillInactive ) {
     FSMWaitInactive();
     if (isAborting) return HVE_INVALID_STATE;
 
+    // Updates might also be triggered from the FileWatch thread
+    watchLog();
+    boost::mutex::scoped_lock updateLock(updateMutex);
+
     // Get current state
     int lastState = local->getNum<int>("state", 0);
     int newState = lastState;
     
     // Check if log file is missing
-    std::string logFile = machine->get("Log folder") + kPathSeparator + "VBox.log";
+    std::string logFile = machine->get("LogFldr") + kPathSeparator + "VBox.log";
     if (file_exists(logFile)) {
 
-        // Look for changes in the timestamp
+        // Look for changes in the timestamp (or a notification
+        // from the FileWatch, which is more accurate). The notification
+        // is consumed before reading, so the ones arriving while we
+        // read are not lost.
+        bool notified = logChanged.exchange( false );
         unsigned long long newFileTime = getFileTimeMs(logFile);
-        if (lastLogTime != newFileTime) {
+        if (notified || (lastLogTime != newFileTime)) {
             lastLogTime = newFileTime;
     
-            // Create a log probe in order to extract as many information
-            // as possible from a single pass.
-            VBoxLogProbe logProbe( machine->get("Log folder") );
-            logProbe.analyze();
+            // Follow the log file with a persistent probe, so only the
+            // bytes appended since the last update are parsed.
+            if (!logProbe || (logProbe->logFile != machine->get("LogFldr") + "/VBox.log"))
+                logProbe = boost::make_shared< VBoxLogProbe >( machine->get("LogFldr") );
+            logProbe->analyze();
 
             // Check if we had a state change
-            if (logProbe.hasState)
-                newState = logProbe.state;
+            if (logProbe->hasState)
+                newState = logProbe->state;
 
             // Check if we had a resolution change
-            if (logProbe.hasResolutionChange) {
+            if (logProbe->hasResolutionChange) {
                 ostringstream oss;
-                oss << logProbe.resWidth << "x" 
-                    << logProbe.resHeight << "x" 
-                    << logProbe.resBpp;
+                oss << logProbe->resWidth << "x" 
+                    << logProbe->resHeight << "x" 
+                    << logProbe->resBpp;
 
                 // Check if video mode has changed
                 std::string vC = machine->get("Video mode", ""),
@@ -1915,16 +2002,16 @@ int VBoxSession::update ( bool waitTillInactive ) {
                     // Update video mde
                     machine->set("Video mode", vM);
                     // Notify listeners that resolution has changed
-                    this->fire( "resolutionChanged", ArgumentList(logProbe.resWidth)(logProbe.resHeight)(logProbe.resBpp) );
+                    this->fire( "resolutionChanged", ArgumentList(logProbe->resWidth)(logProbe->resHeight)(logProbe->resBpp) );
                 }
 
             }
 
             // Check if failures appeared
-            if (logProbe.hasFailures) {
+            if (logProbe->hasFailures) {
 
                 // Forward failures
-                this->fire( "failure", ArgumentList(logProbe.failures) );
+                this->fire( "failure", ArgumentList(logProbe->failures) );
 
             }
 
@@ -1939,27 +2026,97 @@ int VBoxSession::update ( bool waitTillInactive ) {
     if (isAborting) return HVE_INVALID_STATE;
     if (newState != lastState) {
         CVMWA_LOG("Debug", "Update state switch from " << lastState << " to " << newState);
+        switchState( newState );
+    }
 
-        // Handle state switches
-        if (newState == SS_MISSING) {
-            FSMSkew( 3 ); // Goto 'Destroyed'
-        } else if (newState == SS_POWEROFF) {
-            FSMSkew( 4 ); // Goto 'Power Off'
-        } else if (newState == SS_SAVED) {
-            FSMSkew( 5 ); // Goto 'Saved'
-        } else if (newState == SS_PAUSED) {
-            FSMSkew( 6 ); // Goto 'Paused'
-        } else if (newState == SS_RUNNING) {
-            FSMSkew( 7 ); // Goto 'Running'
-        }
+    // It was OK
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Start watching the VirtualBox log file of the VM, if it's known
+ */
+void VBoxSession::watchLog ( ) {
+    CRASH_REPORT_BEGIN;
+    if (isAborting) return;
 
-        // The FSM will automatically go to HandleError & CureError if something
-        // has gone really wrong.
+    // Check if the log file has moved
+    std::string logFolder = machine->get("LogFldr", "");
+    if (logFolder.empty()) return;
+    std::string logFile = logFolder + kPathSeparator + "VBox.log";
 
+    // Replace the previous watch. The old one is removed after releasing
+    // logWatchMutex, since unwatch() waits for the running callbacks.
+    int oldWatchID = 0;
+    {
+        boost::mutex::scoped_lock lock(logWatchMutex);
+        if ((logWatchID > 0) && (logWatchFile == logFile)) return;
+        oldWatchID = logWatchID;
+        logWatchFile = logFile;
+        logWatchID = FileWatch::Default()->watch( logFile, boost::bind( &VBoxSession::logFileChanged, this, _1 ) );
     }
+    if (oldWatchID > 0) FileWatch::Default()->unwatch( oldWatchID );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Stop watching the VirtualBox log file
+ */
+void VBoxSession::unwatchLog ( ) {
+    CRASH_REPORT_BEGIN;
+
+    // Release the lock before unwatch(), since it waits for the running callbacks
+    int oldWatchID = 0;
+    {
+        boost::mutex::scoped_lock lock(logWatchMutex);
+        oldWatchID = logWatchID;
+        logWatchID = 0;
+        logWatchFile = "";
+    }
+    if (oldWatchID > 0) FileWatch::Default()->unwatch( oldWatchID );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Notification from the FileWatch that the VirtualBox log has changed
+ */
+void VBoxSession::logFileChanged ( const std::string& /* file */ ) {
+    CRASH_REPORT_BEGIN;
+    if (isAborting) return;
+    logChanged = true;
+
+    // Let the session monitor update us, in order not to
+    // block the FileWatch thread
+    SessionMonitor::Default()->notify( this );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Skew the FSM to the checkpoint state that corresponds
+ * to the specified session state.
+ */
+void VBoxSession::switchState( int newState ) {
+    CRASH_REPORT_BEGIN;
+
+    // Handle state switches
+    if (newState == SS_MISSING) {
+        FSMSkew( 3 ); // Goto 'Destroyed'
+    } else if (newState == SS_POWEROFF) {
+        FSMSkew( 4 ); // Goto 'Power Off'
+    } else if (newState == SS_SAVED) {
+        FSMSkew( 5 ); // Goto 'Saved'
+    } else if (newState == SS_PAUSED) {
+        FSMSkew( 6 ); // Goto 'Paused'
+    } else if (newState == SS_RUNNING) {
+        FSMSkew( 7 ); // Goto 'Running'
+    }
+
+    // The FSM will automatically go to HandleError & CureError if something
+    // has gone really wrong.
 
-    // It was OK
-    return HVE_OK;
     CRASH_REPORT_END;
 }
 
@@ -1973,6 +2130,19 @@ void VBoxSession::abort ( ) {
     // We are aborting
     isAborting = true;
 
+    // Cancel the system commands of this session only,
+    // even if the FSM thread is not running
+    fsmExecToken->cancel();
+
+    // Stop watching files
+    unwatchLog();
+    LocalConfigPtr config = boost::dynamic_pointer_cast< LocalConfig >( parameters );
+    if (config) config->unwatch();
+    if (monitored) {
+        SessionMonitor::Default()->unmonitor( this );
+        monitored = false;
+    }
+
     // Stop the FSM thread
     // (This will send an interrupt signal,
     // causing all intermediate code to except)
@@ -2013,6 +2183,28 @@ void VBoxSession::hvNotifyDestroyed () {
     CRASH_REPORT_END;
 }
 
+/**
+ * Notification from the VBoxInstance with the state of the VM, as
+ * found during a bulk refresh of all the sessions.
+ */
+void VBoxSession::hvNotifyState ( int newState ) {
+    CRASH_REPORT_BEGIN;
+    if (isAborting) return;
+
+    // Don't interfere with a transition in progress. The
+    // hypervisor state might be an intermediate one.
+    if (FSMActive()) return;
+
+    // Check if we had a state change
+    int lastState = local->getNum<int>("state", 0);
+    if (newState != lastState) {
+        CVMWA_LOG("Debug", "Refresh state switch from " << lastState << " to " << newState);
+        switchState( newState );
+    }
+
+    CRASH_REPORT_END;
+}
+
 /**
  * Notification from the VBoxInstance that we are going
  * for a forceful shutdown. We should cleanup everything
@@ -2067,6 +2259,60 @@ void VBoxSession::FSMEnteringState( const int state, const bool final ) {
 }
 
 
+/**
+ * Notification from the SimpleFSM instance when a step is completed
+ */
+void VBoxSession::FSMStepCompleted( const int state, const int target ) {
+    CRASH_REPORT_BEGIN;
+    if (isAborting) return;
+
+    // Run the updates that were deferred while we were busy. The FSM might
+    // stop before the target (ex. in the error handling), so don't wait for it.
+    if (!FSMActive())
+        SessionMonitor::Default()->notifyIdle( this );
+
+    // Forget the journal when the target is reached. Also don't resume
+    // in the error handling, since the session must be updated.
+    if ((state == target) || (state == 2) || (state == 102) || (state == 103) || (state == 112)) {
+        if (local->contains("fsmState")) {
+            local->lock();
+            local->erase("fsmState");
+            local->erase("fsmTarget");
+            local->erase("fsmTime");
+            local->unlock();
+        }
+        return;
+    }
+
+    // Journal the step
+    local->lock();
+    local->setNum<int>("fsmState", state);
+    local->setNum<int>("fsmTarget", target);
+    local->setNum<long>("fsmTime", getMillis());
+    local->unlock();
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Notification from the SimpleFSM instance when an action missed its deadline
+ */
+void VBoxSession::FSMHandlerTimeout( const int state, const bool redirected ) {
+    CRASH_REPORT_BEGIN;
+
+    // Nothing to do if we are aborting
+    if (isAborting) return;
+
+    // Go through the error state, unless the action did it already
+    if (!redirected) {
+        ostringstream oss;
+        oss << "The action " << state << " took too long to complete";
+        errorOccured( oss.str(), HVE_STILL_WORKING );
+    }
+
+    CRASH_REPORT_END;
+}
+
 /////////////////////////////////////
 /////////////////////////////////////
 ////
@@ -2083,9 +2329,62 @@ int VBoxSession::wrapExec ( std::string cmd, std::vector<std::string> * stdoutLi
     CRASH_REPORT_BEGIN;
     if (isAborting) return HVE_INVALID_STATE;
 
+    // Scope the cancellation of the command to this session
+    SysExecConfig sessionConfig( config );
+    if (!sessionConfig.token) sessionConfig.setToken( FSMExecToken() );
+
+    // Account it to the running FSM handler
+    FSMCountExec();
+
     // Allow only a single thread to invoke a system command
     boost::unique_lock<boost::mutex> lock(execMutex);
-    return this->hypervisor->exec(cmd, stdoutList, stderrMsg, config );
+    int ans = this->hypervisor->exec(cmd, stdoutList, stderrMsg, sessionConfig );
+
+    // Drop the cached machine info if the command has modified the VM
+    if (__vbox_isMutating(cmd))
+        boost::static_pointer_cast<VBoxInstance>(hypervisor)->invalidateMachineInfo( parameters->get("vboxid") );
+
+    return ans;
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Apply the pending modifyvm options of the configuration plan
+ */
+int VBoxSession::applyConfigPlan ( ) {
+    CRASH_REPORT_BEGIN;
+    if (isAborting) return HVE_INVALID_STATE;
+    int ans;
+
+    // Nothing to do?
+    if (configPlan.empty()) {
+        CVMWA_LOG("Debug", "VM configuration is up to date");
+        return HVE_OK;
+    }
+
+    // Use custom execConfig to detect "already exists" NAT rule errors
+    SysExecConfig localExecCfg( execConfig );
+    localExecCfg.handleErrString( "A NAT rule of this name already exists", 100 );
+
+    // Apply everything with a single modifyvm
+    ans = this->wrapExec(configPlan.getModifyVMCommand(), NULL, NULL, localExecCfg);
+    if (ans == 100) {
+
+        // We could not detect the existing NAT rule, so VirtualBox rejected the
+        // entire command. Apply the rest of the options without the NAT rules.
+        if (!configPlan.empty(false)) {
+            ans = this->wrapExec(configPlan.getModifyVMCommand(false), NULL, NULL, execConfig);
+        } else {
+            ans = 0;
+        }
+
+    }
+    if (ans != 0) return HVE_EXTERNAL_ERROR;
+
+    // Keep track of the options applied
+    local->set( PLAN_APPLIED_KEY, configPlan.commit() );
+    return HVE_OK;
 
     CRASH_REPORT_END;
 }
@@ -2115,12 +2414,16 @@ int VBoxSession::destroyVM ( const bool forwardErrors ) {
         return HVE_EXTERNAL_ERROR;
     }
 
+    // Our disks were removed from the media registry
+    boost::static_pointer_cast<VBoxInstance>(hypervisor)->invalidateDiskList();
+
     // Cleanup folder
     cleanupFolder( local->get("baseFolder") );
 
     // Reset properties
     local->set("initialized","0");
     local->erase("vboxid");
+    local->erase(PLAN_APPLIED_KEY);
     machine->clear();
 
     return HVE_OK;
@@ -2184,6 +2487,95 @@ std::string VBoxSession::getUserData ( ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Get the medium mounted on the specified slot, as found in the machine info
+ */
+bool VBoxSession::getMountedDisk ( const std::string & controller, 
+                                   const std::string & port, 
+                                   const std::string & device, 
+                                   std::string * file, 
+                                   std::string * uuid ) {
+    CRASH_REPORT_BEGIN;
+
+    // The slots are listed like: "IDE-0-0"="image.vmdk" and "IDE-ImageUUID-0-0"="..."
+    string slotFile = machine->get( controller + "-" + port + "-" + device, "" );
+    if (slotFile.empty() || (slotFile == "none") || (slotFile == "emptydrive"))
+        return false;
+
+    *file = slotFile;
+    *uuid = machine->get( controller + "-ImageUUID-" + port + "-" + device, "" );
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Update the medium mounted on the specified slot in the machine info
+ */
+void VBoxSession::setMountedDisk ( const std::string & controller, 
+                                   const std::string & port, 
+                                   const std::string & device, 
+                                   const std::string & file, 
+                                   const std::string & uuid ) {
+    CRASH_REPORT_BEGIN;
+    if (file.empty()) {
+        machine->erase( controller + "-" + port + "-" + device );
+        machine->erase( controller + "-ImageUUID-" + port + "-" + device );
+    } else {
+        machine->set( controller + "-" + port + "-" + device, file );
+        machine->set( controller + "-ImageUUID-" + port + "-" + device, uuid );
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Close and delete a medium
+ */
+int VBoxSession::closeMedium ( const VBoxDiskType & dtype, 
+                               const std::string & file, 
+                               const std::string & uuid ) {
+    CRASH_REPORT_BEGIN;
+    if (isAborting) return HVE_INVALID_STATE;
+    ostringstream args;
+    int ans;
+
+    // String-ify the disk type
+    std::string type;
+    if (dtype == T_HDD) type="disk";
+    else if (dtype == T_DVD) type="dvd";
+    else if (dtype == T_FLOPPY) type="floppy";
+
+    // Close and unregister medium
+    args.str("");
+    args << "closemedium " << type << " "
+        << "\"" << file << "\" --delete";
+
+    // Execute and handle errors
+    ans = this->wrapExec(args.str(), NULL, NULL, execConfig);
+    if (ans != HVE_OK) {
+
+        // Close and unregister medium, trying again with UUID
+        args.str("");
+        args << "closemedium " << type << " "
+            << "\"" << uuid << "\" --delete";
+
+        // Execute and handle errors
+        ans = this->wrapExec(args.str(), NULL, NULL, execConfig);
+        if (ans != HVE_OK) {
+
+            // Try manual removal
+            ::remove( file.c_str() );
+
+        }
+
+    }
+
+    // The media registry has changed
+    boost::static_pointer_cast<VBoxInstance>(hypervisor)->invalidateDiskList();
+    return ans;
+
+    CRASH_REPORT_END;
+}
+
 /**
  * Unmount a medium from the VirtulaBox Instance
  */
@@ -2198,17 +2590,8 @@ int VBoxSession::unmountDisk ( const std::string & controller,
     string kk, kv;
     int ans;
 
-    // Calculate the name of the disk slot
-    std::string DISK_SLOT = controller + " (" + port + ", " + device + ")";
-
-    // String-ify the disk type
-    std::string type;
-    if (dtype == T_HDD) type="disk";
-    else if (dtype == T_DVD) type="dvd";
-    else if (dtype == T_FLOPPY) type="floppy";
-
     // Unmount disk only if it's already mounted
-    if (machine->contains( DISK_SLOT, true )) {
+    if (getMountedDisk( controller, port, device, &kk, &kv )) {
 
         // Otherwise unmount the existing disk
         args.str("");
@@ -2226,43 +2609,13 @@ int VBoxSession::unmountDisk ( const std::string & controller,
         // If we are also asked to erase the file, do it now
         if (deleteFile) {
 
-            // Split on '('
-            // (Line contents is something like "IDE (1, 0): image.vmdk (UUID: ...)")
-            getKV( machine->get(DISK_SLOT), &kk, &kv, '(', 0 );
-            kk = kk.substr(0, kk.length()-1);
-
             // Close and unregister medium
-            args.str("");
-            args << "closemedium " << type << " "
-                << "\"" << kk << "\" --delete";
-
-            // Execute and handle errors
-            ans = this->wrapExec(args.str(), NULL, NULL, execConfig);
-            if (ans != HVE_OK) {
-
-                // Try again with UUID
-                kv = kv.substr(6, kv.length()-7);
-
-                // Close and unregister medium
-                args.str("");
-                args << "closemedium " << type << " "
-                    << "\"" << kv << "\" --delete";
-
-                // Execute and handle errors
-                ans = this->wrapExec(args.str(), NULL, NULL, execConfig);
-                if (ans != HVE_OK) {
-
-                    // Try manual removal
-                    ::remove( kk.c_str() );
-
-                }
-
-            }
+            closeMedium( dtype, kk, kv );
 
         }
 
         // Remove file from the mounted devices list
-        machine->erase( DISK_SLOT );
+        setMountedDisk( controller, port, device, "", "" );
 
     }
 
@@ -2273,7 +2626,7 @@ int VBoxSession::unmountDisk ( const std::string & controller,
 
 /**
  * (Re-)Mount a disk on the specified controller
- * This function automatically unmounts a previously attached disk if the filenames
+ * This function automatically replaces a previously attached disk if the filenames
  * do not match.
  */
 int VBoxSession::mountDisk ( const std::string & controller, 
@@ -2281,7 +2634,8 @@ int VBoxSession::mountDisk ( const std::string & controller,
                              const std::string & device, 
                              const VBoxDiskType & dtype,
                              const std::string & diskFile, 
-                             bool multiAttach ) {
+                             bool multiAttach,
+                             bool deleteReplaced ) {
     CRASH_REPORT_BEGIN;
     if (isAborting) return HVE_INVALID_STATE;
 
@@ -2295,143 +2649,125 @@ int VBoxSession::mountDisk ( const std::string & controller,
         multiAttach = false;
     }
 
+    // The replaced disks of multi-attach mode are differencing images, which are deleted
+    if (multiAttach) {
+        deleteReplaced = true;
+    }
+
     // String-ify the disk type
     std::string type;
     if (dtype == T_HDD) type="hdd";
     else if (dtype == T_DVD) type="dvddrive";
     else if (dtype == T_FLOPPY) type="fdd";
 
-    // Calculate the name of the disk slot
-    std::string DISK_SLOT = controller + " (" + port + ", " + device + ")";
+    // If we are doing multi-attach, find the UUID of the master disk in the media registry
+    VBoxInstancePtr vbox = boost::static_pointer_cast<VBoxInstance>(hypervisor);
+    string masterDiskUUID = "";
+    if (multiAttach) {
+        masterDiskUUID = vbox->findMultiAttachMaster( diskFile );
+        if (!masterDiskUUID.empty()) {
+            CVMWA_LOG("Info", "Found master with UUID " << masterDiskUUID);
+        }
+    }
 
-    // (A) Unmount previously mounted disk if it's not what we want
-    if (machine->contains( DISK_SLOT )) {
-        
-        // Split on '('
-        // (Line contents is something like "IDE (1, 0): image.vmdk (UUID: ...)")
-        getKV( machine->get(DISK_SLOT), &kk, &kv, '(', 0 );
-        kk = kk.substr(0, kk.length()-1); // Disk path on kk
-        kv = kv.substr(6, kv.length()-7); // UUID on kv
+    // (A) Check if the previously mounted disk is what we want
+    string replacedFile = "", replacedUUID = "";
+    if (getMountedDisk( controller, port, device, &kk, &kv )) {
 
+        // Disk path on kk, UUID on kv
         if (kk.compare( diskFile ) == 0) {
 
             // If the file is the one we want, we are done            
             return HVE_ALREADY_EXISTS;
 
-        } else {
-
-            // If we are using multiAttach, we have to investigate a bit more
-            if (multiAttach) {
-                string parentUUID = "_child_", actualParentUUID = "_parent_";
+        }
 
-                // Get more information for this disk
-                map<const string, const string> infoParent = this->getDiskInfo(kv);
-                if (infoParent.find("Parent UUID") != infoParent.end())
-                    parentUUID = infoParent["Parent UUID"];
+        // If we are using multiAttach, check if the mounted disk is a child of what we want
+        if (multiAttach) {
+            string parentUUID = "_child_", actualParentUUID = "_parent_";
 
-                // Get more information regarding the parent disk
-                map<const string, const string> infoDisk = this->getDiskInfo(diskFile);
-                if (infoDisk.find("UUID") != infoDisk.end())
-                    actualParentUUID = infoDisk["UUID"];
+            // Get the parent of the mounted disk
+            map<const string, const string> infoDisk = vbox->findDiskByUUID( kv );
+            if (infoDisk.find("Parent UUID") != infoDisk.end())
+                parentUUID = infoDisk["Parent UUID"];
 
-                // If these two UUID matches, we are done
-                if (parentUUID.compare( actualParentUUID ) == 0) {
-                    return HVE_ALREADY_EXISTS;
-                }
+            // Get the UUID of the disk we want
+            map<const string, const string> infoParent = vbox->findDiskByLocation( diskFile );
+            if (infoParent.find("UUID") != infoParent.end())
+                actualParentUUID = infoParent["UUID"];
 
+            // If these two UUID matches, we are done
+            if (parentUUID.compare( actualParentUUID ) == 0) {
+                return HVE_ALREADY_EXISTS;
             }
 
-            // Otherwise unmount the existing disk
-            ans = unmountDisk( controller, port, device, dtype, multiAttach );
-            if (ans != HVE_OK) return HVE_DELETE_ERROR;
-
         }
 
-    }
+        // Otherwise the medium is replaced by the storageattach below
+        replacedFile = kk;
+        replacedUUID = kv;
 
-    // Prepare two locations where we can find the disk: By filename and by UUID.
-    // That's because before some version VirtualBox we need the disk UUID, while for others we need the full path
-    string masterDiskPath = "\"" + diskFile + "\"";
-    string masterDiskUUID = "";
-    
-    // If we are doing multi-attach, try to use UUID-based mounting
-    if (multiAttach) {
-        // Get a list of the disks in order to properly compute multi-attach 
-        vector< map< const string, const string > > disks = boost::static_pointer_cast<VBoxInstance>(hypervisor)->getDiskList();
-        for (vector< map<const string, const string> >::iterator i = disks.begin(); i != disks.end(); i++) {
-            map<const string, const string> disk = *i;
-            // Look of the master disk of what we are using
-            if ( (disk.find("Type") != disk.end()) && (disk.find("Parent UUID") != disk.end()) && (disk.find("Location") != disk.end()) && (disk.find("UUID") != disk.end()) ) {
-                // Check if all the component maches
-                if ( (disk["Type"].compare("multiattach") == 0) && (disk["Parent UUID"].compare("base") == 0) && samePath(disk["Location"],diskFile) ) {
-                    // Use the master UUID instead of the filename
-                    CVMWA_LOG("Info", "Found master with UUID " << disk["UUID"]);
-                    masterDiskUUID = disk["UUID"]; //{" + disk["UUID"] + "}";
-                    break;
-                }
-            }
-        }
     }
 
     // Generate a new uuid
     std::string diskGUID = newGUID();
+    if (dtype == T_DVD) diskGUID = "<irrelevant>";
 
-    // (B.1) Try to attach disk to the SATA controller using full path
-    args.str("");
-    args << "storageattach "
-        << parameters->get("vboxid")
-        << " --storagectl " << controller
-        << " --port "       << port
-        << " --device "     << device
-        << " --type "       << type
-        << " --medium "     <<  masterDiskPath;
-
-    // If we are having a disk
-    if (dtype != T_DVD) {
-        args << " --setuuid " << diskGUID;
-    } else {
-        diskGUID = "<irrelevant>";
-    }
-
-    // Append multiattach flag if we are instructed to do so
-    if (multiAttach)
-        args << " --mtype " << "multiattach";
-
-    // Execute
-    std::string errStr;
-    ans = this->wrapExec(args.str(), &lines, &errStr, execConfig);
-
-    // If we are using multi-attach, try to mount by UUID if mounting
-    // by filename has failed
-    if (multiAttach && !masterDiskUUID.empty()) {
-
-        // If it was OK, just return
-        if (ans == 0) {
-            // Update mounted medium info
-            machine->set( DISK_SLOT, diskFile + " (UUID: " + diskGUID + ")" );
-            return HVE_OK;
+    // Prepare two locations where we can find the disk: By filename and by UUID.
+    // That's because before some version VirtualBox we need the disk UUID, while for others we need the full path
+    vector<string> mediums;
+    mediums.push_back( "\"" + diskFile + "\"" );
+    if (multiAttach && !masterDiskUUID.empty())
+        mediums.push_back( masterDiskUUID );
+
+    // (B) Try to attach the disk using all the locations. If there is
+    //     already a disk on the slot, VirtualBox replaces it.
+    ans = HVE_EXTERNAL_ERROR;
+    for (int retry=0; (retry<2) && (ans != HVE_OK); retry++) {
+        for (vector<string>::iterator it = mediums.begin(); it != mediums.end(); ++it) {
+            args.str("");
+            args << "storageattach "
+                << parameters->get("vboxid")
+                << " --storagectl " << controller
+                << " --port "       << port
+                << " --device "     << device
+                << " --type "       << type
+                << " --medium "     << *it;
+
+            // If we are having a disk
+            if (dtype != T_DVD)
+                args << " --setuuid " << diskGUID;
+
+            // Append multiattach flag if we are instructed to do so
+            if (multiAttach)
+                args << " --mtype " << "multiattach";
+
+            // Execute
+            ans = this->wrapExec(args.str(), &lines, NULL, execConfig);
+            if (ans == HVE_OK) break;
         }
-        
-        // (B.2) Try to attach disk to the SATA controller using UUID (For older VirtualBox versions)
-        args.str("");
-        args << "storageattach "
-            << parameters->get("vboxid")
-            << " --storagectl " << controller
-            << " --port "       << port
-            << " --device "     << device
-            << " --type "       << type
-            << " --mtype "      << "multiattach"
-            << " --setuuid "    << diskGUID
-            << " --medium "     <<  masterDiskUUID;
-
-        // Execute
-        ans = this->wrapExec(args.str(), &lines, NULL, execConfig);
 
+        // If the in-place replacement failed, try again after explicitly
+        // unmounting the previous disk (older VirtualBox versions)
+        if ((ans != HVE_OK) && (retry == 0) && !replacedFile.empty()) {
+            ans = unmountDisk( controller, port, device, dtype, deleteReplaced );
+            if (ans != HVE_OK) return HVE_DELETE_ERROR;
+            replacedFile = "";
+            ans = HVE_EXTERNAL_ERROR;
+        } else {
+            break;
+        }
     }
 
     // Update mounted medium info if it was OK
     if (ans == HVE_OK) {
-        machine->set( DISK_SLOT, diskFile + " (UUID: " + diskGUID + ")" );
+        setMountedDisk( controller, port, device, diskFile, diskGUID );
+        vbox->invalidateDiskList();
+
+        // Remove the disk we replaced
+        if (!replacedFile.empty() && deleteReplaced)
+            closeMedium( dtype, replacedFile, replacedUUID );
+
     }
 
     // Retun last execution result
@@ -2453,8 +2789,8 @@ std::string VBoxSession::getDataFolder ( ) {
         return this->dataPath;
 
     // Find configuration folder
-    if (machine->contains("Config file")) {
-        string settingsFolder = machine->get("Config file");
+    if (machine->contains("CfgFile")) {
+        string settingsFolder = machine->get("CfgFile");
 
         // Strip quotation marks
         if ((settingsFolder[0] == '"') || (settingsFolder[0] == '\''))
@@ -2690,6 +3026,12 @@ std::map<const std::string, const std::string> VBoxSession::getDiskInfo( const s
 
     if (isAborting) return info;
 
+    // Lookup the disk in the cached media registry
+    VBoxInstancePtr vbox = boost::static_pointer_cast<VBoxInstance>(hypervisor);
+    info = vbox->findDiskByUUID( disk );
+    if (info.empty()) info = vbox->findDiskByLocation( disk );
+    if (!info.empty()) return info;
+
     // Get more information for this disk
     args << "showhdinfo \"" << disk << "\"";
     ans = this->wrapExec(args.str(), &lines, NULL, execConfig);
@@ -2709,37 +3051,19 @@ std::map<const std::string, const std::string> VBoxSession::getDiskInfo( const s
 std::map<const std::string, const std::string> VBoxSession::getMachineInfo ( const std::string& machineName, int retries, int timeout ) {
     CRASH_REPORT_BEGIN;
     map<const string, const string> dat;
-    vector<string> lines;
     string vbox_id = this->parameters->get("vboxid");
     if (!machineName.empty()) vbox_id = machineName;
 
     if (isAborting) return dat;
 
-    // Check cached response
-    long ms = getMillis();
-    if ((ms < lastMachineInfoTimestamp + 500) && !lastMachineInfo.empty()) {
-        return lastMachineInfo;
-    }
-
-    // Local SysExecConfig
+    // Local SysExecConfig, scoped to this session
     SysExecConfig config(execConfig);
     config.retries = retries;
     config.timeout = timeout;
+    config.setToken( FSMExecToken() );
     
-    /* Perform property update */
-    int ans = this->wrapExec("showvminfo "+this->parameters->get("vboxid"), &lines, NULL, config);
-    if (ans != 0) {
-        dat.insert(std::make_pair(":ERROR:", ntos<int>( ans )));
-        return dat;
-    }
-    
-    /* Tokenize response */
-    map<const string, const string> machineInfo = tokenize( &lines, ':' );
-    lastMachineInfo.clear();
-    lastMachineInfo.insert( machineInfo.begin(), machineInfo.end() );
-    lastMachineInfoTimestamp = ms;
-    
-    return lastMachineInfo;
+    // Use the machine info cache of the hypervisor
+    return boost::static_pointer_cast<VBoxInstance>(hypervisor)->getMachineInfo( vbox_id, config );
 
     CRASH_REPORT_END;
 }
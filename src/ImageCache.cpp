@@ -0,0 +1,513 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/ImageCache.h>
+#include <CernVM/Hypervisor.h>
+
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+
+#ifndef _WIN32
+#include <sys/file.h>
+#endif
+
+using namespace std;
+
+/**
+ * An exclusive lock on the index of the cache, shared with the other
+ * processes, held for as long as the object exists.
+ */
+class ImageCacheLock {
+public:
+    ImageCacheLock( const std::string& file );
+    ~ImageCacheLock();
+private:
+#ifdef _WIN32
+    HANDLE                      hFile;
+#else
+    int                         fd;
+#endif
+};
+
+/**
+ * Open the lock file and wait until we get the lock
+ */
+ImageCacheLock::ImageCacheLock( const std::string& file ) {
+    CRASH_REPORT_BEGIN;
+#ifdef _WIN32
+    hFile = CreateFileA( file.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+    if (hFile != INVALID_HANDLE_VALUE) {
+        OVERLAPPED ov;
+        memset( &ov, 0, sizeof(ov) );
+        if (!LockFileEx( hFile, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &ov )) {
+            CloseHandle( hFile );
+            hFile = INVALID_HANDLE_VALUE;
+        }
+    }
+    if (hFile == INVALID_HANDLE_VALUE) {
+#else
+    fd = ::open( file.c_str(), O_RDWR | O_CREAT, 0644 );
+    if (fd >= 0) {
+        int ret;
+        while (((ret = ::flock( fd, LOCK_EX )) != 0) && (errno == EINTR)) ;
+        if (ret != 0) {
+            ::close( fd );
+            fd = -1;
+        }
+    }
+    if (fd < 0) {
+#endif
+        CVMWA_LOG("Warning", "Unable to lock the image cache index " << file);
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Release the lock
+ */
+ImageCacheLock::~ImageCacheLock() {
+#ifdef _WIN32
+    if (hFile != INVALID_HANDLE_VALUE) {
+        OVERLAPPED ov;
+        memset( &ov, 0, sizeof(ov) );
+        UnlockFileEx( hFile, 0, 1, 0, &ov );
+        CloseHandle( hFile );
+    }
+#else
+    if (fd >= 0) {
+        ::flock( fd, LOCK_UN );
+        ::close( fd );
+    }
+#endif
+}
+
+/**
+ * Create the cache
+ */
+ImageCache::ImageCache( const std::string& dir, long long quota ) : dir(dir), quota(quota), entries(), cacheMutex() {
+}
+
+/**
+ * Load the index of the cache, dropping the images that have gone away
+ */
+void ImageCache::load() {
+    CRASH_REPORT_BEGIN;
+    entries.clear();
+    std::string sIndexFile = dir + "/" IMAGECACHE_INDEX;
+    std::ifstream fIndex( sIndexFile.c_str() );
+    std::string line, kind, checksum;
+    while (std::getline( fIndex, line )) {
+        std::istringstream ss( line );
+        if (!(ss >> kind >> checksum)) continue;
+
+        if (kind == "image") {
+            Entry e;
+            if (!(ss >> e.size >> e.lastUse)) continue;
+            ss >> std::ws;
+            std::getline( ss, e.file );
+            if (e.file.empty()) continue;
+            entries[checksum] = e;
+        } else {
+            // The aliases and pins follow their image
+            std::map< std::string, Entry >::iterator it = entries.find( checksum );
+            if (it == entries.end()) continue;
+            std::string value;
+            ss >> std::ws;
+            std::getline( ss, value );
+            if (value.empty()) continue;
+            if (kind == "alias") (*it).second.urls.insert( value );
+            if (kind == "pin") (*it).second.pins.insert( value );
+        }
+    }
+    fIndex.close();
+
+    // Forget the images that were removed from the disk
+    for (std::map< std::string, Entry >::iterator it = entries.begin(); it != entries.end(); ) {
+        if (!file_exists( dir + "/" + (*it).second.file )) {
+            entries.erase( it++ );
+        } else {
+            ++it;
+        }
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Save the index of the cache
+ */
+bool ImageCache::save() {
+    CRASH_REPORT_BEGIN;
+    std::string sIndexFile = dir + "/" IMAGECACHE_INDEX;
+    std::string sTempFile = sIndexFile + ".tmp";
+
+    // Write a new index and replace the old one with it
+    std::ofstream fIndex( sTempFile.c_str(), std::ofstream::binary | std::ofstream::trunc );
+    for (std::map< std::string, Entry >::iterator it = entries.begin(); it != entries.end(); ++it) {
+        Entry& e = (*it).second;
+        fIndex << "image " << (*it).first << " " << e.size << " " << e.lastUse << " " << e.file << std::endl;
+        for (std::set< std::string >::iterator jt = e.urls.begin(); jt != e.urls.end(); ++jt)
+            fIndex << "alias " << (*it).first << " " << *jt << std::endl;
+        for (std::set< std::string >::iterator jt = e.pins.begin(); jt != e.pins.end(); ++jt)
+            fIndex << "pin " << (*it).first << " " << *jt << std::endl;
+    }
+    fIndex.close();
+    if (fIndex.fail()) {
+        CVMWA_LOG("Error", "Unable to write the image cache index " << sTempFile);
+        ::remove( sTempFile.c_str() );
+        return false;
+    }
+
+    // Replace it in one step, so the other processes never find the cache without an index
+#ifdef _WIN32
+    if (!MoveFileExA( sTempFile.c_str(), sIndexFile.c_str(), MOVEFILE_REPLACE_EXISTING )) {
+#else
+    if (::rename( sTempFile.c_str(), sIndexFile.c_str() ) != 0) {
+#endif
+        CVMWA_LOG("Error", "Unable to replace the image cache index " << sIndexFile);
+        ::remove( sTempFile.c_str() );
+        return false;
+    }
+    return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Find the checksum of the given image (checksum or path)
+ */
+std::string ImageCache::resolve( const std::string& image ) {
+    CRASH_REPORT_BEGIN;
+    if (entries.find( image ) != entries.end()) return image;
+    for (std::map< std::string, Entry >::iterator it = entries.begin(); it != entries.end(); ++it) {
+        if (samePath( dir + "/" + (*it).second.file, image )) return (*it).first;
+    }
+    return "";
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the path of the cached image with the given checksum
+ */
+std::string ImageCache::lookup( const std::string& checksum ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(cacheMutex);
+    ImageCacheLock indexLock( dir + "/" IMAGECACHE_LOCK );
+    load();
+    std::map< std::string, Entry >::iterator it = entries.find( checksum );
+    if (it == entries.end()) return "";
+
+    // Mark it as used
+    (*it).second.lastUse = (long long) time( NULL );
+    save();
+    return dir + "/" + (*it).second.file;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the path of the cached image that was downloaded from the given URL
+ */
+std::string ImageCache::lookupURL( const std::string& url, std::string * checksum ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(cacheMutex);
+    ImageCacheLock indexLock( dir + "/" IMAGECACHE_LOCK );
+    load();
+    for (std::map< std::string, Entry >::iterator it = entries.begin(); it != entries.end(); ++it) {
+        if ((*it).second.urls.find( url ) == (*it).second.urls.end()) continue;
+
+        // Mark it as used
+        (*it).second.lastUse = (long long) time( NULL );
+        save();
+        if (checksum != NULL) *checksum = (*it).first;
+        return dir + "/" + (*it).second.file;
+    }
+    return "";
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the path of the most recently used cached image that was downloaded
+ * from a URL containing the given string
+ */
+std::string ImageCache::lookupURLPart( const std::string& urlPart, std::string * url ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(cacheMutex);
+    ImageCacheLock indexLock( dir + "/" IMAGECACHE_LOCK );
+    load();
+    std::map< std::string, Entry >::iterator found = entries.end();
+    std::string sURL;
+    for (std::map< std::string, Entry >::iterator it = entries.begin(); it != entries.end(); ++it) {
+        if ((found != entries.end()) && ((*it).second.lastUse <= (*found).second.lastUse)) continue;
+        for (std::set< std::string >::iterator jt = (*it).second.urls.begin(); jt != (*it).second.urls.end(); ++jt) {
+            if ((*jt).find( urlPart ) == std::string::npos) continue;
+            found = it;
+            sURL = *jt;
+            break;
+        }
+    }
+    if (found == entries.end()) return "";
+
+    // Mark it as used
+    (*found).second.lastUse = (long long) time( NULL );
+    save();
+    if (url != NULL) *url = sURL;
+    return dir + "/" + (*found).second.file;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the image is cached
+ */
+bool ImageCache::contains( const std::string& image ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(cacheMutex);
+    load();
+    return !resolve( image ).empty();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the URLs the image was found at
+ */
+std::set< std::string > ImageCache::getURLs( const std::string& image ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(cacheMutex);
+    load();
+    std::string checksum = resolve( image );
+    if (checksum.empty()) return std::set< std::string >();
+    return entries[checksum].urls;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Move a validated file in the cache
+ */
+std::string ImageCache::store( const std::string& file, const std::string& checksum, const std::string& url, bool inPlace ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(cacheMutex);
+    ImageCacheLock indexLock( dir + "/" IMAGECACHE_LOCK );
+
+    // The checksum is the key of the index and usually part of the filename
+    std::string sChecksum = checksum;
+    if (sChecksum.empty() || !isSanitized( &sChecksum, "0123456789abcdef" )) {
+        CVMWA_LOG("Warning", "Not caching '" << file << "', invalid checksum '" << checksum << "'");
+        return file;
+    }
+
+    load();
+    std::map< std::string, Entry >::iterator it = entries.find( checksum );
+    if (it != entries.end()) {
+
+        // Someone may be using a file we did not move, so leave it alone
+        std::string sCached = dir + "/" + (*it).second.file;
+        if (inPlace && !samePath( sCached, file )) return file;
+
+        // We already have it, drop the copy
+        if (!samePath( sCached, file )) ::remove( file.c_str() );
+        if (!url.empty()) (*it).second.urls.insert( url );
+        (*it).second.lastUse = (long long) time( NULL );
+        save();
+        return sCached;
+
+    }
+
+    Entry e;
+    std::string sCached;
+    if (inPlace) {
+
+        // Index it where it is
+        e.file = boost::filesystem::path( file ).filename().string();
+        sCached = dir + "/" + e.file;
+        if (!samePath( sCached, file )) {
+            CVMWA_LOG("Warning", "Not caching '" << file << "', it's not in the image cache folder");
+            return file;
+        }
+
+    } else {
+
+        // Move it in place, keeping its extension (the hypervisor needs it)
+        e.file = checksum + boost::filesystem::path( file ).extension().string();
+        sCached = dir + "/" + e.file;
+        if (!samePath( sCached, file )) {
+            ::remove( sCached.c_str() );
+            if (::rename( file.c_str(), sCached.c_str() ) != 0) {
+                CVMWA_LOG("Error", "Unable to move '" << file << "' to the image cache");
+                return file;
+            }
+        }
+
+    }
+    boost::system::error_code ec;
+    e.size = (long long) boost::filesystem::file_size( sCached, ec );
+    if (ec) e.size = 0;
+    e.lastUse = (long long) time( NULL );
+    if (!url.empty()) e.urls.insert( url );
+    entries[checksum] = e;
+
+    // Make room for it
+    evictLocked( 0, checksum );
+    save();
+    return sCached;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Remember that the cached image was also found at the given URL
+ */
+void ImageCache::alias( const std::string& checksum, const std::string& url ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(cacheMutex);
+    ImageCacheLock indexLock( dir + "/" IMAGECACHE_LOCK );
+    load();
+    std::map< std::string, Entry >::iterator it = entries.find( checksum );
+    if ((it == entries.end()) || url.empty()) return;
+    if ((*it).second.urls.insert( url ).second) save();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Keep the image from being evicted
+ */
+bool ImageCache::pin( const std::string& image, const std::string& owner ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(cacheMutex);
+    ImageCacheLock indexLock( dir + "/" IMAGECACHE_LOCK );
+    if (owner.find_first_of( " \t\r\n" ) != std::string::npos) return false;
+    load();
+    std::string checksum = resolve( image );
+    if (checksum.empty()) return false;
+    Entry& e = entries[checksum];
+    e.pins.insert( owner );
+    e.lastUse = (long long) time( NULL );
+    return save();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Release the pins of the given owner
+ */
+void ImageCache::unpin( const std::string& owner, const std::string& image ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(cacheMutex);
+    ImageCacheLock indexLock( dir + "/" IMAGECACHE_LOCK );
+    load();
+    std::string checksum = image.empty() ? "" : resolve( image );
+    bool changed = false;
+    for (std::map< std::string, Entry >::iterator it = entries.begin(); it != entries.end(); ++it) {
+        if (!checksum.empty() && ((*it).first != checksum)) continue;
+        if ((*it).second.pins.erase( owner ) > 0) changed = true;
+    }
+    if (changed) save();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Sort the images by their last use
+ */
+bool __imageCacheOlder( const std::pair< long long, std::string >& a, const std::pair< long long, std::string >& b ) {
+    return a.first < b.first;
+}
+
+/**
+ * Remove the least recently used images
+ */
+long long ImageCache::evictLocked( long long reserve, const std::string& keep ) {
+    CRASH_REPORT_BEGIN;
+    if (quota <= 0) return 0;
+
+    // Find the images that can be removed
+    long long usage = 0;
+    std::vector< std::pair< long long, std::string > > candidates;
+    for (std::map< std::string, Entry >::iterator it = entries.begin(); it != entries.end(); ++it) {
+        usage += (*it).second.size;
+        if (!(*it).second.pins.empty() || ((*it).first == keep)) continue;
+        candidates.push_back( std::make_pair( (*it).second.lastUse, (*it).first ) );
+    }
+    std::sort( candidates.begin(), candidates.end(), __imageCacheOlder );
+
+    // Remove the oldest ones until we fit
+    long long freed = 0;
+    for (std::vector< std::pair< long long, std::string > >::iterator it = candidates.begin(); it != candidates.end(); ++it) {
+        if (usage + reserve <= quota) break;
+        Entry& e = entries[(*it).second];
+        std::string sFile = dir + "/" + e.file;
+        if ((::remove( sFile.c_str() ) != 0) && file_exists( sFile )) continue;
+        CVMWA_LOG("Info", "Evicted '" << e.file << "' (" << e.size << " bytes) from the image cache");
+        usage -= e.size;
+        freed += e.size;
+        entries.erase( (*it).second );
+    }
+    if (usage + reserve > quota) {
+        CVMWA_LOG("Warning", "The image cache is above its quota (" << usage << " > " << quota << " bytes)");
+    }
+
+    return freed;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Make room in the cache
+ */
+long long ImageCache::evict( long long reserve ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(cacheMutex);
+    ImageCacheLock indexLock( dir + "/" IMAGECACHE_LOCK );
+    load();
+    long long freed = evictLocked( reserve, "" );
+    if (freed > 0) save();
+    return freed;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Change the quota of the cache
+ */
+void ImageCache::setQuota( long long quota ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(cacheMutex);
+    this->quota = quota;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the quota of the cache
+ */
+long long ImageCache::getQuota() {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(cacheMutex);
+    return quota;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the total size of the cached images
+ */
+long long ImageCache::getUsage() {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(cacheMutex);
+    load();
+    long long usage = 0;
+    for (std::map< std::string, Entry >::iterator it = entries.begin(); it != entries.end(); ++it)
+        usage += (*it).second.size;
+    return usage;
+    CRASH_REPORT_END;
+}
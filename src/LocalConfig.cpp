@@ -22,6 +22,7 @@
 
 #include <CernVM/Hypervisor.h>
 #include <CernVM/LocalConfig.h>
+#include <CernVM/FileWatch.h>
 
 // Initialize singletons
 LocalConfigPtr LocalConfig::globalConfigSingleton;
@@ -76,7 +77,7 @@ LocalConfigPtr LocalConfig::forRuntime( const std::string& name ) {
 /**
  * Create custom configuration file from the given map file
  */
-LocalConfig::LocalConfig ( std::string path, std::string name ) : ParameterMap(), timeLoaded(0), timeModified(0), keysDeleted() {
+LocalConfig::LocalConfig ( std::string path, std::string name ) : ParameterMap(), timeLoaded(0), timeModified(0), keysDeleted(), watchID(0), watchMutex(), syncMutex() {
     CRASH_REPORT_BEGIN;
 
     // Prepare names
@@ -98,6 +99,57 @@ LocalConfig::LocalConfig ( std::string path, std::string name ) : ParameterMap()
     CRASH_REPORT_END;
 }
 
+/**
+ * Stop watching the file on destruction
+ */
+LocalConfig::~LocalConfig ( ) {
+    CRASH_REPORT_BEGIN;
+    unwatch();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Get notified when the config file is changed, and synchronize
+ * the contents without waiting for somebody to call sync()
+ */
+void LocalConfig::watch ( ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(watchMutex);
+    if (watchID > 0) return;
+    watchID = FileWatch::Default()->watch( 
+        systemPath(this->configDir + "/" + configName + ".conf"), 
+        boost::bind( &LocalConfig::fileChanged, this, _1 )
+    );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Stop watching the config file
+ */
+void LocalConfig::unwatch ( ) {
+    CRASH_REPORT_BEGIN;
+
+    // Release the lock before unwatch(), since it waits for the running callbacks
+    int oldWatchID = 0;
+    {
+        boost::mutex::scoped_lock lock(watchMutex);
+        oldWatchID = watchID;
+        watchID = 0;
+    }
+    if (oldWatchID > 0) FileWatch::Default()->unwatch( oldWatchID );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Notification from the FileWatch that the config file has changed
+ */
+void LocalConfig::fileChanged ( const std::string& /* file */ ) {
+    CRASH_REPORT_BEGIN;
+    this->sync();
+    CRASH_REPORT_END;
+}
+
 /**
  * Enumerate the names of the config files in the specified directory that matches the specified prefix.
  */
@@ -424,6 +476,7 @@ time_t LocalConfig::getLastModified ( std::string configFile ) {
  */
 ParameterMap& LocalConfig::erase ( const std::string& name ) {
     CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock syncLock(syncMutex);
 
     // Update time modified
     timeModified = getTimeInMs();
@@ -495,6 +548,7 @@ ParameterMap& LocalConfig::clearAll ( ) {
  */
 ParameterMap& LocalConfig::set ( const std::string& name, std::string value ) {
     CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock syncLock(syncMutex);
 
     // Update time modified
     timeModified = getTimeInMs();
@@ -531,13 +585,14 @@ void LocalConfig::commitChanges ( ) {
  */
 bool LocalConfig::save ( ) {
     CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock syncLock(syncMutex);
     bool ans = false;
 
     {
         // Mutex for making this thread-safe
         boost::unique_lock<boost::mutex> lock(*parametersMutex);
         // Save map to file
-        bool ans = this->saveMap( configName, parameters.get() );
+        ans = this->saveMap( configName, parameters.get() );
     }
 
     // Check answer
@@ -563,13 +618,14 @@ bool LocalConfig::save ( ) {
  */
 bool LocalConfig::load ( ) {
     CRASH_REPORT_BEGIN;
+    boost::recursive_mutex::scoped_lock syncLock(syncMutex);
     bool ans = false;
 
     {
         // Mutex for making this thread-safe
         boost::unique_lock<boost::mutex> lock(*parametersMutex);
         // Load map from file
-        bool ans = this->loadMap( configName, parameters.get() );
+        ans = this->loadMap( configName, parameters.get() );
     }
 
     // Check answer
@@ -595,7 +651,8 @@ bool LocalConfig::load ( ) {
  */
 bool LocalConfig::sync ( ) {
     CRASH_REPORT_BEGIN;
-    
+    boost::recursive_mutex::scoped_lock syncLock(syncMutex);
+
     // If the file is missing, save it 
     std::string fName = systemPath(this->configDir + "/" + configName + ".conf");
     if (!file_exists( fName ))
@@ -676,8 +733,10 @@ bool LocalConfig::sync ( ) {
         }
     }
 
-    // Save file contents
+    // Save file contents. Memory and disk are now in sync, so
+    // don't merge again until one of them changes.
     this->saveMap( configName, &map );
+    timeLoaded = getTimeInMs();
 
     return true;
     CRASH_REPORT_END;
@@ -0,0 +1,196 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/SessionMonitor.h>
+#include <CernVM/Hypervisor.h>
+
+using namespace std;
+
+SessionMonitorPtr   systemSessionMonitor;
+boost::once_flag    systemSessionMonitorOnce = BOOST_ONCE_INIT;
+
+/**
+ * Allocate the system-wide monitor
+ */
+void __initSessionMonitor() {
+    systemSessionMonitor = boost::make_shared< SessionMonitor >();
+}
+
+/**
+ * Create the monitor
+ */
+SessionMonitor::SessionMonitor() : sessions(), queue(), stopping(false), thread(NULL), monitorMutex(), monitorCond(), updateMutex() {
+}
+
+/**
+ * Stop the monitor thread
+ */
+SessionMonitor::~SessionMonitor() {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::mutex::scoped_lock lock(monitorMutex);
+        stopping = true;
+    }
+    monitorCond.notify_all();
+    if (thread != NULL) {
+        thread->join();
+        delete thread;
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Get system-wide monitor singleton
+ */
+SessionMonitorPtr SessionMonitor::Default() {
+    CRASH_REPORT_BEGIN;
+    boost::call_once( __initSessionMonitor, systemSessionMonitorOnce );
+    return systemSessionMonitor;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Start monitoring a session
+ */
+void SessionMonitor::monitor( const HVSessionPtr& session ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(monitorMutex);
+    if (sessions.find( session.get() ) != sessions.end()) return;
+
+    // Store it
+    Entry e;
+    e.session = session;
+    e.queued = false;
+    e.deferred = false;
+    sessions[ session.get() ] = e;
+
+    // Start the thread on demand
+    if (thread == NULL)
+        thread = new boost::thread( boost::bind( &SessionMonitor::monitorLoop, this ) );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Stop monitoring a session
+ */
+void SessionMonitor::unmonitor( HVSession * session ) {
+    CRASH_REPORT_BEGIN;
+
+    // Wait for the running update to complete
+    boost::recursive_mutex::scoped_lock updateLock(updateMutex);
+    boost::mutex::scoped_lock lock(monitorMutex);
+
+    std::map< HVSession*, Entry >::iterator it = sessions.find( session );
+    if (it == sessions.end()) return;
+    if ((*it).second.queued) queue.remove( session );
+    sessions.erase( it );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Schedule an update of the session
+ */
+void SessionMonitor::notify( HVSession * session ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(monitorMutex);
+    std::map< HVSession*, Entry >::iterator it = sessions.find( session );
+    if (it == sessions.end()) return;
+    enqueue( session, (*it).second );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Run the deferred update of the session
+ */
+void SessionMonitor::notifyIdle( HVSession * session ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(monitorMutex);
+    std::map< HVSession*, Entry >::iterator it = sessions.find( session );
+    if ((it == sessions.end()) || !(*it).second.deferred) return;
+    enqueue( session, (*it).second );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Queue the update of a session, unless it's already queued
+ */
+void SessionMonitor::enqueue( HVSession * session, Entry& e ) {
+    CRASH_REPORT_BEGIN;
+    e.deferred = false;
+    if (e.queued) return;
+    e.queued = true;
+    queue.push_back( session );
+    monitorCond.notify_all();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Monitor thread main loop
+ */
+void SessionMonitor::monitorLoop() {
+    CRASH_REPORT_BEGIN;
+    for (;;) {
+        HVSessionPtr session;
+
+        // Wait for a session to update
+        {
+            boost::mutex::scoped_lock lock(monitorMutex);
+            while (!stopping && queue.empty())
+                monitorCond.wait( lock );
+            if (stopping) return;
+
+            // Pick it (it might have gone away)
+            HVSession * ptr = queue.front();
+            queue.pop_front();
+            std::map< HVSession*, Entry >::iterator it = sessions.find( ptr );
+            if (it == sessions.end()) continue;
+            (*it).second.queued = false;
+            session = (*it).second.session.lock();
+            if (!session) {
+                sessions.erase( it );
+                continue;
+            }
+        }
+
+        // Check if it was unmonitored in the mean time. If the session becomes
+        // idle while we are updating it, it will be updated again.
+        boost::recursive_mutex::scoped_lock updateLock(updateMutex);
+        {
+            boost::mutex::scoped_lock lock(monitorMutex);
+            std::map< HVSession*, Entry >::iterator it = sessions.find( session.get() );
+            if (it == sessions.end()) continue;
+            (*it).second.deferred = true;
+        }
+
+        // Update it, without waiting if it's busy
+        int ans = session->update( false );
+
+        // If it was busy, keep it deferred until it becomes idle
+        if (ans != HVE_SCHEDULED) {
+            boost::mutex::scoped_lock lock(monitorMutex);
+            std::map< HVSession*, Entry >::iterator it = sessions.find( session.get() );
+            if (it != sessions.end()) (*it).second.deferred = false;
+        }
+
+    }
+    CRASH_REPORT_END;
+}
@@ -19,26 +19,231 @@
  */
 
 #include <CernVM/SimpleFSM.h>
+#include <algorithm>
 #include <cstdarg>
 #include <stdexcept>
 #include <iostream>
+#include <sstream>
+#include <fstream>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <json/json.h>
+
+/**
+ * The routing tables of the FSM definitions, indexed by the graph signature
+ */
+std::map< std::string, FSMRoutingTablePtr > 	fsmRoutingTables;
+boost::mutex 									fsmRoutingTablesMutex;
+
+/**
+ * The graphs of the static FSM definitions (also protected by fsmRoutingTablesMutex)
+ */
+std::map< const FSMStaticDef*, FSMGraphPtr > 	fsmStaticGraphs;
+
+/**
+ * The watchdog that enforces the deadlines of the FSM handlers.
+ *
+ * A single thread (started on demand) serves all the SimpleFSM instances. When
+ * a deadline expires, the system commands of the handler are cancelled, so it
+ * returns early and the FSM is notified with FSMHandlerTimeout.
+ */
+class FSMWatchdog {
+public:
+
+	FSMWatchdog() : deadlines(), stopping(false), thread(NULL), mutex(), cond() { };
+
+	/**
+	 * Stop and join the watchdog thread
+	 */
+	~FSMWatchdog() {
+		{
+			boost::unique_lock<boost::mutex> lock(mutex);
+			stopping = true;
+		}
+		cond.notify_all();
+		if (thread != NULL) {
+			thread->join();
+			delete thread;
+		}
+	}
+
+	/**
+	 * Start the deadline of the given FSM, unless one is already running.
+	 * When it expires, the given token is cancelled.
+	 */
+	bool arm( SimpleFSM * fsm, long deadline, const SysExecTokenPtr & token ) {
+		boost::unique_lock<boost::mutex> lock(mutex);
+		if (fsm->fsmDeadlineArmed) return false;
+		fsm->fsmDeadlineArmed = true;
+		fsm->fsmDeadlineHit = false;
+		deadlines[fsm] = std::make_pair( deadline, token );
+		if (thread == NULL)
+			thread = new boost::thread( boost::bind( &FSMWatchdog::watchLoop, this ) );
+		cond.notify_all();
+		return true;
+	}
+
+	/**
+	 * Stop the deadline of the given FSM and return true if it has expired.
+	 * When this function returns, the FSM is not accessed by the watchdog.
+	 */
+	bool disarm( SimpleFSM * fsm ) {
+		boost::unique_lock<boost::mutex> lock(mutex);
+		bool hit = fsm->fsmDeadlineHit;
+		deadlines.erase( fsm );
+		fsm->fsmDeadlineArmed = false;
+		fsm->fsmDeadlineHit = false;
+		return hit;
+	}
+
+private:
+
+	/**
+	 * Watchdog thread main loop
+	 */
+	void watchLoop() {
+		boost::unique_lock<boost::mutex> lock(mutex);
+		while (!stopping) {
+
+			// Expire the due deadlines and find the next one
+			long now = getMillis(), next = 0;
+			for (std::map< SimpleFSM*, std::pair< long, SysExecTokenPtr > >::iterator it = deadlines.begin(); it != deadlines.end(); ) {
+				if ((*it).second.first <= now) {
+					SimpleFSM * fsm = (*it).first;
+					SysExecTokenPtr token = (*it).second.second;
+					deadlines.erase( it++ );
+					fsm->fsmDeadlineHit = true;
+					token->cancel();
+				} else {
+					if ((next == 0) || ((*it).second.first < next)) next = (*it).second.first;
+					++it;
+				}
+			}
+
+			// Wait for the next deadline or for a change
+			if (next == 0) {
+				cond.wait( lock );
+			} else {
+				cond.timed_wait( lock, boost::posix_time::milliseconds( next - now ) );
+			}
+
+		}
+	}
+
+	std::map< SimpleFSM*, std::pair< long, SysExecTokenPtr > >
+									deadlines;
+	bool 							stopping;
+	boost::thread * 				thread;
+	boost::mutex 					mutex;
+	boost::condition_variable 		cond;
+
+};
+typedef boost::shared_ptr< FSMWatchdog > FSMWatchdogPtr;
+FSMWatchdogPtr 		systemFSMWatchdog;
+boost::once_flag 	systemFSMWatchdogOnce = BOOST_ONCE_INIT;
+
+/**
+ * Allocate the system-wide watchdog
+ */
+void __initFSMWatchdog() {
+	systemFSMWatchdog = boost::make_shared< FSMWatchdog >();
+}
+
+/**
+ * Get the system-wide watchdog, creating it on first use
+ */
+FSMWatchdogPtr __fsmWatchdog() {
+	boost::call_once( __initFSMWatchdog, systemFSMWatchdogOnce );
+	return systemFSMWatchdog;
+}
+
+/**
+ * Build the next-hop routing table of the given FSM graph.
+ *
+ * A reverse BFS from every target gives the distance of every node to it. The next
+ * hop is then the first child (in decleration order) that is one step closer, which
+ * picks the same path as a depth-first search on the children would.
+ */
+FSMRoutingTablePtr buildRoutingTable( const std::vector<FSMNode*> & nodes ) {
+    CRASH_REPORT_BEGIN;
+	size_t n = nodes.size();
+	boost::shared_ptr< FSMRoutingTable > table = boost::make_shared< FSMRoutingTable >();
+	table->size = n;
+	table->nextHop.assign( n * n, -1 );
+
+	// Build the reverse links
+	std::vector< std::vector<int> > parents( n );
+	for (size_t i=0; i<n; ++i) {
+		for (std::vector<FSMNode*>::iterator it = nodes[i]->children.begin(); it != nodes[i]->children.end(); ++it) {
+			parents[ (*it)->index ].push_back( (int)i );
+		}
+	}
+
+	// Route towards every target
+	std::vector<int> dist( n ), queue( n );
+	for (size_t to=0; to<n; ++to) {
+
+		// Distance of every node to the target
+		dist.assign( n, -1 );
+		dist[to] = 0;
+		size_t qHead = 0, qTail = 0;
+		queue[qTail++] = (int)to;
+		while (qHead < qTail) {
+			int v = queue[qHead++];
+			for (std::vector<int>::iterator it = parents[v].begin(); it != parents[v].end(); ++it) {
+				if (dist[*it] >= 0) continue;
+				dist[*it] = dist[v] + 1;
+				queue[qTail++] = *it;
+			}
+		}
+
+		// Pick the first child that gets us closer
+		for (size_t from=0; from<n; ++from) {
+			if ((from == to) || (dist[from] <= 0)) continue;
+			for (std::vector<FSMNode*>::iterator it = nodes[from]->children.begin(); it != nodes[from]->children.end(); ++it) {
+				if (dist[ (*it)->index ] == dist[from] - 1) {
+					table->nextHop[ from * n + to ] = (*it)->index;
+					break;
+				}
+			}
+		}
+
+	}
+
+	return table;
+    CRASH_REPORT_END;
+}
 
 /**
  * Void function FSMEnteringState
  */
 void SimpleFSM::FSMEnteringState( const int state, bool final ) { }
 
+/**
+ * Void function FSMHandlerTimeout
+ */
+void SimpleFSM::FSMHandlerTimeout( const int /* state */, const bool /* redirected */ ) { }
+
+/**
+ * Void function FSMStepCompleted
+ */
+void SimpleFSM::FSMStepCompleted( const int /* state */, const int /* target */ ) { }
+
 /**
  * Reset FSM registry variables
  */
 void SimpleFSM::FSMRegistryBegin() {
     CRASH_REPORT_BEGIN;
-    // Reset
-    fsmNodes.clear();
+    // Reset (with a graph of our own, since the handlers are bound to us)
+    fsmGraph = boost::make_shared<FSMGraph>();
     fsmTmpRouteLinks.clear();
-    fsmCurrentPath.clear();
-    fsmRootNode = NULL;
-    fsmCurrentNode = NULL;
+    fsmTmpBranchLinks.clear();
+    {
+        boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+        fsmCurrentPath.clear();
+        fsmCurrentNode = NULL;
+        _fsmPublish();
+    }
     CRASH_REPORT_END;
 }
 
@@ -52,9 +257,9 @@ void SimpleFSM::FSMRegistryAdd( int id, fsmHandler handler, ... ) {
     int l;
 
     // Initialize node
-    fsmNodes[id].id = id;
-    fsmNodes[id].handler = handler;
-    fsmNodes[id].children.clear();
+    fsmGraph->nodes[id].id = id;
+    fsmGraph->nodes[id].handler = handler;
+    fsmGraph->nodes[id].children.clear();
     
     // Store route mapping to temp routes vector
     // (Will be synced by FSMRegistryEnd)
@@ -68,45 +273,192 @@ void SimpleFSM::FSMRegistryAdd( int id, fsmHandler handler, ... ) {
 }
 
 /**
- * Complete FSM registry decleration and build FSM tree
+ * Set the name of a node (used by the instrumentation)
  */
-void SimpleFSM::FSMRegistryEnd( int rootID ) {
+void SimpleFSM::FSMRegistryName( int id, const std::string & name ) {
+    CRASH_REPORT_BEGIN;
+
+    // Strip the '&Class::' prefix of the handler
+    std::string n = name;
+    size_t pos = n.rfind("::");
+    if (pos != std::string::npos) n = n.substr(pos + 2);
+    fsmGraph->nodes[id].name = n;
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Set the deadline of the handler of a node
+ */
+void SimpleFSM::FSMRegistryTimeout( int id, int timeout ) {
+    CRASH_REPORT_BEGIN;
+    fsmGraph->nodes[id].timeout = timeout;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Add a fork/join group to the FSM registry
+ */
+void SimpleFSM::FSMRegistryParallel( int id, ... ) {
+    CRASH_REPORT_BEGIN;
+    va_list pl;
+    int l;
+
+    // Store branches to the temp branches vector
+    // (Will be synced by FSMRegistryEnd)
+    va_start(pl, id);
+    while ((l = va_arg(pl,int)) != 0) {
+        fsmTmpBranchLinks[id].push_back(l);
+    }
+    va_end(pl);
+    CRASH_REPORT_END;
+}
+
+/**
+ * Link the nodes of the graph with the given links and branches, index them
+ * and pick the root node. Returns the signature of the graph.
+ */
+std::string __fsmLinkGraph( FSMGraph & graph, std::map<int,std::vector<int> > & routeLinks, std::map<int,std::vector<int> > & branchLinks, int rootID ) {
     CRASH_REPORT_BEGIN;
 	std::map<int,FSMNode>::iterator pt;
-	std::vector<FSMNode*> 			nodePtr;
 	std::vector<int> 				links;
+	std::ostringstream 				signature;
+
+	// Index the nodes
+	graph.index.clear();
+	for (std::map<int,FSMNode>::iterator it = graph.nodes.begin(); it != graph.nodes.end(); ++it) {
+		(*it).second.index = (int)graph.index.size();
+		graph.index.push_back( &((*it).second) );
+	}
 
 	// Build FSM linked list
-	for (std::map<int,FSMNode>::iterator it = fsmNodes.begin(); it != fsmNodes.end(); ++it) {
+	for (std::map<int,FSMNode>::iterator it = graph.nodes.begin(); it != graph.nodes.end(); ++it) {
 		int id = (*it).first;
 		FSMNode * node = &((*it).second);
 
 		// Create links
-		nodePtr.clear();
-		links = fsmTmpRouteLinks[id];
+		signature << id << ":";
+		links = routeLinks[id];
 		for (std::vector<int>::iterator jt = links.begin(); jt != links.end(); ++jt) {
 
 			// Get pointer to node element in map
-			pt = fsmNodes.find( *jt );
+			pt = graph.nodes.find( *jt );
 			FSMNode * refNode = &((*pt).second);
 
 			// Update node
 			node->children.push_back( refNode );
+			signature << *jt << ",";
+
+		}
+		signature << ";";
 
+		// Link branches
+		node->branches.clear();
+		links = branchLinks[id];
+		for (std::vector<int>::iterator jt = links.begin(); jt != links.end(); ++jt) {
+			pt = graph.nodes.find( *jt );
+			if (pt == graph.nodes.end()) continue;
+			if (!(*pt).second.hasHandler()) continue;
+			node->branches.push_back( &((*pt).second) );
 		}
 
 	}
 
 	// Fetch root node
-	fsmTargetState = rootID;
-	pt = fsmNodes.find( rootID );
-	fsmRootNode = &((*pt).second);
+	pt = graph.nodes.find( rootID );
+	graph.root = &((*pt).second);
+
+	return signature.str();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Complete FSM registry decleration and build FSM tree
+ */
+void SimpleFSM::FSMRegistryEnd( int rootID ) {
+    CRASH_REPORT_BEGIN;
+
+	// Link the graph
+	std::string signature = __fsmLinkGraph( *fsmGraph, fsmTmpRouteLinks, fsmTmpBranchLinks, rootID );
+
+	// Use the routing table of the same FSM graph if it's already built
+	{
+		boost::unique_lock<boost::mutex> lock(fsmRoutingTablesMutex);
+		std::map< std::string, FSMRoutingTablePtr >::iterator it = fsmRoutingTables.find( signature );
+		if (it != fsmRoutingTables.end()) {
+			fsmGraph->routes = (*it).second;
+		} else {
+			fsmGraph->routes = buildRoutingTable( fsmGraph->index );
+			fsmRoutingTables[ signature ] = fsmGraph->routes;
+		}
+	}
 
 	// Reset current node
-	fsmCurrentNode = fsmRootNode;
+	fsmTargetState = rootID;
+	{ /* mutex(fsmCurrentPath)) */
+		boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+		fsmCurrentNode = fsmGraph->root;
+		_fsmPublish();
+	}
 
 	// Flush temp arrays
 	fsmTmpRouteLinks.clear();
+	fsmTmpBranchLinks.clear();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Use a static FSM definition
+ */
+void SimpleFSM::FSMRegistryStatic( const FSMStaticDef & def ) {
+    CRASH_REPORT_BEGIN;
+	FSMGraphPtr graph;
+
+	// Build the graph of the definition only once
+	{
+		boost::unique_lock<boost::mutex> lock(fsmRoutingTablesMutex);
+		std::map< const FSMStaticDef*, FSMGraphPtr >::iterator it = fsmStaticGraphs.find( &def );
+		if (it != fsmStaticGraphs.end()) {
+			graph = (*it).second;
+		} else {
+			std::map<int,std::vector<int> > routeLinks, branchLinks;
+			graph = boost::make_shared<FSMGraph>();
+
+			// Create the nodes
+			for (size_t i=0; i<def.nodeCount; ++i) {
+				const FSMStaticNode & n = def.nodes[i];
+				FSMNode & node = graph->nodes[n.id];
+				node.id = n.id;
+				node.staticHandler = n.handler;
+				node.timeout = n.timeout;
+				if (n.name != NULL) node.name = n.name;
+				routeLinks[n.id].clear();
+				for (int j=0; (j<FSM_STATIC_LINKS) && (n.links[j] != 0); ++j)
+					routeLinks[n.id].push_back( n.links[j] );
+			}
+			for (size_t i=0; i<def.forkCount; ++i) {
+				branchLinks[ def.forks[i].id ].push_back( def.forks[i].branch );
+			}
+
+			// Link it and build the routing table
+			__fsmLinkGraph( *graph, routeLinks, branchLinks, def.root );
+			graph->routes = buildRoutingTable( graph->index );
+			fsmStaticGraphs[ &def ] = graph;
+		}
+	}
+
+	// Use it
+	fsmGraph = graph;
+	fsmTmpRouteLinks.clear();
+	fsmTmpBranchLinks.clear();
+	fsmTargetState = def.root;
+	{ /* mutex(fsmCurrentPath)) */
+		boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+		fsmCurrentPath.clear();
+		fsmCurrentNode = fsmGraph->root;
+		_fsmPublish();
+	}
+
     CRASH_REPORT_END;
 }
 
@@ -120,14 +472,27 @@ bool SimpleFSM::_callHandler( FSMNode * node, bool inThread ) {
 	try {
 
 		// Run the new state
-		if (node->handler)
-			node->handler();
+		if (node->hasHandler()) {
+			unsigned int redirectSerial = fsmRedirectSerial;
+			bool deadline = _fsmArmDeadline( node );
+			long long traceBegin = _fsmTraceBegin();
+			try {
+				_fsmInvoke( node );
+			} catch (...) {
+				_fsmTraceEnd( node, traceBegin, false );
+				if (deadline) _fsmDisarmDeadline();
+				throw;
+			}
+			_fsmTraceEnd( node, traceBegin, false );
+			if (deadline && _fsmDisarmDeadline())
+				_fsmDeadlineMissed( node, fsmRedirectSerial != redirectSerial );
+		}
 
 	} catch (boost::thread_interrupted &e) {
 		CVMWA_LOG("Debuf", "FSM Handler interrupted");
 
-		// Cleanup
-		fsmInsideHandler = false;
+		// Cleanup (we are stopping, so the deferred target is dropped)
+		_fsmLeaveHandler( false );
 
 		if (inThread) {
 			// If we are in-thread, re-throw so it's
@@ -162,7 +527,11 @@ bool SimpleFSM::FSMContinue( bool inThread ) {
     CRASH_REPORT_BEGIN;
 	if (fsmInsideHandler) return false;
 	if (fsmCurrentPath.empty() && (fsmCurrentNode != NULL)) return false;
-	fsmInsideHandler = true;
+	{ /* mutex(fsmCurrentPath)) */
+		boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+		fsmInsideHandler = true;
+		fsmHandlerThread = boost::this_thread::get_id();
+	}
 
 	FSMNode * next;
 	{ /* mutex(fsmCurrentPath)) */
@@ -176,7 +545,7 @@ bool SimpleFSM::FSMContinue( bool inThread ) {
 	// Skip state nodes
     { /* mutex(fsmCurrentPath)) */
         boost::unique_lock<boost::mutex> lock(fsmPathMutex);
-        while ((!next->handler) && !fsmCurrentPath.empty()) {
+        while ((!next->hasHandler()) && !fsmCurrentPath.empty()) {
             lock.unlock();
             FSMEnteringState( next->id, false );
             lock.lock();
@@ -187,69 +556,65 @@ bool SimpleFSM::FSMContinue( bool inThread ) {
     }
 
 	// Change current node
-	fsmCurrentNode = next;
-	FSMEnteringState( next->id, (const bool) fsmCurrentPath.empty() );
-
-	// Call handler
-	if (!_callHandler(next, inThread)) 
-		return false;
-
-	// We are now outside the handler
-	fsmInsideHandler = false;
-    return true;
-    CRASH_REPORT_END;
-}
-
-/**
- * Helper function to traverse the FSM graph, trying to find the
- * shortest path that leads to the given action.
- */
-void findShortestPath( std::vector< FSMNode * > path, FSMNode * node, int state,	// Arguments
-					  size_t * clipLength, std::vector< FSMNode * > ** bestPath ) {	// State
-    CRASH_REPORT_BEGIN;
-
-	// Update path
-	path.push_back( node );
-
-	// Clip protection
-	if (path.size() >= *clipLength)
-		return;
-
-	// Iterate through the children
-	for (std::vector<FSMNode*>::iterator it = node->children.begin(); it != node->children.end(); ++it) {
-		FSMNode * n = *it;
-
-		// Ignore if it's already visited
-		if (std::find(path.begin(), path.end(), n) != path.end())
-			continue;
-
-		// Check if we found the node
-		if (n->id == state) {
-
-			// Set new clip path
-			*clipLength = path.size();
-			path.push_back( n );
-
-			// Replace best path
-			if (*bestPath != NULL) delete *bestPath;
-			*bestPath = new std::vector<FSMNode*>(path);
-
-#ifdef LOGGING
-			// Present best path
-			std::ostringstream oss;
-			for (std::vector<FSMNode*>::iterator j= (*bestPath)->begin(); j!=(*bestPath)->end(); ++j) {
-				if (!oss.str().empty()) oss << ", "; oss << (*j)->id;
+	bool isLast;
+	{ /* mutex(fsmCurrentPath)) */
+		boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+		fsmCurrentNode = next;
+		isLast = fsmCurrentPath.empty();
+		_fsmPublish();
+	}
+	FSMEnteringState( next->id, isLast );
+
+	// If the handler of this node was running in parallel, join it
+	// and apply the redirection it requested, if any.
+	int redirectState; bool redirectJump;
+	if (_fsmJoinBranches( next, &redirectState, &redirectJump )) {
+		if (redirectState != 0) {
+			if (redirectJump) {
+				FSMJump( redirectState );
+			} else {
+				FSMSkew( redirectState );
 			}
-			CVMWA_LOG("Debug", "Preferred path: " << oss.str() );
-#endif
+		}
+	} else {
 
-			// We cannot continue (since we found a better path)
-			return;
+		// Start the parallel branches of this node
+		_fsmForkBranches( next );
+
+		// Call handler. If it failed, let the deferred target (if any) take
+		// us away from here, or it would be parked forever.
+		if (!_callHandler(next, inThread)) {
+			_fsmLeaveHandler( true );
+			return false;
 		}
 
-		// Continue with the items
-		findShortestPath( path, n, state, clipLength, bestPath );
 	}
+
+	// We are now outside the handler. Pick the last
+	// target requested while we were running it.
+	int pending, stepNode, stepTarget;
+	{ /* mutex(fsmCurrentPath)) */
+		boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+		fsmInsideHandler = false;
+		fsmHandlerThread = boost::thread::id();
+		pending = fsmPendingTarget;
+		fsmPendingTarget = 0;
+		stepNode = (fsmCurrentNode != NULL) ? fsmCurrentNode->id : 0;
+		if (pending == 0) _fsmPublish();
+	}
+	if (pending != 0) {
+	    CVMWA_LOG("Debug", "Continuing towards the coalesced target " << pending);
+		FSMGoto( pending );
+	}
+	{ /* mutex(fsmCurrentPath)) */
+		boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+		stepTarget = fsmTargetState;
+	}
+
+	// Report the completed step (the handler might have redirected us). If
+	// it was the last one, the FSM is already inactive when this is called.
+	FSMStepCompleted( stepNode, stepTarget );
+    return true;
     CRASH_REPORT_END;
 }
 
@@ -261,38 +626,64 @@ void findShortestPath( std::vector< FSMNode * > path, FSMNode * node, int state,
 void SimpleFSM::FSMGoto(int state, int stripPathComponents) {
     CRASH_REPORT_BEGIN;
 
+	// Merge the requests that do not change the active target
+	// or that arrive while a handler is running.
+	if ((stripPathComponents == 1) && _fsmCoalesce( state ))
+		return;
+
 	// Allow only one thread to steer the FSM
 	boost::unique_lock<boost::mutex> lock(fsmGotoMutex);
 
     CVMWA_LOG("Debug", "Going towards " << state);
 
 	// Reset path
+	bool newTarget;
 	{ /* mutex(fsmCurrentPath)) */
 		boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+		newTarget = fsmCurrentPath.empty() || (state != fsmTargetState);
 		fsmCurrentPath.clear();
 	}
 
-	// Prepare clip length
-	size_t clipLength = fsmNodes.size();
+	// A new request (not a re-route towards the same target)
+	if (newTarget) {
+		boost::unique_lock<boost::mutex> lock(fsmStatsMutex);
+		fsmGotoSerial++;
+	}
 
-	// Prepare solver
-	std::vector< FSMNode * > srcPath;
-	std::vector< FSMNode * > *resPath = NULL;
-	findShortestPath( srcPath, fsmCurrentNode, state, &clipLength, &resPath );
+	// Look-up the target and the first hop in the routing table
+	FSMRoutingTablePtr routes = fsmGraph->routes;
+	std::map<int,FSMNode>::iterator pt = fsmGraph->nodes.find( state );
+	if (routes && (fsmCurrentNode != NULL) && (pt != fsmGraph->nodes.end())) {
+		size_t n = routes->size;
+		int to = (*pt).second.index;
+		int hop = routes->nextHop[ fsmCurrentNode->index * n + to ];
+
+		// Check if we actually found a path
+		if (hop >= 0) {
+
+			// Follow the next hops (the path includes the current node)
+			{
+				boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+				int component = 0;
+				if (component++ >= stripPathComponents) fsmCurrentPath.push_back( fsmCurrentNode );
+				while (hop >= 0) {
+					if (component++ >= stripPathComponents) fsmCurrentPath.push_back( fsmGraph->index[hop] );
+					if (hop == to) break;
+					hop = routes->nextHop[ hop * n + to ];
+				}
 
-	// Check if we actually found a path
-	if (resPath != NULL) {
+				// Switch active target
+				fsmTargetState = state;
+			}
 
-		// Update target path and release resPath memory
-		{
-			boost::unique_lock<boost::mutex> lock(fsmPathMutex);
-			fsmCurrentPath.assign( resPath->begin()+stripPathComponents, resPath->end() );
 		}
-		delete resPath;
 
-		// Switch active target
-		fsmTargetState = state;
+	}
 
+	// Publish the new path
+	{ /* mutex(fsmCurrentPath)) */
+		boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+		_fsmPublish();
 	}
 
 	// If we have progress feedback, update the max
@@ -305,11 +696,12 @@ void SimpleFSM::FSMGoto(int state, int stripPathComponents) {
 			pathCount = 0;
 			for (std::list<FSMNode*>::iterator j= fsmCurrentPath.begin(); j!=fsmCurrentPath.end(); ++j) {
 				FSMNode* node = *j;
-				if (node->handler) pathCount++;
+				if (node->hasHandler()) pathCount++;
 			}
 		}
 
 		// Restart progress
+		boost::unique_lock<boost::recursive_mutex> lock(fsmProgressMutex);
         fsmProgress->restart( fsmProgressResetMsg, false );
 
 		// Update max tasks that will be passed through
@@ -318,7 +710,7 @@ void SimpleFSM::FSMGoto(int state, int stripPathComponents) {
 	}
 
 	// Notify possibly paused thread
-	if (fsmThread != NULL)
+	if ((fsmThread != NULL) || fsmExecutor)
 		_fsmWakeup();
 
 #ifdef LOGGING
@@ -345,6 +737,10 @@ void SimpleFSM::FSMGoto(int state, int stripPathComponents) {
 void SimpleFSM::FSMJump(int state) {
     CRASH_REPORT_BEGIN;
 
+	// Branches cannot steer the FSM before they are joined
+	if (_fsmDeferRedirect( state, true )) return;
+	fsmRedirectSerial++;
+
 	// Allow only one thread to steer the FSM
 	boost::unique_lock<boost::mutex> lock(fsmGotoMutex);
 
@@ -357,19 +753,25 @@ void SimpleFSM::FSMJump(int state) {
 	}
 
 	// Pick the current node
-	std::map<int,FSMNode>::iterator it = fsmNodes.find( state );
+	std::map<int,FSMNode>::iterator it = fsmGraph->nodes.find( state );
 
-	if (it == fsmNodes.end()) {
+	if (it == fsmGraph->nodes.end()) {
 		// Skip missing nodes
-		fsmCurrentNode = fsmRootNode;
+		boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+		fsmCurrentNode = fsmGraph->root;
+		_fsmPublish();
 
 	} else {
 
         // Change current node
-        fsmCurrentNode = &it->second;
+        {
+            boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+            fsmCurrentNode = &it->second;
+            _fsmPublish();
+        }
 
         // Handle only non-state nodes
-        if (fsmCurrentNode->handler) {
+        if (fsmCurrentNode->hasHandler()) {
 		    // We are entering the given state
 		    FSMEnteringState( fsmCurrentNode->id, true );
 
@@ -389,22 +791,27 @@ void SimpleFSM::FSMJump(int state) {
  */
 void SimpleFSM::FSMSkew(int state) {
     CRASH_REPORT_BEGIN;
-    CVMWA_LOG("Debug", "Skewing through " << state << " towards " << fsmTargetState);
+
+	// Branches cannot steer the FSM before they are joined
+	if (_fsmDeferRedirect( state, false )) return;
+	fsmRedirectSerial++;
 	std::map<int,FSMNode>::iterator pt;
 
 	// Search given state
-	pt = fsmNodes.find( state );
-	if (pt == fsmNodes.end()) return;
+	pt = fsmGraph->nodes.find( state );
+	if (pt == fsmGraph->nodes.end()) return;
 
 	// Switch current node to the skewed state
-	fsmCurrentNode = &((*pt).second);
-
-	// Notify state change
 	bool isEmpty = false;
+	int target;
 	{ /* mutex(fsmCurrentPath)) */
 		boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+		fsmCurrentNode = &((*pt).second);
 		isEmpty = fsmCurrentPath.empty();		
+		target = fsmTargetState;
+		_fsmPublish();
 	}
+    CVMWA_LOG("Debug", "Skewing through " << state << " towards " << target);
 	FSMEnteringState( state, isEmpty );
 
 	// Continue towards the active target only if the path is not empty. 
@@ -412,9 +819,10 @@ void SimpleFSM::FSMSkew(int state) {
 	{ /* mutex(fsmCurrentPath)) */
 		boost::unique_lock<boost::mutex> lock(fsmPathMutex);
 		isEmpty = fsmCurrentPath.empty();		
+		target = fsmTargetState;
 	}
 	if ( !isEmpty ) {
-		FSMGoto( fsmTargetState, 0 );
+		FSMGoto( target, 0 );
 	}
 
     CRASH_REPORT_END;
@@ -477,14 +885,32 @@ void SimpleFSM::FSMThreadStop() {
     CRASH_REPORT_BEGIN;
     CVMWA_LOG("Debug", "Stopping FSM thread");
 
+	// In executor mode, just make sure we are not running
+	if (fsmExecutor) {
+		if (!fsmThreadActive) {
+		    CVMWA_LOG("Debug", "Thread already stopped");
+			_fsmStopBranches();
+			return;
+		}
+		fsmtInterruptRequested = true;
+		fsmExecToken->cancel();
+		fsmExecutor->cancel( this );
+		_fsmStopBranches();
+		fsmwWaitCond.notify_all();
+		fsmThreadActive = false;
+		return;
+	}
+
 	// Ensure we have a running thread
 	if ((fsmThread == NULL) || (!fsmThreadActive)) {
 	    CVMWA_LOG("Debug", "Thread already stopped");
+		_fsmStopBranches();
 		return;
 	}
 
-	// Interrupt thread
+	// Interrupt thread and cancel any system command it's waiting for
 	fsmtInterruptRequested = true;
+	fsmExecToken->cancel();
 	fsmThread->interrupt();
 
 	// Notify all condition variables
@@ -504,6 +930,9 @@ void SimpleFSM::FSMThreadStop() {
 	// Cleanup thread
 	fsmThread = NULL;
 
+	// Stop the parallel branches
+	_fsmStopBranches();
+
     CRASH_REPORT_END;
 }
 
@@ -542,6 +971,13 @@ void SimpleFSM::_fsmPause() {
 void SimpleFSM::_fsmWakeup() {
     CRASH_REPORT_BEGIN;
     if (fsmtInterruptRequested) return;
+
+    // In executor mode, schedule the next action
+    if (fsmExecutor) {
+    	if (fsmThreadActive) fsmExecutor->schedule( this );
+    	return;
+    }
+
     CVMWA_LOG("Debug", "Waking-up paused thread");
 
     {
@@ -576,6 +1012,7 @@ void SimpleFSM::FSMUseProgress ( const FiniteTaskPtr & pf, const std::string & r
 void SimpleFSM::FSMDoing ( const std::string & message ) {
     CRASH_REPORT_BEGIN;
 	CVMWA_LOG("Debug", "Doing " << message);
+	boost::unique_lock<boost::recursive_mutex> lock(fsmProgressMutex);
 	if (fsmProgress) {
 		fsmProgress->doing(message);
 	}
@@ -591,6 +1028,7 @@ void SimpleFSM::FSMDoing ( const std::string & message ) {
 void SimpleFSM::FSMDone ( const std::string & message ) {
     CRASH_REPORT_BEGIN;
 	CVMWA_LOG("Debug", "Done " << message);
+	boost::unique_lock<boost::recursive_mutex> lock(fsmProgressMutex);
 	if (fsmProgress) {
 		fsmProgress->done(message);
 	}
@@ -605,6 +1043,7 @@ template <typename T> boost::shared_ptr<T>
 SimpleFSM::FSMBegin( const std::string& message ) {
     CRASH_REPORT_BEGIN;
 	boost::shared_ptr<T> ptr = boost::shared_ptr<T>();
+	boost::unique_lock<boost::recursive_mutex> lock(fsmProgressMutex);
 	if (fsmProgress) {
 		ptr = fsmProgress->begin<T>(message);
 	}
@@ -618,6 +1057,7 @@ SimpleFSM::FSMBegin( const std::string& message ) {
 void SimpleFSM::FSMFail ( const std::string & message, const int errorCode ) {
     CRASH_REPORT_BEGIN;
 	CVMWA_LOG("Debug", "Done " << message);
+	boost::unique_lock<boost::recursive_mutex> lock(fsmProgressMutex);
 	if (fsmProgress) {
 		fsmProgress->fail(message, errorCode);
 	}
@@ -633,8 +1073,8 @@ void SimpleFSM::FSMWaitFor ( int state, int timeout ) {
 
 	// Find the state
 	std::map<int,FSMNode>::iterator pt;
-	pt = fsmNodes.find( state );
-	if (pt == fsmNodes.end()) return;
+	pt = fsmGraph->nodes.find( state );
+	if (pt == fsmGraph->nodes.end()) return;
 
 	// If we are already on this state, don't do anything
 	if (fsmCurrentNode == fsmwState) return;
@@ -682,8 +1122,59 @@ void SimpleFSM::FSMWaitInactive ( int timeout ) {
  */
 bool SimpleFSM::FSMActive ( ) {
     CRASH_REPORT_BEGIN;
-	boost::unique_lock<boost::mutex> lock(fsmPathMutex);
-	return !fsmCurrentPath.empty();
+	return fsmObsActive.load( boost::memory_order_acquire );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the ID of the current node
+ */
+int SimpleFSM::FSMCurrentState ( ) {
+    CRASH_REPORT_BEGIN;
+	return fsmObsNode.load( boost::memory_order_acquire );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the ID of the target state
+ */
+int SimpleFSM::FSMTargetState ( ) {
+    CRASH_REPORT_BEGIN;
+	return fsmObsTarget.load( boost::memory_order_acquire );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Read a consistent snapshot of the published state. If a writer is
+ * updating it at the same time, just read it again.
+ */
+void SimpleFSM::FSMObserve ( int * state, int * target, bool * active ) {
+    CRASH_REPORT_BEGIN;
+	for (;;) {
+		unsigned int seq = fsmObsSeq.load( boost::memory_order_acquire );
+		if (seq & 1) continue;
+		*state = fsmObsNode.load( boost::memory_order_relaxed );
+		*target = fsmObsTarget.load( boost::memory_order_relaxed );
+		*active = fsmObsActive.load( boost::memory_order_relaxed );
+		boost::atomic_thread_fence( boost::memory_order_acquire );
+		if (fsmObsSeq.load( boost::memory_order_relaxed ) == seq) return;
+	}
+    CRASH_REPORT_END;
+}
+
+/**
+ * Publish the current node, the target and the active flag
+ * for the lock-free readers (fsmPathMutex must be locked)
+ */
+void SimpleFSM::_fsmPublish ( ) {
+    CRASH_REPORT_BEGIN;
+	unsigned int seq = fsmObsSeq.load( boost::memory_order_relaxed );
+	fsmObsSeq.store( seq + 1, boost::memory_order_relaxed );
+	boost::atomic_thread_fence( boost::memory_order_release );
+	fsmObsNode.store( (fsmCurrentNode != NULL) ? fsmCurrentNode->id : 0, boost::memory_order_relaxed );
+	fsmObsTarget.store( fsmTargetState, boost::memory_order_relaxed );
+	fsmObsActive.store( !fsmCurrentPath.empty() || (fsmPendingTarget != 0), boost::memory_order_relaxed );
+	fsmObsSeq.store( seq + 2, boost::memory_order_release );
     CRASH_REPORT_END;
 }
 
@@ -696,8 +1187,26 @@ boost::thread * SimpleFSM::FSMThreadStart() {
 	if (fsmThread != NULL)
 		return fsmThread;
 
+	// Drop the requests coalesced before we were stopped
+	{ /* mutex(fsmCurrentPath)) */
+		boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+		fsmPendingTarget = 0;
+		_fsmPublish();
+	}
+
+	// In executor mode there is no thread, just start scheduling
+	if (fsmExecutor) {
+		if (fsmThreadActive) return NULL;
+		fsmtInterruptRequested = false;
+		fsmExecToken->reset();
+		fsmThreadActive = true;
+		if (FSMActive()) _fsmWakeup();
+		return NULL;
+	}
+
 	// Reset properties
 	fsmtInterruptRequested = false;
+	fsmExecToken->reset();
 	
 	// Set the current state to paused, effectively
 	// stopping the FSM execution if no wakeup signals are piled
@@ -710,20 +1219,755 @@ boost::thread * SimpleFSM::FSMThreadStart() {
 }
 
 /**
- * Release mutex upon destruction
+ * Place the FSM on the given node without running its handler
  */
-SimpleFSM::~SimpleFSM() {
+bool SimpleFSM::FSMRestore( int state ) {
     CRASH_REPORT_BEGIN;
+	boost::unique_lock<boost::mutex> lock(fsmGotoMutex);
 
-	// Join thread
-	FSMThreadStop();
+	// Find the node
+	std::map<int,FSMNode>::iterator it = fsmGraph->nodes.find( state );
+	if (it == fsmGraph->nodes.end()) return false;
+
+	// We can only be moved while idle
+	boost::unique_lock<boost::mutex> pathLock(fsmPathMutex);
+	if (fsmInsideHandler || !fsmCurrentPath.empty()) return false;
+    CVMWA_LOG("Debug", "Restoring on " << state);
+	fsmCurrentNode = &((*it).second);
+	_fsmPublish();
+	return true;
 
     CRASH_REPORT_END;
 }
 
 /**
- * Implement some known templates
+ * Use a shared executor instead of a dedicated thread
  */
-template FiniteTaskPtr      SimpleFSM::FSMBegin<FiniteTask>( const std::string& message );
-template VariableTaskPtr    SimpleFSM::FSMBegin<VariableTask>( const std::string& message );
-template BooleanTaskPtr     SimpleFSM::FSMBegin<BooleanTask>( const std::string& message );
+void SimpleFSM::FSMUseExecutor( const FSMExecutorPtr & executor ) {
+    CRASH_REPORT_BEGIN;
+
+	// We cannot switch while running
+	if ((fsmThread != NULL) || fsmThreadActive) {
+		CVMWA_LOG("Warning", "Cannot change the FSM executor while running");
+		return;
+	}
+	fsmExecutor = executor;
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Run the next action of the FSM (called by the executor workers).
+ * Returns true if there are more actions to run.
+ */
+bool SimpleFSM::_fsmStep() {
+    CRASH_REPORT_BEGIN;
+	bool res = false;
+
+	// Same as an iteration of the FSMThreadLoop
+	try {
+		if (!fsmtInterruptRequested) {
+			boost::unique_lock<boost::mutex> lock(fsmmThreadSafe);
+			res = FSMContinue(true);
+		}
+	} catch (boost::thread_interrupted &e) {
+		CVMWA_LOG("Debug", "FSM action interrupted");
+		res = false;
+	}
+
+	// Unlock people waiting for completion
+	if (!res) fsmwWaitCond.notify_all();
+	return res;
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Start the handlers of the branches of the given node, if they are further
+ * down the current path.
+ */
+void SimpleFSM::_fsmForkBranches( FSMNode * node ) {
+    CRASH_REPORT_BEGIN;
+	if (node->branches.empty()) return;
+	if (fsmtInterruptRequested) return;
+
+	for (std::vector<FSMNode*>::iterator it = node->branches.begin(); it != node->branches.end(); ++it) {
+		FSMNode * branch = *it;
+
+		// Check if we are going to pass through the branch node
+		{ /* mutex(fsmCurrentPath)) */
+			boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+			if (std::find( fsmCurrentPath.begin(), fsmCurrentPath.end(), branch ) == fsmCurrentPath.end())
+				continue;
+		}
+
+		// Start it (if not already running)
+		boost::unique_lock<boost::mutex> lock(fsmBranchMutex);
+		bool running = false;
+		for (std::list<FSMBranch>::iterator jt = fsmBranches.begin(); jt != fsmBranches.end(); ++jt) {
+			if ((*jt).node == branch) running = true;
+		}
+		if (running) continue;
+
+	    CVMWA_LOG("Debug", "Forking branch " << branch->id << " from " << node->id);
+		FSMBranch b;
+		b.node = branch;
+		b.redirectState = 0;
+		b.redirectJump = false;
+		b.thread = NULL;
+		b.token = fsmExecToken->createChild();
+		fsmBranches.push_back( b );
+		fsmBranches.back().thread = new boost::thread( boost::bind( &SimpleFSM::_fsmBranchThread, this, branch ) );
+
+	}
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Wait for the branch of the given node and for the branches that are no longer
+ * in the current path. The latter are cancelled and interrupted first, since
+ * their result is going to be dropped. Returns true if the given node was a
+ * branch, in which case the redirection it requested is also returned.
+ */
+bool SimpleFSM::_fsmJoinBranches( FSMNode * node, int * redirectState, bool * redirectJump ) {
+    CRASH_REPORT_BEGIN;
+	std::vector<boost::thread *> threads;
+	bool joined = false;
+	*redirectState = 0;
+	*redirectJump = false;
+
+	// Pick the branches to join
+	{
+		boost::unique_lock<boost::mutex> lock(fsmBranchMutex);
+		if (fsmBranches.empty()) return false;
+		boost::unique_lock<boost::mutex> pathLock(fsmPathMutex);
+		for (std::list<FSMBranch>::iterator it = fsmBranches.begin(); it != fsmBranches.end(); ++it) {
+			if ((*it).node == node) {
+				threads.push_back( (*it).thread );
+			} else if (std::find( fsmCurrentPath.begin(), fsmCurrentPath.end(), (*it).node ) == fsmCurrentPath.end()) {
+			    CVMWA_LOG("Debug", "Cancelling the abandoned branch " << (*it).node->id);
+				(*it).token->cancel();
+				(*it).thread->interrupt();
+				threads.push_back( (*it).thread );
+			}
+		}
+	}
+	if (threads.empty()) return false;
+
+	// Wait for them without holding the lock, since the
+	// branches might need it for deferring a redirection
+	for (std::vector<boost::thread *>::iterator it = threads.begin(); it != threads.end(); ++it)
+		(*it)->join();
+
+	// Collect the results and cleanup
+	{
+		boost::unique_lock<boost::mutex> lock(fsmBranchMutex);
+		for (std::list<FSMBranch>::iterator it = fsmBranches.begin(); it != fsmBranches.end(); ) {
+			if (std::find( threads.begin(), threads.end(), (*it).thread ) == threads.end()) {
+				++it;
+				continue;
+			}
+			if ((*it).node == node) {
+			    CVMWA_LOG("Debug", "Joined branch " << node->id);
+				joined = true;
+				*redirectState = (*it).redirectState;
+				*redirectJump = (*it).redirectJump;
+			} else if ((*it).redirectState != 0) {
+			    CVMWA_LOG("Debug", "Ignoring redirection to " << (*it).redirectState << " from the abandoned branch " << (*it).node->id);
+			}
+			delete (*it).thread;
+			it = fsmBranches.erase( it );
+		}
+	}
+
+	return joined;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Interrupt and join all the running branches
+ */
+void SimpleFSM::_fsmStopBranches() {
+    CRASH_REPORT_BEGIN;
+	std::vector<boost::thread *> threads;
+	{
+		boost::unique_lock<boost::mutex> lock(fsmBranchMutex);
+		for (std::list<FSMBranch>::iterator it = fsmBranches.begin(); it != fsmBranches.end(); ++it) {
+			(*it).token->cancel();
+			(*it).thread->interrupt();
+			threads.push_back( (*it).thread );
+		}
+	}
+	if (threads.empty()) return;
+    CVMWA_LOG("Debug", "Stopping " << threads.size() << " parallel branch(es)");
+
+	// Join them without holding the lock
+	for (std::vector<boost::thread *>::iterator it = threads.begin(); it != threads.end(); ++it)
+		(*it)->join();
+
+	// Cleanup
+	boost::unique_lock<boost::mutex> lock(fsmBranchMutex);
+	for (std::list<FSMBranch>::iterator it = fsmBranches.begin(); it != fsmBranches.end(); ++it)
+		delete (*it).thread;
+	fsmBranches.clear();
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Entry point of the branch threads
+ */
+void SimpleFSM::_fsmBranchThread( FSMNode * node ) {
+    CRASH_REPORT_BEGIN;
+	long long traceBegin = _fsmTraceBegin();
+	try {
+		try {
+			_fsmInvoke( node );
+		} catch (...) {
+			_fsmTraceEnd( node, traceBegin, true );
+			throw;
+		}
+		_fsmTraceEnd( node, traceBegin, true );
+	} catch (boost::thread_interrupted &e) {
+		CVMWA_LOG("Debug", "FSM branch " << node->id << " interrupted");
+	} catch ( std::exception &e ) {
+		CVMWA_LOG("Exception", e.what() );
+	} catch ( ... ) {
+		CVMWA_LOG("Exception", "Unknown exception" );
+	}
+    CRASH_REPORT_END;
+}
+
+/**
+ * If we are called from a branch thread, keep the redirection
+ * for when the branch is joined and return true.
+ */
+bool SimpleFSM::_fsmDeferRedirect( int state, bool jump ) {
+    CRASH_REPORT_BEGIN;
+	boost::unique_lock<boost::mutex> lock(fsmBranchMutex);
+	for (std::list<FSMBranch>::iterator it = fsmBranches.begin(); it != fsmBranches.end(); ++it) {
+		if (((*it).thread != NULL) && ((*it).thread->get_id() == boost::this_thread::get_id())) {
+		    CVMWA_LOG("Debug", "Deferring redirection to " << state << " until branch " << (*it).node->id << " is joined");
+			if ((*it).redirectState == 0) {
+				(*it).redirectState = state;
+				(*it).redirectJump = jump;
+			}
+			return true;
+		}
+	}
+	return false;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the exec token of the branch running on the current thread,
+ * the token of the handler with a deadline running on it, or the
+ * token of the FSM.
+ */
+SysExecTokenPtr SimpleFSM::FSMExecToken() {
+    CRASH_REPORT_BEGIN;
+	boost::unique_lock<boost::mutex> lock(fsmBranchMutex);
+	for (std::list<FSMBranch>::iterator it = fsmBranches.begin(); it != fsmBranches.end(); ++it) {
+		if (((*it).thread != NULL) && ((*it).thread->get_id() == boost::this_thread::get_id()))
+			return (*it).token;
+	}
+	if (fsmDeadlineToken && (fsmDeadlineThread == boost::this_thread::get_id()))
+		return fsmDeadlineToken;
+	return fsmExecToken;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Coalesce a goto request:
+ *
+ *  - If we are already heading towards the same target, there is nothing to do
+ *    (any other request that was pending is superseded).
+ *  - If a handler is running on another thread, keep only the last request
+ *    and apply it when the handler completes. This way the intermediate targets
+ *    of a burst are dropped before their handlers run, the progress is restarted
+ *    and the path is computed only once.
+ *
+ * The requests from within the handlers are applied immediately.
+ */
+bool SimpleFSM::_fsmCoalesce( int state ) {
+    CRASH_REPORT_BEGIN;
+	boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+
+	// Already heading there
+	if (!fsmCurrentPath.empty() && (state == fsmTargetState)) {
+		if (fsmPendingTarget != 0) {
+		    CVMWA_LOG("Debug", "Dropping the superseded target " << fsmPendingTarget);
+		}
+	    CVMWA_LOG("Debug", "Already heading towards " << state);
+		fsmPendingTarget = 0;
+		_fsmPublish();
+		return true;
+	}
+
+	// Handler running on another thread
+	if (fsmInsideHandler && (fsmHandlerThread != boost::this_thread::get_id())) {
+		if ((fsmPendingTarget != 0) && (fsmPendingTarget != state)) {
+		    CVMWA_LOG("Debug", "Dropping the superseded target " << fsmPendingTarget);
+		}
+	    CVMWA_LOG("Debug", "Deferring target " << state << " until the running handler completes");
+		fsmPendingTarget = state;
+		_fsmPublish();
+		return true;
+	}
+
+	return false;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Mark that we are out of a handler that did not complete, and apply or drop
+ * the target that was deferred while it was running.
+ */
+void SimpleFSM::_fsmLeaveHandler( bool applyPending ) {
+    CRASH_REPORT_BEGIN;
+	int pending;
+	{ /* mutex(fsmCurrentPath)) */
+		boost::unique_lock<boost::mutex> lock(fsmPathMutex);
+		fsmInsideHandler = false;
+		fsmHandlerThread = boost::thread::id();
+		pending = fsmPendingTarget;
+		fsmPendingTarget = 0;
+		_fsmPublish();
+	}
+	if (pending == 0) return;
+	if (applyPending) {
+	    CVMWA_LOG("Debug", "Continuing towards the deferred target " << pending << " after a failed handler");
+		FSMGoto( pending );
+	} else {
+	    CVMWA_LOG("Debug", "Dropping the deferred target " << pending);
+	}
+    CRASH_REPORT_END;
+}
+
+/**
+ * Start the deadline of the handler of the given node, if it has one
+ * and if there is no other deadline running (ex. we are in an FSMJump).
+ * The handler runs with its own token, so an expired deadline does not
+ * cancel the commands of the parallel branches.
+ */
+bool SimpleFSM::_fsmArmDeadline( FSMNode * node ) {
+    CRASH_REPORT_BEGIN;
+	if (node->timeout <= 0) return false;
+	SysExecTokenPtr token = fsmExecToken->createChild();
+	if (!__fsmWatchdog()->arm( this, getMillis() + node->timeout, token )) return false;
+	{
+		boost::unique_lock<boost::mutex> lock(fsmBranchMutex);
+		fsmDeadlineToken = token;
+		fsmDeadlineThread = boost::this_thread::get_id();
+	}
+	return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Stop the running deadline and return true if it has expired
+ */
+bool SimpleFSM::_fsmDisarmDeadline() {
+    CRASH_REPORT_BEGIN;
+	bool hit = __fsmWatchdog()->disarm( this );
+	{
+		boost::unique_lock<boost::mutex> lock(fsmBranchMutex);
+		fsmDeadlineToken.reset();
+		fsmDeadlineThread = boost::thread::id();
+	}
+	return hit;
+    CRASH_REPORT_END;
+}
+
+/**
+ * The handler of the given node has returned after its deadline
+ */
+void SimpleFSM::_fsmDeadlineMissed( FSMNode * node, bool redirected ) {
+    CRASH_REPORT_BEGIN;
+    CVMWA_LOG("Warning", "FSM handler " << node->id << " (" << node->name << ") missed its deadline of " << node->timeout << " ms");
+
+	// Account it
+	{
+		boost::unique_lock<boost::mutex> lock(fsmStatsMutex);
+		std::map<int,FSMHandlerStats>::iterator it = fsmStats.find( node->id );
+		if (it != fsmStats.end()) (*it).second.timeouts++;
+	}
+
+	// Let the subclass route the FSM
+	FSMHandlerTimeout( node->id, redirected );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Call the handler of the given node
+ */
+void SimpleFSM::_fsmInvoke( FSMNode * node ) {
+	if (node->staticHandler != NULL) {
+		node->staticHandler( this );
+	} else {
+		node->handler();
+	}
+}
+
+/**
+ * The wall-clock time in milliseconds since the epoch. Unlike getMillis() it's
+ * 64-bit and it has the same origin on all the platforms, so it can be used
+ * in the trace timestamps.
+ */
+long long __fsmEpochMillis() {
+	static const boost::posix_time::ptime epoch( boost::gregorian::date( 1970, 1, 1 ) );
+	return ( boost::posix_time::microsec_clock::universal_time() - epoch ).total_milliseconds();
+}
+
+/**
+ * Start accounting a handler invocation on the current thread
+ */
+long long SimpleFSM::_fsmTraceBegin() {
+    CRASH_REPORT_BEGIN;
+	boost::unique_lock<boost::mutex> lock(fsmStatsMutex);
+	fsmStatsExec[ boost::this_thread::get_id() ].push_back( 0 );
+	return __fsmEpochMillis();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Complete the accounting of a handler invocation on the current thread
+ */
+void SimpleFSM::_fsmTraceEnd( FSMNode * node, long long begin, bool branch ) {
+    CRASH_REPORT_BEGIN;
+	long long duration = __fsmEpochMillis() - begin;
+	boost::unique_lock<boost::mutex> lock(fsmStatsMutex);
+
+	// Pop the exec counter (handlers can be nested with FSMJump)
+	unsigned int execCalls = 0;
+	std::map<boost::thread::id, std::vector<unsigned int> >::iterator it = fsmStatsExec.find( boost::this_thread::get_id() );
+	if (it != fsmStatsExec.end()) {
+		if (!(*it).second.empty()) {
+			execCalls = (*it).second.back();
+			(*it).second.pop_back();
+		}
+		if ((*it).second.empty()) fsmStatsExec.erase( it );
+	}
+
+	// Update statistics
+	std::map<int,FSMHandlerStats>::iterator pt = fsmStats.find( node->id );
+	if (pt == fsmStats.end()) {
+		FSMHandlerStats st;
+		st.id = node->id;
+		st.name = node->name;
+		st.calls = 0;
+		st.retries = 0;
+		st.execCalls = 0;
+		st.timeouts = 0;
+		st.totalTime = 0;
+		st.maxTime = 0;
+		st.lastTime = 0;
+		st.gotoSerial = 0;
+		pt = fsmStats.insert( std::pair<int,FSMHandlerStats>( node->id, st ) ).first;
+	}
+	FSMHandlerStats & st = (*pt).second;
+	if ((st.calls > 0) && (st.gotoSerial == fsmGotoSerial)) st.retries++;
+	st.gotoSerial = fsmGotoSerial;
+	st.calls++;
+	st.execCalls += execCalls;
+	st.totalTime += duration;
+	st.lastTime = duration;
+	if (duration > st.maxTime) st.maxTime = duration;
+
+	// Keep the trace
+	FSMTraceEvent ev;
+	ev.id = node->id;
+	ev.name = node->name;
+	ev.begin = begin;
+	ev.duration = duration;
+	ev.execCalls = execCalls;
+	ev.branch = branch;
+	fsmTrace.push_back( ev );
+	if (fsmTrace.size() > FSM_TRACE_SIZE) fsmTrace.pop_front();
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Account a system command to the handler running on the current thread
+ */
+void SimpleFSM::FSMCountExec() {
+    CRASH_REPORT_BEGIN;
+	boost::unique_lock<boost::mutex> lock(fsmStatsMutex);
+	std::map<boost::thread::id, std::vector<unsigned int> >::iterator it = fsmStatsExec.find( boost::this_thread::get_id() );
+	if ((it != fsmStatsExec.end()) && !(*it).second.empty())
+		(*it).second.back()++;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the timing statistics of the handlers
+ */
+std::map<int,FSMHandlerStats> SimpleFSM::FSMGetStats() {
+    CRASH_REPORT_BEGIN;
+	boost::unique_lock<boost::mutex> lock(fsmStatsMutex);
+	return fsmStats;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the last handler invocations
+ */
+std::vector<FSMTraceEvent> SimpleFSM::FSMGetTrace() {
+    CRASH_REPORT_BEGIN;
+	boost::unique_lock<boost::mutex> lock(fsmStatsMutex);
+	return std::vector<FSMTraceEvent>( fsmTrace.begin(), fsmTrace.end() );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Clear the timing statistics and the trace
+ */
+void SimpleFSM::FSMResetStats() {
+    CRASH_REPORT_BEGIN;
+	boost::unique_lock<boost::mutex> lock(fsmStatsMutex);
+	fsmStats.clear();
+	fsmTrace.clear();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Return the trace in the Chrome trace-event format. Every invocation is a
+ * complete ('X') event. The main path is on thread 0 and every branch is
+ * on a thread with the ID of the branch node.
+ */
+std::string SimpleFSM::FSMTraceJSON() {
+    CRASH_REPORT_BEGIN;
+	std::vector<FSMTraceEvent> trace = FSMGetTrace();
+	Json::Value root, events(Json::arrayValue);
+
+	for (std::vector<FSMTraceEvent>::iterator it = trace.begin(); it != trace.end(); ++it) {
+		Json::Value ev, args;
+		std::ostringstream name;
+		if ((*it).name.empty()) {
+			name << (*it).id;
+		} else {
+			name << (*it).name;
+		}
+		args["id"] = (*it).id;
+		args["exec"] = (*it).execCalls;
+		ev["name"] = name.str();
+		ev["cat"] = (*it).branch ? "fsm,branch" : "fsm";
+		ev["ph"] = "X";
+		ev["ts"] = (double)(*it).begin * 1000.0;
+		ev["dur"] = (double)(*it).duration * 1000.0;
+		ev["pid"] = 0;
+		ev["tid"] = (*it).branch ? (*it).id : 0;
+		ev["args"] = args;
+		events.append( ev );
+	}
+
+	root["traceEvents"] = events;
+	root["displayTimeUnit"] = "ms";
+	Json::FastWriter writer;
+	return writer.write( root );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Write the trace JSON to the given file
+ */
+bool SimpleFSM::FSMDumpTrace( const std::string & filename ) {
+    CRASH_REPORT_BEGIN;
+	std::ofstream ofs( filename.c_str(), std::ofstream::out | std::ofstream::trunc );
+	if (!ofs.good()) return false;
+	ofs << FSMTraceJSON();
+	ofs.close();
+	return true;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Release mutex upon destruction
+ */
+SimpleFSM::~SimpleFSM() {
+    CRASH_REPORT_BEGIN;
+
+	// Join thread
+	FSMThreadStop();
+
+	// Make sure the watchdog is not looking at us
+	if (fsmDeadlineArmed) _fsmDisarmDeadline();
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Implement some known templates
+ */
+template FiniteTaskPtr      SimpleFSM::FSMBegin<FiniteTask>( const std::string& message );
+template VariableTaskPtr    SimpleFSM::FSMBegin<VariableTask>( const std::string& message );
+template BooleanTaskPtr     SimpleFSM::FSMBegin<BooleanTask>( const std::string& message );
+
+/////////////////////////////////////
+/////////////////////////////////////
+////
+//// FSMExecutor Implementation
+////
+/////////////////////////////////////
+/////////////////////////////////////
+
+FSMExecutorPtr 		systemFSMExecutor;
+boost::once_flag 	systemFSMExecutorOnce = BOOST_ONCE_INIT;
+
+/**
+ * Allocate the system-wide executor
+ */
+void __initFSMExecutor() {
+	systemFSMExecutor = boost::make_shared< FSMExecutor >();
+}
+
+/**
+ * Create the executor (the workers are started on demand)
+ */
+FSMExecutor::FSMExecutor( int concurrency ) : concurrency(concurrency), numIdle(0), stopping(false), queue(), threads(), execMutex(), execCond(), doneCond() {
+    CRASH_REPORT_BEGIN;
+	if (this->concurrency <= 0) this->concurrency = boost::thread::hardware_concurrency();
+	if (this->concurrency < 2) this->concurrency = 2;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Stop and join the workers
+ */
+FSMExecutor::~FSMExecutor() {
+    CRASH_REPORT_BEGIN;
+	{
+		boost::unique_lock<boost::mutex> lock(execMutex);
+		stopping = true;
+	}
+	execCond.notify_all();
+	for (std::vector< boost::thread * >::iterator it = threads.begin(); it != threads.end(); ++it) {
+		(*it)->join();
+		delete *it;
+	}
+    CRASH_REPORT_END;
+}
+
+/**
+ * Get system-wide executor singleton
+ */
+FSMExecutorPtr FSMExecutor::Default() {
+    CRASH_REPORT_BEGIN;
+	boost::call_once( __initFSMExecutor, systemFSMExecutorOnce );
+	return systemFSMExecutor;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Schedule the next action of the given FSM
+ */
+void FSMExecutor::schedule( SimpleFSM * fsm ) {
+    CRASH_REPORT_BEGIN;
+	boost::unique_lock<boost::mutex> lock(execMutex);
+	if (stopping) return;
+
+	// If it's already queued or running, just let the
+	// worker know that it should run again
+	if (fsm->fsmxScheduled) {
+		fsm->fsmxPending = true;
+		return;
+	}
+
+	// Put it in the queue
+	fsm->fsmxScheduled = true;
+	queue.push_back( fsm );
+
+	// Start a new worker if everybody is busy and we are within limits
+	if ((numIdle == 0) && ((int)threads.size() < concurrency)) {
+		int index = (int)threads.size();
+		threads.push_back( new boost::thread( boost::bind( &FSMExecutor::workerLoop, this, index ) ) );
+	}
+
+	// Wake-up an idle worker
+	execCond.notify_one();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Remove the FSM from the executor
+ */
+void FSMExecutor::cancel( SimpleFSM * fsm ) {
+    CRASH_REPORT_BEGIN;
+	boost::unique_lock<boost::mutex> lock(execMutex);
+	fsm->fsmxPending = false;
+
+	// If it's queued, just remove it
+	if (fsm->fsmxWorker < 0) {
+		if (fsm->fsmxScheduled) queue.remove( fsm );
+		fsm->fsmxScheduled = false;
+		return;
+	}
+
+	// If we are called from within the action, it will
+	// not be scheduled again when it completes.
+	boost::thread * worker = threads[ fsm->fsmxWorker ];
+	if (worker->get_id() == boost::this_thread::get_id())
+		return;
+
+	// Interrupt it and wait for the action to complete
+	worker->interrupt();
+	while (fsm->fsmxWorker >= 0)
+		doneCond.wait(lock);
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Worker thread main loop
+ */
+void FSMExecutor::workerLoop( int index ) {
+    CRASH_REPORT_BEGIN;
+	for (;;) {
+		SimpleFSM * fsm;
+
+		// Wait for an FSM to run
+		{
+			boost::unique_lock<boost::mutex> lock(execMutex);
+			numIdle++;
+			while (queue.empty() && !stopping)
+				execCond.wait(lock);
+			numIdle--;
+			if (stopping) return;
+
+			// Pick the next FSM
+			fsm = queue.front();
+			queue.pop_front();
+			fsm->fsmxPending = false;
+			fsm->fsmxWorker = index;
+		}
+
+		// Run a single action
+		bool more = fsm->_fsmStep();
+
+		// Re-queue it at the end (so the other FSMs get their turn)
+		// if there is more to do, or release it.
+		{
+			boost::unique_lock<boost::mutex> lock(execMutex);
+			fsm->fsmxWorker = -1;
+			if ((more || fsm->fsmxPending) && !fsm->fsmtInterruptRequested && !stopping) {
+				fsm->fsmxPending = false;
+				queue.push_back( fsm );
+				execCond.notify_one();
+			} else {
+				fsm->fsmxScheduled = false;
+			}
+		}
+		doneCond.notify_all();
+
+		// Consume any interruption that was meant for the FSM we just run
+		try {
+			boost::this_thread::interruption_point();
+		} catch (boost::thread_interrupted &e) {
+		}
+
+	}
+    CRASH_REPORT_END;
+}
@@ -0,0 +1,260 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+#include <CernVM/SysExecPool.h>
+#include <CernVM/Hypervisor.h>
+
+using namespace std;
+
+SysExecPoolPtr      systemExecPool;
+boost::once_flag    systemExecPoolOnce = BOOST_ONCE_INIT;
+
+/**
+ * Allocate the system-wide pool
+ */
+void __initSysExecPool() {
+    systemExecPool = boost::make_shared< SysExecPool >();
+}
+
+/**
+ * Create a job
+ */
+SysExecJob::SysExecJob( const std::string& app, const std::string& cmdline, const SysExecConfig& config, const callbackSysExec& cb, const sysExecHandler& handler )
+    : result(0), stdoutList(), stderrMsg(""), app(app), cmdline(cmdline), config(config), callback(cb), handler(handler), completed(false), jobMutex(), jobCond() {
+    CRASH_REPORT_BEGIN;
+
+    // Every job has it's own cancellation token, which is
+    // also cancelled if the caller's token is cancelled.
+    if (config.token) {
+        this->config.setToken( config.token->createChild() );
+    } else {
+        this->config.setToken( boost::make_shared< SysExecToken >() );
+    }
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the job is completed
+ */
+bool SysExecJob::done() {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(jobMutex);
+    return completed;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Wait for the job to complete and return it's exit code
+ */
+int SysExecJob::wait() {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(jobMutex);
+    while (!completed) jobCond.wait(lock);
+    return result;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Wait for the job to complete up to the given time
+ */
+bool SysExecJob::waitFor( int timeout ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(jobMutex);
+    boost::system_time const deadline = boost::get_system_time() + boost::posix_time::milliseconds(timeout);
+    while (!completed) {
+        if (!jobCond.timed_wait(lock, deadline)) break;
+    }
+    return completed;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Cancel the job
+ */
+void SysExecJob::cancel() {
+    CRASH_REPORT_BEGIN;
+    config.token->cancel();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Run the job and notify the listeners
+ */
+void SysExecJob::run() {
+    CRASH_REPORT_BEGIN;
+    int res;
+    vector<string> lines;
+    string err;
+
+    // Run the command, unless we were cancelled while in the queue
+    if (config.isCancelled()) {
+        CVMWA_LOG("Debug", "Job cancelled before running: " << app << " " << cmdline);
+        err = "ERROR: Aborted";
+        res = 254;
+    } else {
+        res = sysExec( app, cmdline, &lines, &err, config, handler );
+    }
+
+    // Store results and notify waiters
+    {
+        boost::mutex::scoped_lock lock(jobMutex);
+        result = res;
+        stdoutList = lines;
+        stderrMsg = err;
+        completed = true;
+    }
+    jobCond.notify_all();
+
+    // Fire callback
+    if (callback) callback( res, lines, err );
+
+    CRASH_REPORT_END;
+}
+
+/**
+ * Create the pool (the workers are started on demand)
+ */
+SysExecPool::SysExecPool( int concurrency ) : concurrency(concurrency), numWorkers(0), numIdle(0), stopping(false), queue(), running(), workers(), poolMutex(), poolCond() {
+    CRASH_REPORT_BEGIN;
+    if (this->concurrency < 1) this->concurrency = 1;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Cancel everything and join the workers
+ */
+SysExecPool::~SysExecPool() {
+    CRASH_REPORT_BEGIN;
+    {
+        boost::mutex::scoped_lock lock(poolMutex);
+        stopping = true;
+    }
+    cancelAll();
+    poolCond.notify_all();
+    workers.join_all();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Get system-wide pool singleton
+ */
+SysExecPoolPtr SysExecPool::Default() {
+    CRASH_REPORT_BEGIN;
+    boost::call_once( __initSysExecPool, systemExecPoolOnce );
+    return systemExecPool;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Schedule a command for execution
+ */
+SysExecJobPtr SysExecPool::submit( const std::string& app, const std::string& cmdline, const SysExecConfig& config, const callbackSysExec& cb, const sysExecHandler& handler ) {
+    CRASH_REPORT_BEGIN;
+    SysExecJobPtr job = boost::make_shared< SysExecJob >( app, cmdline, config, cb, handler );
+    boost::mutex::scoped_lock lock(poolMutex);
+
+    // Put job in the queue
+    queue.push_back( job );
+
+    // Start a new worker if there are more queued jobs than idle workers to
+    // pick them and we are within limits (the idle workers are counted until
+    // they wake up, so a burst would otherwise go to a single one of them)
+    if ((queue.size() > (size_t) numIdle) && (numWorkers < concurrency)) {
+        numWorkers++;
+        workers.create_thread( boost::bind( &SysExecPool::workerLoop, this ) );
+    }
+
+    // Wake-up an idle worker
+    poolCond.notify_one();
+    return job;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Change the concurrency level
+ */
+void SysExecPool::setConcurrency( int concurrency ) {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(poolMutex);
+    if (concurrency < 1) concurrency = 1;
+    this->concurrency = concurrency;
+
+    // Let the surplus workers exit
+    poolCond.notify_all();
+    CRASH_REPORT_END;
+}
+
+/**
+ * Cancel all the queued and running jobs
+ */
+void SysExecPool::cancelAll() {
+    CRASH_REPORT_BEGIN;
+    list< SysExecJobPtr > jobs;
+    {
+        boost::mutex::scoped_lock lock(poolMutex);
+        jobs.insert( jobs.end(), queue.begin(), queue.end() );
+        jobs.insert( jobs.end(), running.begin(), running.end() );
+    }
+    for (list< SysExecJobPtr >::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        (*it)->cancel();
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Worker thread main loop
+ */
+void SysExecPool::workerLoop() {
+    CRASH_REPORT_BEGIN;
+    for (;;) {
+        SysExecJobPtr job;
+        {
+            boost::mutex::scoped_lock lock(poolMutex);
+
+            // Wait for a job
+            numIdle++;
+            while (queue.empty() && !stopping && (numWorkers <= concurrency))
+                poolCond.wait(lock);
+            numIdle--;
+
+            // Exit if we are stopping or if we are too many
+            if ((queue.empty() && stopping) || (numWorkers > concurrency)) {
+                numWorkers--;
+                return;
+            }
+
+            // Pick the next job
+            job = queue.front();
+            queue.pop_front();
+            running.push_back( job );
+        }
+
+        // Run it
+        job->run();
+
+        // Remove from the running jobs
+        {
+            boost::mutex::scoped_lock lock(poolMutex);
+            running.remove( job );
+        }
+    }
+    CRASH_REPORT_END;
+}
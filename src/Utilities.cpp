@@ -41,6 +41,26 @@
 #include <CernVM/Utilities.h>
 #include <CernVM/Hypervisor.h>
 
+#ifndef _WIN32
+#include <spawn.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// Pick the way posix_spawn can close the descriptors inherited from the parent
+#if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2,34)
+#define SYSEXEC_SPAWN_CLOSEFROM
+#endif
+#elif defined(__APPLE__) && defined(POSIX_SPAWN_CLOEXEC_DEFAULT)
+#define SYSEXEC_SPAWN_CLOEXEC_DEFAULT
+#endif
+
+#ifndef _WIN32
+extern char **environ;
+#endif
+
 using namespace std;
 namespace fs = boost::filesystem;
 
@@ -91,6 +111,7 @@ template int ston<int>( const std::string &Text );
 template unsigned int ston<unsigned int>( const std::string &Text );
 template long ston<long>( const std::string &Text );
 template size_t ston<size_t>( const std::string &Text );
+template long long ston<long long>( const std::string &Text );
 template double ston<double>( const std::string &Text );
 template float ston<float>( const std::string &Text );
 
@@ -98,6 +119,7 @@ template std::string ntos<int>( int &value );
 template std::string ntos<unsigned int>( unsigned int &value );
 template std::string ntos<long>( long &value );
 template std::string ntos<size_t>( size_t &value );
+template std::string ntos<long long>( long long &value );
 template std::string ntos<double>( double &value );
 template std::string ntos<float>( float &value );
 
@@ -142,6 +164,7 @@ SysExecConfig& SysExecConfig::operator=(const SysExecConfig& rhs) {
     timeout = rhs.timeout;
     gui = rhs.gui;
     errStrings = rhs.errStrings;
+    token = rhs.token;
 
     return *this;
 }
@@ -178,6 +201,136 @@ SysExecConfig& SysExecConfig::setGUI( bool gui ) {
     return *this;
 };
 
+/**
+ * Change the cancellation token and return this class reference
+ */
+SysExecConfig& SysExecConfig::setToken( const SysExecTokenPtr& token ) { 
+    this->token = token; 
+    return *this;
+};
+
+/**
+ * Check if the execution was cancelled through the token or globally
+ */
+bool SysExecConfig::isCancelled( ) const {
+    if (token && token->isCancelled()) return true;
+    return sysExecGlobalToken()->isCancelled();
+};
+
+/**
+ * Release the wake-up descriptors
+ */
+SysExecToken::~SysExecToken() {
+#ifndef _WIN32
+    if (wakeFd[0] >= 0) close(wakeFd[0]);
+    if (wakeFd[1] >= 0) close(wakeFd[1]);
+#endif
+}
+
+/**
+ * Cancel the token and all of it's children
+ */
+void SysExecToken::cancel() {
+    CRASH_REPORT_BEGIN;
+    std::vector< boost::weak_ptr< SysExecToken > > cancelChildren;
+    {
+        boost::mutex::scoped_lock lock(tokenMutex);
+        if (cancelled) return;
+        cancelled = true;
+        cancelChildren = children;
+        children.clear();
+
+#ifndef _WIN32
+        // Wake-up everyone blocked on our descriptor
+        if (wakeFd[1] >= 0) {
+            if (write( wakeFd[1], "C", 1 ) < 0) { };
+        }
+#endif
+    }
+
+    // Cancel children outside the lock
+    for (std::vector< boost::weak_ptr< SysExecToken > >::iterator it = cancelChildren.begin(); it != cancelChildren.end(); ++it) {
+        SysExecTokenPtr child = (*it).lock();
+        if (child) child->cancel();
+    }
+    CRASH_REPORT_END;
+}
+
+/**
+ * Reset the cancelled state
+ */
+void SysExecToken::reset() {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(tokenMutex);
+    cancelled = false;
+#ifndef _WIN32
+    // Drain the wake-up descriptor
+    if (wakeFd[0] >= 0) {
+        char buf[64];
+        while (read( wakeFd[0], buf, sizeof(buf) ) > 0) { };
+    }
+#endif
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the token is cancelled
+ */
+bool SysExecToken::isCancelled() {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(tokenMutex);
+    return cancelled;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Create a token that is cancelled when this token is cancelled
+ */
+SysExecTokenPtr SysExecToken::createChild() {
+    CRASH_REPORT_BEGIN;
+    SysExecTokenPtr child = boost::make_shared< SysExecToken >();
+    boost::mutex::scoped_lock lock(tokenMutex);
+    if (cancelled) {
+        child->cancelled = true;
+    } else {
+        // Forget the children that have gone away
+        for (std::vector< boost::weak_ptr< SysExecToken > >::iterator it = children.begin(); it != children.end(); ) {
+            if ((*it).expired()) {
+                it = children.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        children.push_back( child );
+    }
+    return child;
+    CRASH_REPORT_END;
+}
+
+#ifndef _WIN32
+/**
+ * Return a descriptor that becomes readable when the token is cancelled
+ */
+int __cloexecPipe( int fd[2] );
+int SysExecToken::descriptor() {
+    CRASH_REPORT_BEGIN;
+    boost::mutex::scoped_lock lock(tokenMutex);
+    if (wakeFd[0] < 0) {
+        if (__cloexecPipe( wakeFd ) < 0) {
+            wakeFd[0] = -1; wakeFd[1] = -1;
+            return -1;
+        }
+        fcntl( wakeFd[0], F_SETFL, O_NONBLOCK );
+        fcntl( wakeFd[1], F_SETFL, O_NONBLOCK );
+        if (cancelled) {
+            if (write( wakeFd[1], "C", 1 ) < 0) { };
+        }
+    }
+    return wakeFd[0];
+    CRASH_REPORT_END;
+}
+#endif
+
 
 /**
  * Release memory from the named mutexes already acquired
@@ -543,9 +696,9 @@ void splitLines( string rawString, vector<string> * out ) {
  * Split the given string into a vector of strings using white space as delimiter, while preserving
  * strin contents found in double quotes.
  */
-int splitArguments( std::string source, char ** charBuffer, int bufferSize, int bufferOffset ) {
+int splitArguments( std::string source, std::vector< std::string > * argsPtr ) {
     CRASH_REPORT_BEGIN;
-    static vector<string> args;
+    vector<string> & args = *argsPtr;
     size_t wsPos=0, sqPos=0, dqPos=0, qPos=0, iPos=0;
     string chunk; char nextChar = ' ';
 
@@ -619,29 +772,8 @@ int splitArguments( std::string source, char ** charBuffer, int bufferSize, int
 
     }
 
-    // Cast back to the charBuffer
-    int i = bufferOffset;
-    for (vector<string>::iterator it = args.begin(); it < args.end(); it++) {
-
-        // Check if we filled the buffer
-        if ((i+1) >= bufferSize) {
-            charBuffer[i] = (char*)NULL;
-            break;
-        }
-
-        /* CHECK: My guess is that since 'args' is static, the
-                  pointer to the buffer within the string will 
-                  be preserved even when the function exit. 
-                  Is it true? */
-        charBuffer[i++] = (char *)(*it).c_str();
-
-    }
-
-    // Put a null char on the end
-    charBuffer[i] = (char*)NULL;
-
-    // Return how many components were placed in the charBuffer
-    return i;
+    // Return how many arguments were found
+    return args.size();
 
     CRASH_REPORT_END;
 }
@@ -786,9 +918,58 @@ std::string getTmpFile( string suffix, string folder ) {
 }
 
 /**
- * Global variables shared with abortSysExec() and sysExec()
+ * The process-wide cancellation token, used by abortSysExec()
  */
-bool    sysExecAborted = false;
+SysExecTokenPtr     sysExecGlobal;
+boost::once_flag    sysExecGlobalOnce = BOOST_ONCE_INIT;
+
+/**
+ * Allocate the process-wide cancellation token
+ */
+void __initSysExecGlobal() {
+    sysExecGlobal = boost::make_shared< SysExecToken >();
+}
+
+/**
+ * Return the process-wide cancellation token
+ */
+SysExecTokenPtr sysExecGlobalToken() {
+    CRASH_REPORT_BEGIN;
+    boost::call_once( __initSysExecGlobal, sysExecGlobalOnce );
+    return sysExecGlobal;
+    CRASH_REPORT_END;
+}
+
+#ifndef _WIN32
+
+/**
+ * Close all the descriptors from the given one and above
+ */
+void closeDescriptorsFrom( int lowfd ) {
+#if defined(SYS_close_range)
+    if (syscall( SYS_close_range, (unsigned int)lowfd, ~0U, 0 ) == 0) return;
+#endif
+    int maxFD = getdtablesize();
+    for (int cfd=lowfd; cfd<maxFD; cfd++) {
+        close(cfd);
+    }
+}
+
+/**
+ * Create a pipe whose descriptors are not inherited by the child processes
+ */
+int __cloexecPipe( int fd[2] ) {
+#if defined(__linux__) && defined(O_CLOEXEC)
+    return pipe2( fd, O_CLOEXEC );
+#else
+    if (pipe(fd) < 0) return -1;
+    fcntl( fd[0], F_SETFD, FD_CLOEXEC );
+    fcntl( fd[1], F_SETFD, FD_CLOEXEC );
+    return 0;
+#endif
+}
+
+#endif
 
 /**
  * Global initialization to sysExec
@@ -796,7 +977,7 @@ bool    sysExecAborted = false;
 void initSysExec() {
     CRASH_REPORT_BEGIN;
     CVMWA_LOG("Debug", "Initializing sysExec()");
-    sysExecAborted = false;
+    sysExecGlobalToken()->reset();
     CRASH_REPORT_END;
 }
 
@@ -806,7 +987,7 @@ void initSysExec() {
 void abortSysExec() {
     CRASH_REPORT_BEGIN;
     CVMWA_LOG("Debug", "Aborting sysExec()");
-    sysExecAborted = true;
+    sysExecGlobalToken()->cancel();
     CRASH_REPORT_END;
 }
 
@@ -826,6 +1007,78 @@ int checkMatchingErrorCode( const std::string& buffer, const SysExecConfig& conf
     CRASH_REPORT_END;
 }
 
+#ifndef _WIN32
+
+/**
+ * Launch the given application, redirecting it's STDOUT and STDERR to the
+ * specified descriptors. Returns the PID of the child or -1 on error.
+ */
+pid_t __sysExecSpawn( const string& app, const string& cmdline, int outfd, int errfd ) {
+    CRASH_REPORT_BEGIN;
+
+    /* Split cmdline into string components. (This must be done
+       before spawning, since we cannot allocate memory afterwards) */
+    vector<string> args;
+    splitArguments( cmdline, &args );
+    vector<char *> parts;
+    parts.push_back( (char *)app.c_str() );
+    for (vector<string>::iterator it = args.begin(); it != args.end(); ++it)
+        parts.push_back( (char *)(*it).c_str() );
+    parts.push_back( (char *)NULL );
+
+#if defined(SYSEXEC_SPAWN_CLOSEFROM) || defined(SYSEXEC_SPAWN_CLOEXEC_DEFAULT)
+
+    /* Use posix_spawn that does not copy our page tables */
+    pid_t pidChild;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init( &actions );
+    posix_spawnattr_init( &attr );
+
+    /* Replace standard outs */
+    posix_spawn_file_actions_adddup2( &actions, outfd, 1 );
+    posix_spawn_file_actions_adddup2( &actions, errfd, 2 );
+
+    /* Do not leak any other debris from the parent */
+#if defined(SYSEXEC_SPAWN_CLOSEFROM)
+    posix_spawn_file_actions_addclosefrom_np( &actions, 3 );
+#else
+    posix_spawn_file_actions_addinherit_np( &actions, 0 );
+    posix_spawnattr_setflags( &attr, POSIX_SPAWN_CLOEXEC_DEFAULT );
+#endif
+
+    /* Launch given process */
+    int ret = posix_spawn( &pidChild, app.c_str(), &actions, &attr, &parts[0], environ );
+    posix_spawn_file_actions_destroy( &actions );
+    posix_spawnattr_destroy( &attr );
+    if (ret != 0) return -1;
+    return pidChild;
+
+#else
+
+    /* Fork to create child instance */
+    pid_t pidChild = fork();
+    if (pidChild != 0) return pidChild;
+
+    /* Replace standard outs */
+    if ((dup2(outfd, 1) < 0) || (dup2(errfd, 2) < 0))
+        _exit(254);
+
+    /* Close any other debris from the parent */
+    closeDescriptorsFrom( 3 );
+
+    /* Launch given process */
+    execv( app.c_str(), &parts[0] );
+
+    /* We reach this point if execv fails */
+    _exit(254);
+
+#endif
+    CRASH_REPORT_END;
+}
+
+#endif
+
 /**
  * Cross-platform exec and return function (called by sysExec())
  */
@@ -836,167 +1089,135 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
     
     int ret = 0;
     pid_t pidChild;
-    string item;
     string rawStdout = "";
     *rawStderr = "";
-    bool pipeHUP[2];
 
     /* Prepare the two pipes */
-    int outfd[2]; if (pipe(outfd) < 0) return HVE_IO_ERROR;
-    int errfd[2]; if (pipe(errfd) < 0) return HVE_IO_ERROR;
-
-    /* Fork to create child instance */
-    pidChild = fork();
-    if (pidChild == -1) {
-
-        /* Close pipes */
+    int outfd[2]; if (__cloexecPipe(outfd) < 0) return HVE_IO_ERROR;
+    int errfd[2]; if (__cloexecPipe(errfd) < 0) {
         close(outfd[0]); close(outfd[1]);
-        close(errfd[0]); close(errfd[1]);
+        return HVE_IO_ERROR;
+    }
 
-        /* Return error code if something went wrong */
-        return 254;
+    /* Spawn child process */
+    pidChild = __sysExecSpawn( app, cmdline, outfd[1], errfd[1] );
 
-    } else if(!pidChild) {
+    /* Close unused write end */
+    close(outfd[1]); close(errfd[1]);
 
-        /* Close unused read end */
+    /* Return error code if something went wrong */
+    if (pidChild == -1) {
         close(outfd[0]); close(errfd[0]);
+        return 254;
+    }
 
-        /* Close standard outs */
-        close(1); close(2);
-
-        /* Replace standard outs */
-        if (dup2(outfd[1], 1) < 0) {
-            close(outfd[1]); close(errfd[1]);
-            return HVE_IO_ERROR;
-        }
-        if (dup2(errfd[1], 2) < 0) {
-            close(outfd[1]); close(errfd[1]);
-            return HVE_IO_ERROR;
-        }
-
-        /* Release the writing end */
-        close(outfd[1]); close(errfd[1]);
+    /* Get a descriptor that becomes readable when the child exits, so
+       we are not stuck if it's children keep our pipes open */
+    int pidFd = -1;
+#if defined(SYS_pidfd_open)
+    pidFd = syscall( SYS_pidfd_open, pidChild, 0 );
+#endif
 
-        /* Nasty way of closing any other debris from the parent */
-        int maxFD = getdtablesize();
-        for (int cfd=3; cfd<maxFD; cfd++) {
-            close(cfd);
-        }
+    /* Prepare the poll fd list. The cancellation tokens are
+       included so that we are woken-up when cancelled. */
+    struct pollfd fds[5];
+    fds[0].fd = outfd[0];            fds[0].events = POLLIN;
+    fds[1].fd = errfd[0];            fds[1].events = POLLIN;
+    fds[2].fd = pidFd;               fds[2].events = POLLIN;
+    fds[3].fd = sysExecGlobalToken()->descriptor();
+    fds[3].events = POLLIN;
+    fds[4].fd = config.token ? config.token->descriptor() : -1;
+    fds[4].events = POLLIN;
+
+    /* Start reading stdin/err until both pipes are hung-up */
+    char data[SYSEXEC_BUFFER_SIZE];
+    ssize_t dataLen;
+    bool childExited = false;
+    long startTime = getMillis();
+    while ((fds[0].fd >= 0) || (fds[1].fd >= 0)) {
 
-        /* Split cmdline into string components */
-        char *parts[512];
-        parts[0] = (char *)app.c_str();
-        splitArguments( cmdline, parts, 512, 1 );
-        
-        /* Launch given process */
-        execv(app.c_str(), parts);
+        /* Abort if it takes way too long */
+        long remaining = config.timeout - (getMillis() - startTime);
+        bool aborted = config.isCancelled();
+        if ( aborted || (remaining <= 0) ) {
 
-        /* We reach this point if execv fails */
-        return 254;
+            // Close pipes
+            close(outfd[0]); close(errfd[0]);
+            if (pidFd >= 0) close(pidFd);
 
-    } else {
+            // Kill process
+            kill( pidChild, SIGKILL );
 
-        char data[1024];
-        ssize_t dataLen;
-
-        /* Close unused write end */
-        close(outfd[1]); close(errfd[1]);
-
-        /* Prepare the poll fd list */
-        struct pollfd fds[2];
-        fds[0].fd = outfd[0]; fds[0].events = POLLIN;
-        fds[1].fd = errfd[0]; fds[1].events = POLLIN;
-
-        /* Start reading stdin/err */
-        long startTime = getMillis();
-        for (;;) {
-
-            /* Poll descriptors */
-            ret = poll(fds, 2, 50);
-            if (ret > 0) {
-                /* An event on one of the fds has occurred. */
-                for (int i=0; i<2; i++) {
-                    pipeHUP[i] = false;
-                    if (fds[i].revents & POLLIN) {
-                        // Data is available on fds[i]
-                        dataLen = read(fds[i].fd, data, sizeof(data)-1);
-                        if (dataLen > 0) {
-                            if (i == 0) {
-                                rawStdout.append(data, dataLen);
-                            } else {
-                                rawStderr->append(data, dataLen);
+            // Reap process
+            waitpid(pidChild, &ret, 0);
 
-#if defined(DEBUG) || defined(LOGGING) || defined(CRASH_REPORTING)
-                                /* Debug log stderror */
-                                CVMWA_LOG("Debug", "Exec STDERR: " << *rawStderr);
-#endif
-                            }
-                        } else {
-                            // Error while reading
-                            pipeHUP[i] = true;
-                        }
-                    } else if (fds[i].revents & POLLHUP) {
-                        // pipe hung-up.
-                        // Set ret to -1 to flag termination
-                        pipeHUP[i] = true;
-                    }
-                }
-                
-                // Wait all FDs to hung-up
-                if (pipeHUP[0] && pipeHUP[1])
-                    ret = -1;
-                
+            // Set stderror (just for the heck of it)
+            if (aborted) {
+                CVMWA_LOG("Debug", "Aborting execution");
+                *rawStderr = "ERROR: Aborted";
+                return 254;
+            } else {
+                CVMWA_LOG("Debug", "Timed out while waiting for response");
+                *rawStderr = "ERROR: Timed out";
+                return 255;
             }
 
-            /* Abort if it takes way too long */
-            if ( sysExecAborted || ((getMillis() - startTime) > config.timeout) ) {
-
-                // Close pipes
-                close(outfd[0]); close(errfd[0]);
-
-                // Kill process
-                kill( pidChild, SIGKILL );
+        }
 
-                // Reap process
-                waitpid(pidChild, &ret, 0);
+        /* Block until something happens. If the child has exited
+           we just collect whatever is left in the pipes. */
+        ret = poll(fds, 5, childExited ? 0 : (int)remaining);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if ((ret == 0) && childExited) 
+            break;
 
-                // Set stderror (just for the heck of it)
-                if (sysExecAborted) {
-                    CVMWA_LOG("Debug", "Aborting execution");
-                    *rawStderr = "ERROR: Aborted";
-                    return 254;
+        /* Handle stdout/stderr events */
+        for (int i=0; i<2; i++) {
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                dataLen = read(fds[i].fd, data, sizeof(data));
+                if (dataLen > 0) {
+                    if (i == 0) {
+                        rawStdout.append(data, dataLen);
+                    } else {
+                        rawStderr->append(data, dataLen);
+                    }
                 } else {
-                    CVMWA_LOG("Debug", "Timed out while waiting for response");
-                    *rawStderr = "ERROR: Timed out";
-                    return 255;
+                    // Pipe hung-up (poll ignores negative fds)
+                    fds[i].fd = -1;
                 }
-
             }
+        }
 
-            /* Exit on error */
-            if (ret < 0) 
-                break;
-                
-            /* CPU Idle delay */
-            sleepMs( SYSEXEC_SLEEP_DELAY - 50 );
-
+        /* The child has exited */
+        if (fds[2].revents & POLLIN) {
+            childExited = true;
+            fds[2].fd = -1;
         }
 
-        /* Split stdout lines */
-        splitLines( rawStdout, stdoutList );
+    }
 
-        /* Close pipes */
-        close(outfd[0]); close(errfd[0]);
+#if defined(DEBUG) || defined(LOGGING) || defined(CRASH_REPORTING)
+    /* Debug log stderror */
+    if (!rawStderr->empty())
+        CVMWA_LOG("Debug", "Exec STDERR: " << *rawStderr);
+#endif
 
-        /* Wait forked pid to exit */
-        waitpid(pidChild, &ret, 0);
+    /* Split stdout lines */
+    splitLines( rawStdout, stdoutList );
 
-        /* Otherwise, return the error code */
-        return ret;
-    }
+    /* Close pipes */
+    close(outfd[0]); close(errfd[0]);
+    if (pidFd >= 0) close(pidFd);
+
+    /* Wait forked pid to exit */
+    waitpid(pidChild, &ret, 0);
+
+    /* Otherwise, return the error code */
+    return ret;
 
-     /* Should not reach this point, but what the heck */
-     return ret;
 #else
 	HANDLE g_hChildStdOut_Rd = NULL;
 	HANDLE g_hChildStdOut_Wr = NULL;
@@ -1099,7 +1320,7 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
         }
         
         /* Check for abort */
-        if (sysExecAborted) {
+        if (config.isCancelled()) {
             CVMWA_LOG("Debug", "Aborting execution");
             *rawStderr = "ERROR: Aborted";
             ret = 255;
@@ -1144,7 +1365,7 @@ int __sysExec( string app, string cmdline, vector<string> * stdoutList, string *
             }
         
             /* Check for abort */
-            if (sysExecAborted) {
+            if (config.isCancelled()) {
                 CVMWA_LOG("Debug", "Aborting execution");
                 *rawStderr = "ERROR: Aborted";
                 ret = 255;
@@ -1211,6 +1432,15 @@ int sysExecAsync( string app, string cmdline ) {
  * Cross-platform exec function with retry functionality
  */
 int sysExec( const string& app, const string& cmdline, vector<string> * stdoutList, string * rawStderrAns, const SysExecConfig& config ) {
+    CRASH_REPORT_BEGIN;
+    return sysExec( app, cmdline, stdoutList, rawStderrAns, config, sysExecHandler() );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Exec function with retry functionality that delegates every attempt to the given handler
+ */
+int sysExec( const string& app, const string& cmdline, vector<string> * stdoutList, string * rawStderrAns, const SysExecConfig& config, const sysExecHandler& handler ) {
     CRASH_REPORT_BEGIN;
     string stdError;
     int res = 252, matchedRes = 0;
@@ -1220,7 +1450,7 @@ int sysExec( const string& app, const string& cmdline, vector<string> * stdoutLi
         return 252;
 
     // If we have already aborted, return
-    if (sysExecAborted) {
+    if (config.isCancelled()) {
         CVMWA_LOG("Debug", "Aborted request to run: " << app << " " << cmdline);
         return 255;
     }
@@ -1230,7 +1460,9 @@ int sysExec( const string& app, const string& cmdline, vector<string> * stdoutLi
         
         // Call the wrapper function
         CVMWA_LOG("Debug", "Executing: " << app << " " << cmdline);
-        res = __sysExec( app, cmdline, stdoutList, &stdError, config );
+        res = SYSEXEC_FALLBACK;
+        if (handler) res = handler( app, cmdline, stdoutList, &stdError, config );
+        if (res == SYSEXEC_FALLBACK) res = __sysExec( app, cmdline, stdoutList, &stdError, config );
         CVMWA_LOG("Debug", "Exec EXIT_CODE: " << res);
 
         // Check for known error codes
@@ -1246,7 +1478,7 @@ int sysExec( const string& app, const string& cmdline, vector<string> * stdoutLi
         }
 
         // If it was successful, or we were aborted, return now. No retries.
-        if ((res == 0) || (res == 255)) {
+        if ((res == 0) || (res == 255) || config.isCancelled()) {
             break;
         } else {
             // Wait and retry
@@ -1392,6 +1624,61 @@ int sha256_file( string path, string * checksum ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Start an incremental SHA256 signature
+ */
+SHA256Stream::SHA256Stream() : mdctx(NULL) {
+    CRASH_REPORT_BEGIN;
+    mdctx = EVP_MD_CTX_create();
+    EVP_DigestInit_ex( (EVP_MD_CTX*)mdctx, EVP_sha256(), NULL );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Release the signature context
+ */
+SHA256Stream::~SHA256Stream() {
+    CRASH_REPORT_BEGIN;
+    EVP_MD_CTX_destroy( (EVP_MD_CTX*)mdctx );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Restart the signature
+ */
+void SHA256Stream::reset() {
+    CRASH_REPORT_BEGIN;
+    EVP_DigestInit_ex( (EVP_MD_CTX*)mdctx, EVP_sha256(), NULL );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Hash the given data
+ */
+void SHA256Stream::update( const char * data, size_t len ) {
+    CRASH_REPORT_BEGIN;
+    EVP_DigestUpdate( (EVP_MD_CTX*)mdctx, data, len );
+    CRASH_REPORT_END;
+}
+
+/**
+ * Complete the signature and return it in hex
+ */
+std::string SHA256Stream::hexdigest() {
+    CRASH_REPORT_BEGIN;
+    unsigned int md_len;
+    unsigned char md_value[EVP_MAX_MD_SIZE];
+    EVP_DigestFinal_ex( (EVP_MD_CTX*)mdctx, md_value, &md_len );
+
+    // Convert to hex
+    std::ostringstream oss; oss << std::hex;
+    for(unsigned int i = 0; i < md_len; i++) {
+        oss << std::setfill('0') << std::setw(2) << (int)md_value[i];
+    }
+    return oss.str();
+    CRASH_REPORT_END;
+}
+
 /**
  * OpenSSL SHA256 on string buffer
  */
@@ -2068,6 +2355,112 @@ bool isSanitized( std::string * check, const char * chars ) {
     CRASH_REPORT_END;
 }
 
+/**
+ * Start decompressing to the given stream
+ */
+GZInflateStream::GZInflateStream( std::ostream * output ) : zstream(NULL), output(output), written(0), ended(false), failed(false) {
+    CRASH_REPORT_BEGIN;
+    z_stream * strm = new z_stream;
+    strm->zalloc = Z_NULL;
+    strm->zfree = Z_NULL;
+    strm->opaque = Z_NULL;
+    strm->next_in = Z_NULL;
+    strm->avail_in = 0;
+
+    // Expect a gzip header
+    if (inflateInit2( strm, 16 + MAX_WBITS ) != Z_OK) {
+        CVMWA_LOG("Error", "Unable to initialize zlib");
+        failed = true;
+    }
+    zstream = strm;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Release the zlib state
+ */
+GZInflateStream::~GZInflateStream() {
+    CRASH_REPORT_BEGIN;
+    z_stream * strm = (z_stream*)zstream;
+    inflateEnd( strm );
+    delete strm;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Decompress the next block of compressed data
+ */
+int GZInflateStream::update( const char * data, size_t len ) {
+    CRASH_REPORT_BEGIN;
+    if (failed) return HVE_IO_ERROR;
+    z_stream * strm = (z_stream*)zstream;
+    unsigned char buffer[GZ_BLOCK_SIZE];
+
+    strm->next_in = (Bytef *) data;
+    strm->avail_in = (uInt) len;
+    do {
+
+        // Inflate as much as fits in the buffer
+        strm->next_out = buffer;
+        strm->avail_out = GZ_BLOCK_SIZE;
+        int ret = inflate( strm, Z_NO_FLUSH );
+        if ((ret == Z_STREAM_ERROR) || (ret == Z_NEED_DICT) || (ret == Z_DATA_ERROR) || (ret == Z_MEM_ERROR)) {
+            CVMWA_LOG("Error", "GZError '" << (strm->msg ? strm->msg : "") << "'");
+            failed = true;
+            return HVE_IO_ERROR;
+        }
+
+        // Write block
+        size_t have = GZ_BLOCK_SIZE - strm->avail_out;
+        if (have > 0) {
+            output->write( (const char *) buffer, have );
+            written += have;
+            if (output->fail()) {
+                CVMWA_LOG("Error", "Unable to write the extracted data");
+                failed = true;
+                return HVE_IO_ERROR;
+            }
+        }
+
+        // Like gzread, continue with the next member of
+        // a concatenated gzip file
+        if (ret == Z_STREAM_END) {
+            ended = true;
+            if (strm->avail_in == 0) break;
+            inflateReset( strm );
+            ended = false;
+        } else if (ret == Z_BUF_ERROR) {
+            // Need more input
+            break;
+        }
+
+    } while ((strm->avail_in > 0) || (strm->avail_out == 0));
+
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * Check if the compressed data were complete
+ */
+int GZInflateStream::finish() {
+    CRASH_REPORT_BEGIN;
+    if (failed) return HVE_IO_ERROR;
+    if (!ended) {
+        CVMWA_LOG("Error", "The GZip stream was truncated");
+        return HVE_IO_ERROR;
+    }
+    return HVE_OK;
+    CRASH_REPORT_END;
+}
+
+/**
+ * The number of bytes extracted so far
+ */
+long long GZInflateStream::size() {
+    return written;
+}
+
 /**
  * Decompress a GZipped file from src and write it to dst
  */
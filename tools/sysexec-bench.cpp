@@ -0,0 +1,123 @@
+/**
+ * This file is part of CernVM Web API Plugin.
+ *
+ * CVMWebAPI is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CVMWebAPI is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CVMWebAPI. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Developed by Ioannis Charalampidis 2013
+ * Contact: <ioannis.charalampidis[at]cern.ch>
+ */
+
+/**
+ * Micro-benchmark for the per-command latency floor of sysExec().
+ *
+ * It runs a trivial command many times and reports the minimum, median,
+ * mean and 99th percentile of the time it took to execute it.
+ *
+ * Usage: sysexec-bench [count] [--channel] [app [cmdline]]
+ *
+ *  count       The number of commands to run (default 200)
+ *  --channel   Send the commands through an ExecChannel instead of forking
+ *  app         The binary to run (default /bin/true)
+ *  cmdline     The arguments to pass to it
+ */
+
+#include <CernVM/Utilities.h>
+#include <CernVM/ExecChannel.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+
+using namespace std;
+
+int main( int argc, char ** argv ) {
+
+    // Defaults
+    int count = 200;
+    bool useChannel = false;
+#ifdef _WIN32
+    string app = "C:\\Windows\\System32\\cmd.exe";
+    string cmdline = "/c exit 0";
+#else
+    string app = "/bin/true";
+    string cmdline = "";
+#endif
+
+    // Parse arguments
+    bool customApp = false;
+    for (int i=1; i<argc; i++) {
+        string arg = argv[i];
+        if (arg == "--channel") {
+            useChannel = true;
+        } else if (!customApp && (i == 1) && (atoi(argv[i]) > 0)) {
+            count = atoi(argv[i]);
+        } else if (!customApp) {
+            app = arg;
+            cmdline = "";
+            customApp = true;
+        } else {
+            if (!cmdline.empty()) cmdline += " ";
+            cmdline += arg;
+        }
+    }
+
+    // Prepare the channel if requested
+    ExecChannelPtr channel;
+    if (useChannel) channel = boost::make_shared< ExecChannel >( app );
+
+    // Warm-up (and validate the command)
+    vector<string> lines;
+    string err;
+    SysExecConfig config;
+    int ret = channel ? sysExec( app, cmdline, &lines, &err, config, boost::bind( &ExecChannel::execute, channel.get(), _1, _2, _3, _4, _5 ) )
+                      : sysExec( app, cmdline, &lines, &err, config );
+    if (ret != 0) {
+        fprintf( stderr, "Command '%s %s' failed with exit code %d\n", app.c_str(), cmdline.c_str(), ret );
+        return 1;
+    }
+
+    // Time every command
+    vector<double> samples;
+    samples.reserve( count );
+    for (int i=0; i<count; i++) {
+        boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+        if (channel) {
+            sysExec( app, cmdline, &lines, &err, config, boost::bind( &ExecChannel::execute, channel.get(), _1, _2, _3, _4, _5 ) );
+        } else {
+            sysExec( app, cmdline, &lines, &err, config );
+        }
+        boost::chrono::duration<double, boost::milli> elapsed = boost::chrono::steady_clock::now() - start;
+        samples.push_back( elapsed.count() );
+    }
+
+    // Calculate the statistics
+    sort( samples.begin(), samples.end() );
+    double total = 0;
+    for (vector<double>::iterator it = samples.begin(); it != samples.end(); ++it)
+        total += *it;
+
+    printf( "sysExec('%s %s') via %s, %d commands\n", app.c_str(), cmdline.c_str(), useChannel ? "exec channel" : "fork/exec", count );
+    printf( "  min    : %8.3f ms\n", samples.front() );
+    printf( "  median : %8.3f ms\n", samples[ samples.size() / 2 ] );
+    printf( "  mean   : %8.3f ms\n", total / samples.size() );
+    printf( "  p99    : %8.3f ms\n", samples[ (samples.size() * 99) / 100 ] );
+    printf( "  max    : %8.3f ms\n", samples.back() );
+
+    return 0;
+}